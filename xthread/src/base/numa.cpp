@@ -0,0 +1,90 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include "numa.h"
+
+namespace xthread
+{
+namespace base
+{
+static pthread_once_t numa_once = PTHREAD_ONCE_INIT;
+static int g_numa_node_num = 1;
+
+// 读取文件中的第一行, 格式为"0"或者"0-3"或者"0,2-3"
+static bool read_first_line(const char* path, char* buf, size_t size) {
+    FILE* fp = fopen(path, "r");
+    if (fp == NULL) {
+        return false;
+    }
+    const bool ok = (fgets(buf, static_cast<int>(size), fp) != NULL);
+    fclose(fp);
+    return ok;
+}
+
+// 返回列表中最大的数字, 没有数字时返回-1
+static int max_in_list(const char* list) {
+    int max = -1;
+    const char* p = list;
+    while (*p != '\0') {
+        char* end = NULL;
+        const long n = strtol(p, &end, 10);
+        if (end == p) {
+            ++p;
+            continue;
+        }
+        if (n > max) {
+            max = static_cast<int>(n);
+        }
+        p = end;
+    }
+    return max;
+}
+
+static void init_numa_node_num() {
+    char buf[256];
+    if (!read_first_line("/sys/devices/system/node/online", buf, sizeof(buf))) {
+        return;
+    }
+    const int max_node = max_in_list(buf);
+    if (max_node < 0) {
+        return;
+    }
+    g_numa_node_num = (max_node + 1 > MAX_NUMA_NODE_NUM ? MAX_NUMA_NODE_NUM : max_node + 1);
+}
+
+int numa_node_num() {
+    pthread_once(&numa_once, init_numa_node_num);
+    return g_numa_node_num;
+}
+
+int current_numa_node() {
+    const int nnode = numa_node_num();
+    if (nnode == 1) {
+        return 0;
+    }
+    unsigned cpu = 0;
+    unsigned node = 0;
+    if (syscall(SYS_getcpu, &cpu, &node, NULL) != 0) {
+        return 0;
+    }
+    return static_cast<int>(node % static_cast<unsigned>(nnode));
+}
+
+int numa_node_first_cpu(int node) {
+    char path[128];
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+    char buf[256];
+    if (!read_first_line(path, buf, sizeof(buf))) {
+        return -1;
+    }
+    char* end = NULL;
+    const long cpu = strtol(buf, &end, 10);
+    if (end == buf) {
+        return -1;
+    }
+    return static_cast<int>(cpu);
+}
+}
+}
@@ -0,0 +1,21 @@
+#ifndef XTHREAD_BASE_NUMA_H
+#define XTHREAD_BASE_NUMA_H
+
+namespace xthread
+{
+namespace base
+{
+// 支持的最大NUMA节点数量, 更大的节点号按照取模折叠
+static const int MAX_NUMA_NODE_NUM = 8;
+
+// 从/sys/devices/system/node/online读取的NUMA节点数量, 没有NUMA信息时为1
+int numa_node_num();
+
+// 当前线程正在运行的CPU所在的NUMA节点, 取值为[0, numa_node_num())
+int current_numa_node();
+
+// 节点node上的第一个CPU, 没有时返回-1
+int numa_node_first_cpu(int node);
+}
+}
+#endif
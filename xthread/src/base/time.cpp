@@ -0,0 +1,64 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include "time.h"
+
+namespace xthread
+{
+namespace base
+{
+namespace detail
+{
+int64_t invariant_tsc_freq = 0;
+uint64_t tsc_base = 0;
+int64_t tsc_base_ns = 0;
+
+static pthread_once_t tsc_once = PTHREAD_ONCE_INIT;
+
+// TSC的频率不随CPU频率变化, 并且在深度睡眠时不停止, 才能用来计算时间
+static bool cpu_has_invariant_tsc() {
+    FILE* fp = fopen("/proc/cpuinfo", "r");
+    if (fp == NULL) {
+        return false;
+    }
+    char line[4096];
+    bool constant_tsc = false;
+    bool nonstop_tsc = false;
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        if (strncmp(line, "flags", 5) == 0) {
+            constant_tsc = (strstr(line, " constant_tsc") != NULL);
+            nonstop_tsc = (strstr(line, " nonstop_tsc") != NULL);
+            break;
+        }
+    }
+    fclose(fp);
+    return constant_tsc && nonstop_tsc;
+}
+
+// 用CLOCK_MONOTONIC校准TSC的频率
+static void calibrate_tsc() {
+    if (rdtsc() == 0 || !cpu_has_invariant_tsc()) {
+        return;
+    }
+    const int64_t ns0 = monotonic_time_ns();
+    const uint64_t tsc0 = rdtsc();
+    timespec interval = {0, 10000000L};
+    nanosleep(&interval, NULL);
+    const int64_t ns1 = monotonic_time_ns();
+    const uint64_t tsc1 = rdtsc();
+    if (ns1 <= ns0 || tsc1 <= tsc0) {
+        return;
+    }
+    tsc_base = tsc1;
+    tsc_base_ns = ns1;
+    invariant_tsc_freq = static_cast<int64_t>(
+            static_cast<double>(tsc1 - tsc0) * 1000000000.0 / static_cast<double>(ns1 - ns0));
+}
+
+bool init_invariant_tsc() {
+    pthread_once(&tsc_once, calibrate_tsc);
+    return invariant_tsc_freq > 0;
+}
+}
+}
+}
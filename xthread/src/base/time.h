@@ -36,6 +36,66 @@ inline int64_t gettimeofday_ms() {
     return gettimeofday_us() / 1000;
 }
 
+// 不受NTP调整系统时间影响, 只用于计算时间间隔
+inline int64_t monotonic_time_ns() {
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return timespec_to_nanoseconds(now);
+}
+
+inline int64_t realtime_ns() {
+    timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return timespec_to_nanoseconds(now);
+}
+
+namespace detail
+{
+// 校准之后的TSC频率(每秒的tick数), CPU不支持恒定频率的TSC时为0
+extern int64_t invariant_tsc_freq;
+// 校准时的TSC和对应的monotonic_time_ns
+extern uint64_t tsc_base;
+extern int64_t tsc_base_ns;
+bool init_invariant_tsc();
+
+inline uint64_t rdtsc() {
+#if defined(__x86_64__) || defined(__i386__)
+    uint32_t lo = 0;
+    uint32_t hi = 0;
+    __asm__ __volatile__("rdtsc" : "=a"(lo), "=d"(hi));
+    return (static_cast<uint64_t>(hi) << 32) | lo;
+#else
+    return 0;
+#endif
+}
+
+// 把TSC读数换算为纳秒时间: base对应base_ns, freq为每秒的tick数.
+// 不同CPU之间的TSC可能略有偏差, 读到比base小的值时delta为负数, 不能按照无符号数计算
+inline int64_t tsc_to_ns(uint64_t tsc, uint64_t base, int64_t base_ns, int64_t freq) {
+    const int64_t delta = static_cast<int64_t>(tsc - base);
+    const int64_t sec = delta / freq;
+    const int64_t rem = delta - sec * freq;
+    return base_ns + sec * 1000000000L + rem * 1000000000L / freq;
+}
+}
+
+// 是否可以使用cpuwide_time_ns, 第一次调用时校准TSC频率(大约10ms)
+inline bool has_invariant_tsc() {
+    return detail::init_invariant_tsc();
+}
+
+/*
+ *  通过TSC计算的时间, 和monotonic_time_ns在同一个时间轴上, 不需要系统调用或者vDSO.
+ *  has_invariant_tsc()返回false时退化为monotonic_time_ns
+ */
+inline int64_t cpuwide_time_ns() {
+    const int64_t freq = detail::invariant_tsc_freq;
+    if (freq > 0) {
+        return detail::tsc_to_ns(detail::rdtsc(), detail::tsc_base, detail::tsc_base_ns, freq);
+    }
+    return monotonic_time_ns();
+}
+
 inline timespec ns2timespec(int64_t ns) {
     timespec ret = {0, 0};
     ret.tv_sec = ns / 1000000000L;
@@ -91,6 +151,14 @@ inline timespec seconds_from_now(int64_t seconds) {
     return nanoseconds_from_now(seconds * 1000000000L);
 }
 
+inline timespec milliseconds_from_now(int64_t milliseconds) {
+    return nanoseconds_from_now(milliseconds * 1000000L);
+}
+
+inline timespec microseconds_from_now(int64_t microseconds) {
+    return nanoseconds_from_now(microseconds * 1000L);
+}
+
 }
 }
 #endif
@@ -0,0 +1,87 @@
+#include <cstdio>
+#include "../common/obj_pool/object_pool.h"
+#include "../common/obj_pool/resource_pool_in.h"
+#include "../base/time.h"
+
+/*
+ *  每次分配/归还BATCH个对象, 比较逐个调用get_object/return_object和批量接口的开销
+ */
+
+struct Message {
+    char data[128];
+};
+
+const size_t BATCH = 64;
+const size_t NROUND = 200000;
+
+void bench_object_loop() {
+    Message* objs[BATCH];
+    int64_t start = xthread::base::monotonic_time_ns();
+    for (size_t r = 0; r < NROUND; ++r) {
+        for (size_t i = 0; i < BATCH; ++i) {
+            objs[i] = xthread::base::get_object<Message>();
+        }
+        for (size_t i = 0; i < BATCH; ++i) {
+            xthread::base::return_object<Message>(objs[i]);
+        }
+    }
+    int64_t elapsed = xthread::base::monotonic_time_ns() - start;
+    printf("%-30s : %6.2f ns/object\n", "get_object/return_object",
+           static_cast<double>(elapsed) / static_cast<double>(NROUND * BATCH));
+}
+
+void bench_object_batch() {
+    Message* objs[BATCH];
+    int64_t start = xthread::base::monotonic_time_ns();
+    for (size_t r = 0; r < NROUND; ++r) {
+        xthread::base::get_objects<Message>(objs, BATCH);
+        xthread::base::return_objects<Message>(objs, BATCH);
+    }
+    int64_t elapsed = xthread::base::monotonic_time_ns() - start;
+    printf("%-30s : %6.2f ns/object\n", "get_objects/return_objects",
+           static_cast<double>(elapsed) / static_cast<double>(NROUND * BATCH));
+}
+
+typedef xthread::base::ResourcePool<Message> MessagePool;
+
+void bench_resource_loop() {
+    xthread::base::ResourceId<Message> ids[BATCH];
+    MessagePool* pool = MessagePool::getInstance();
+    int64_t start = xthread::base::monotonic_time_ns();
+    for (size_t r = 0; r < NROUND; ++r) {
+        for (size_t i = 0; i < BATCH; ++i) {
+            pool->get_resource(&ids[i]);
+        }
+        for (size_t i = 0; i < BATCH; ++i) {
+            pool->return_resource(ids[i]);
+        }
+    }
+    int64_t elapsed = xthread::base::monotonic_time_ns() - start;
+    printf("%-30s : %6.2f ns/resource\n", "get_resource/return_resource",
+           static_cast<double>(elapsed) / static_cast<double>(NROUND * BATCH));
+}
+
+void bench_resource_batch() {
+    xthread::base::ResourceId<Message> ids[BATCH];
+    Message* ptrs[BATCH];
+    MessagePool* pool = MessagePool::getInstance();
+    int64_t start = xthread::base::monotonic_time_ns();
+    for (size_t r = 0; r < NROUND; ++r) {
+        pool->get_resources(ids, ptrs, BATCH);
+        pool->return_resources(ids, BATCH);
+    }
+    int64_t elapsed = xthread::base::monotonic_time_ns() - start;
+    printf("%-30s : %6.2f ns/resource\n", "get_resources/return_resources",
+           static_cast<double>(elapsed) / static_cast<double>(NROUND * BATCH));
+}
+
+int main() {
+    // 预热, 先分配好Block
+    bench_object_batch();
+    bench_object_loop();
+    bench_object_batch();
+    bench_resource_batch();
+    bench_resource_loop();
+    bench_resource_batch();
+    return 0;
+}
@@ -0,0 +1,107 @@
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include <pthread.h>
+#include <sched.h>
+#include "../common/obj_pool/object_pool.h"
+#include "../base/numa.h"
+#include "../base/time.h"
+
+/*
+ *  比较在节点0上的线程复用本节点释放的对象和其他节点释放的对象时, 写入对象的开销.
+ *  1. remote: 节点1上的线程分配并写入NOBJ个对象后释放, 节点0上的线程(本节点没有空闲对象)再分配并写入
+ *  2. local : 节点0上的线程释放自己的对象之后再分配并写入
+ *  只有一个NUMA节点时两个线程在同一个节点上, 两者的结果应该接近
+ */
+
+struct BenchObject {
+    char data[256];
+};
+
+const size_t NOBJ = 65536;
+const int NROUND = 8;
+
+void bind_to_node(int node) {
+    const int cpu = xthread::base::numa_node_first_cpu(node);
+    if (cpu < 0) {
+        return;
+    }
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+void alloc_objects(std::vector<BenchObject*>* objs) {
+    objs->resize(NOBJ);
+    for (size_t i = 0; i < NOBJ; ++i) {
+        (*objs)[i] = xthread::base::get_object<BenchObject>();
+    }
+}
+
+void return_objects(std::vector<BenchObject*>* objs) {
+    for (size_t i = 0; i < objs->size(); ++i) {
+        xthread::base::return_object<BenchObject>((*objs)[i]);
+    }
+    objs->clear();
+}
+
+// 返回每个对象的写入时间(ns)
+double touch_objects(const std::vector<BenchObject*>& objs, int c) {
+    int64_t start = xthread::base::monotonic_time_ns();
+    for (int r = 0; r < NROUND; ++r) {
+        for (size_t i = 0; i < objs.size(); ++i) {
+            memset(objs[i]->data, c + r, sizeof(objs[i]->data));
+        }
+    }
+    int64_t elapsed = xthread::base::monotonic_time_ns() - start;
+    return static_cast<double>(elapsed) / static_cast<double>(objs.size() * NROUND);
+}
+
+struct RemoteArg {
+    int node;
+};
+
+// 在remote节点上分配, 写入之后释放, 释放的FreeChunk属于remote节点
+void* remote_thread(void* arg) {
+    RemoteArg* ra = static_cast<RemoteArg*>(arg);
+    bind_to_node(ra->node);
+    std::vector<BenchObject*> objs;
+    alloc_objects(&objs);
+    touch_objects(objs, 1);
+    return_objects(&objs);
+    return NULL;
+}
+
+int main() {
+    const int nnode = xthread::base::numa_node_num();
+    const int remote_node = (nnode > 1 ? 1 : 0);
+    printf("numa nodes : %d, local node 0, remote node %d\n", nnode, remote_node);
+    bind_to_node(0);
+
+    // 先占住本节点的对象, 使本节点的FreeChunk栈为空
+    std::vector<BenchObject*> held;
+    alloc_objects(&held);
+    touch_objects(held, 0);
+
+    RemoteArg ra;
+    ra.node = remote_node;
+    pthread_t tid;
+    pthread_create(&tid, NULL, remote_thread, &ra);
+    pthread_join(tid, NULL);
+
+    std::vector<BenchObject*> objs;
+    alloc_objects(&objs);
+    const double remote_ns = touch_objects(objs, 2);
+
+    return_objects(&objs);
+    return_objects(&held);
+    alloc_objects(&objs);
+    const double local_ns = touch_objects(objs, 3);
+    return_objects(&objs);
+
+    printf("%-24s : %6.2f ns/object\n", "reuse remote objects", remote_ns);
+    printf("%-24s : %6.2f ns/object\n", "reuse local objects", local_ns);
+    printf("%s\n", xthread::base::get_pool_info<BenchObject>().c_str());
+    return 0;
+}
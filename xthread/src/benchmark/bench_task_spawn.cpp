@@ -0,0 +1,64 @@
+#include <cstdio>
+#include <vector>
+#include <atomic>
+#include <sched.h>
+#include "../common/task_control.h"
+#include "../common/task_group.h"
+#include "../base/time.h"
+
+/*
+ *  在task中创建大量不会挂起的小task, 比较不同栈类型下每个task的开销
+ */
+
+const size_t NTASK = 1000000;
+std::atomic<size_t> g_ndone(0);
+
+void* empty_task(void*) {
+    g_ndone.fetch_add(1, std::memory_order_relaxed);
+    return NULL;
+}
+
+struct SpawnArg {
+    xthread::TaskControl* control;
+    int stack_type;
+};
+
+void* spawner(void* arg) {
+    SpawnArg* sa = static_cast<SpawnArg*>(arg);
+    xthread::TaskId tid;
+    for (size_t i = 0; i < NTASK; ++i) {
+        sa->control->start_task(&tid, empty_task, NULL, sa->stack_type);
+    }
+    return NULL;
+}
+
+void bench(xthread::TaskControl* control, int stack_type, const char* name) {
+    g_ndone.store(0);
+    SpawnArg sa;
+    sa.control = control;
+    sa.stack_type = stack_type;
+    int64_t start = xthread::base::gettimeofday_us();
+    xthread::TaskId tid;
+    control->start_task(&tid, spawner, &sa);
+    xthread::TaskControl::join_task(tid);
+    while (g_ndone.load(std::memory_order_relaxed) != NTASK) {
+        sched_yield();
+    }
+    int64_t elapsed = xthread::base::gettimeofday_us() - start;
+    printf("%-20s : %8.1f ns/task\n", name,
+           static_cast<double>(elapsed) * 1000.0 / static_cast<double>(NTASK));
+}
+
+int main() {
+    xthread::TaskControl control;
+    if (control.init(1) != 0) {
+        return -1;
+    }
+    // 先各跑一轮预热栈缓存和对象池
+    bench(&control, xthread::StackType::STACK_TYPE_NORMAL, "warmup");
+    bench(&control, xthread::StackType::STACK_TYPE_NORMAL, "STACK_TYPE_NORMAL");
+    bench(&control, xthread::StackType::STACK_TYPE_SMALL, "STACK_TYPE_SMALL");
+    bench(&control, xthread::StackType::STACK_TYPE_PTHREAD, "STACK_TYPE_PTHREAD");
+    control.stop_and_join();
+    return 0;
+}
@@ -0,0 +1,164 @@
+#include <cstdio>
+#include <vector>
+#include <atomic>
+#include <algorithm>
+#include <pthread.h>
+#include <unistd.h>
+#include "../common/timer_thread.h"
+#include "../base/time.h"
+
+/*
+ *  多个线程调度大量到期时间在[1, 1000]ms之间的Task, 再按照比例取消其中的一部分,
+ *  统计schedule/unschedule的吞吐以及Task执行时间比预期晚的分位数.
+ *  晚的时间同时由回调自己测量和TimerThread内置的直方图给出, 直方图的值是所在桶的上界
+ */
+
+const size_t NTHREAD = 4;
+const size_t NTASK_PER_THREAD = 250000;
+const size_t NTASK = NTHREAD * NTASK_PER_THREAD;
+const int64_t MAX_DELAY_NS = 1000000000;
+
+struct LatenessTask {
+    int64_t expected_ns;
+    int64_t lateness_ns;
+};
+
+std::atomic<size_t> g_nfired(0);
+
+void lateness_routine(void* arg) {
+    LatenessTask* task = static_cast<LatenessTask*>(arg);
+    task->lateness_ns = xthread::base::monotonic_time_ns() - task->expected_ns;
+    g_nfired.fetch_add(1, std::memory_order_relaxed);
+}
+
+struct SchedulerArg {
+    xthread::TimerThread* timer_thread;
+    LatenessTask* tasks;
+    xthread::TimerThread::TaskId* task_ids;
+    size_t index;
+    // 每1000个Task取消ncancel_per_mille个
+    size_t ncancel_per_mille;
+    int64_t schedule_ns;
+    int64_t unschedule_ns;
+    size_t ncancelled;
+};
+
+void* scheduler_thread(void* arg) {
+    SchedulerArg* sa = static_cast<SchedulerArg*>(arg);
+    uint64_t seed = 0x9E3779B97F4A7C15ULL * (sa->index + 1);
+    int64_t start = xthread::base::monotonic_time_ns();
+    for (size_t i = 0; i < NTASK_PER_THREAD; ++i) {
+        // xorshift
+        seed ^= seed << 13;
+        seed ^= seed >> 7;
+        seed ^= seed << 17;
+        const int64_t delay_ns = 1000000 + static_cast<int64_t>(seed % static_cast<uint64_t>(MAX_DELAY_NS));
+        LatenessTask* task = &sa->tasks[i];
+        task->expected_ns = xthread::base::monotonic_time_ns() + delay_ns;
+        task->lateness_ns = -1;
+        sa->task_ids[i] = sa->timer_thread->schedule_after(lateness_routine, task, delay_ns);
+    }
+    sa->schedule_ns = xthread::base::monotonic_time_ns() - start;
+
+    sa->ncancelled = 0;
+    size_t nunschedule = 0;
+    start = xthread::base::monotonic_time_ns();
+    for (size_t i = 0; i < NTASK_PER_THREAD; ++i) {
+        if (i % 1000 >= sa->ncancel_per_mille) {
+            continue;
+        }
+        ++nunschedule;
+        if (sa->timer_thread->unschedule(sa->task_ids[i]) == 0) {
+            ++sa->ncancelled;
+        }
+    }
+    const int64_t elapsed = xthread::base::monotonic_time_ns() - start;
+    sa->unschedule_ns = (nunschedule == 0 ? 0 : elapsed / static_cast<int64_t>(nunschedule));
+    return NULL;
+}
+
+int64_t percentile_us(const std::vector<int64_t>& sorted, double ratio) {
+    if (sorted.empty()) {
+        return 0;
+    }
+    size_t index = static_cast<size_t>(ratio * static_cast<double>(sorted.size()));
+    if (index >= sorted.size()) {
+        index = sorted.size() - 1;
+    }
+    return sorted[index] / 1000;
+}
+
+void bench(int engine, size_t ncancel_per_mille, const char* name) {
+    xthread::TimerThread timer_thread;
+    xthread::TimerThreadOptions options;
+    options.engine = engine;
+    if (timer_thread.start(&options) != 0) {
+        printf("start TimerThread failed\n");
+        return;
+    }
+    std::vector<LatenessTask> tasks(NTASK);
+    std::vector<xthread::TimerThread::TaskId> task_ids(NTASK);
+    g_nfired.store(0);
+
+    pthread_t th[NTHREAD];
+    SchedulerArg args[NTHREAD];
+    for (size_t i = 0; i < NTHREAD; ++i) {
+        args[i].timer_thread = &timer_thread;
+        args[i].tasks = &tasks[i * NTASK_PER_THREAD];
+        args[i].task_ids = &task_ids[i * NTASK_PER_THREAD];
+        args[i].index = i;
+        args[i].ncancel_per_mille = ncancel_per_mille;
+        pthread_create(&th[i], NULL, scheduler_thread, &args[i]);
+    }
+    int64_t schedule_ns = 0;
+    int64_t unschedule_ns = 0;
+    size_t ncancelled = 0;
+    for (size_t i = 0; i < NTHREAD; ++i) {
+        pthread_join(th[i], NULL);
+        schedule_ns += args[i].schedule_ns;
+        unschedule_ns += args[i].unschedule_ns;
+        ncancelled += args[i].ncancelled;
+    }
+
+    xthread::TimerThreadStats stats;
+    timer_thread.get_stats(&stats);
+    const int64_t queue_depth = stats.queue_depth;
+    while (g_nfired.load(std::memory_order_relaxed) + ncancelled < NTASK) {
+        usleep(10000);
+    }
+    timer_thread.get_stats(&stats);
+    timer_thread.stop_and_join();
+
+    std::vector<int64_t> lateness;
+    lateness.reserve(NTASK - ncancelled);
+    for (size_t i = 0; i < NTASK; ++i) {
+        if (tasks[i].lateness_ns >= 0) {
+            lateness.push_back(tasks[i].lateness_ns);
+        }
+    }
+    std::sort(lateness.begin(), lateness.end());
+
+    printf("%-24s : schedule %6.1f ns/op, unschedule %6.1f ns/op, cancelled %7zu, queue depth %7lld\n",
+           name,
+           static_cast<double>(schedule_ns) / static_cast<double>(NTASK),
+           static_cast<double>(unschedule_ns) / static_cast<double>(NTHREAD),
+           ncancelled, static_cast<long long>(queue_depth));
+    printf("%-24s   lateness(us) p50 %6lld p99 %6lld p999 %6lld, histogram p50 <%lld p99 <%lld p999 <%lld\n",
+           "",
+           static_cast<long long>(percentile_us(lateness, 0.5)),
+           static_cast<long long>(percentile_us(lateness, 0.99)),
+           static_cast<long long>(percentile_us(lateness, 0.999)),
+           static_cast<long long>(stats.lateness_percentile_us(0.5)),
+           static_cast<long long>(stats.lateness_percentile_us(0.99)),
+           static_cast<long long>(stats.lateness_percentile_us(0.999)));
+}
+
+int main() {
+    bench(xthread::TimerThreadOptions::ENGINE_HEAP, 0, "heap cancel 0%");
+    bench(xthread::TimerThreadOptions::ENGINE_HEAP, 500, "heap cancel 50%");
+    bench(xthread::TimerThreadOptions::ENGINE_HEAP, 900, "heap cancel 90%");
+    bench(xthread::TimerThreadOptions::ENGINE_TIMING_WHEEL, 0, "timing wheel cancel 0%");
+    bench(xthread::TimerThreadOptions::ENGINE_TIMING_WHEEL, 500, "timing wheel cancel 50%");
+    bench(xthread::TimerThreadOptions::ENGINE_TIMING_WHEEL, 900, "timing wheel cancel 90%");
+    return 0;
+}
@@ -0,0 +1,100 @@
+#include <cstdio>
+#include <atomic>
+#include <pthread.h>
+#include "../common/work_stealing_queue.h"
+#include "../common/macros.h"
+#include "../base/time.h"
+
+/*
+ *  1. 单个拥有者push/pop的延迟
+ *  2. 多个线程持续偷取时拥有者push/pop的延迟
+ */
+
+typedef size_t value_type;
+const size_t NOPS = 10000000;
+const size_t NTHIEF = 3;
+std::atomic<bool> g_stop(false);
+std::atomic<size_t> g_nstolen(0);
+
+template <typename Queue>
+void bench_owner_only(Queue* q, const char* name) {
+    value_type val = 0;
+    size_t sum = 0;
+    int64_t start = xthread::base::gettimeofday_us();
+    for (size_t i = 0; i < NOPS; ++i) {
+        q->push(i);
+        q->push(i);
+        q->pop(&val);
+        sum += val;
+        q->pop(&val);
+        sum += val;
+    }
+    int64_t elapsed = xthread::base::gettimeofday_us() - start;
+    printf("%-28s owner only      : %6.2f ns/op (sum=%zu)\n", name,
+           static_cast<double>(elapsed) * 1000.0 / static_cast<double>(NOPS * 4), sum);
+}
+
+template <typename Queue>
+void* thief_thread(void* arg) {
+    Queue* q = static_cast<Queue*>(arg);
+    value_type vals[16];
+    size_t nstolen = 0;
+    while (!g_stop.load(std::memory_order_relaxed)) {
+        size_t n = q->steal_batch(vals, ARRAY_SIZE(vals));
+        if (n == 0) {
+            asm volatile("pause\n": : :"memory");
+        }
+        nstolen += n;
+    }
+    g_nstolen.fetch_add(nstolen);
+    return NULL;
+}
+
+template <typename Queue>
+void bench_steal_pressure(Queue* q, const char* name) {
+    g_stop.store(false);
+    g_nstolen.store(0);
+    pthread_t th[NTHIEF];
+    for (size_t i = 0; i < NTHIEF; ++i) {
+        pthread_create(&th[i], NULL, thief_thread<Queue>, q);
+    }
+    value_type val = 0;
+    size_t npopped = 0;
+    int64_t start = xthread::base::gettimeofday_us();
+    for (size_t i = 0; i < NOPS; ++i) {
+        q->push(i);
+        q->push(i);
+        npopped += q->pop(&val);
+        npopped += q->pop(&val);
+    }
+    int64_t elapsed = xthread::base::gettimeofday_us() - start;
+    g_stop.store(true);
+    for (size_t i = 0; i < NTHIEF; ++i) {
+        pthread_join(th[i], NULL);
+    }
+    while (q->pop(&val)) {
+    }
+    printf("%-28s %zu thieves      : %6.2f ns/op popped=%zu stolen=%zu\n", name, NTHIEF,
+           static_cast<double>(elapsed) * 1000.0 / static_cast<double>(NOPS * 4),
+           npopped, g_nstolen.load());
+}
+
+int main() {
+    xthread::WorkStealingQueue<value_type>* dq = new xthread::WorkStealingQueue<value_type>;
+    dq->init(1024);
+    bench_owner_only(dq, "WorkStealingQueue");
+    bench_steal_pressure(dq, "WorkStealingQueue");
+    delete dq;
+
+    xthread::WorkStealingQueue<value_type>* gq = new xthread::WorkStealingQueue<value_type>;
+    gq->init(1024, true);
+    bench_owner_only(gq, "WorkStealingQueue(growable)");
+    bench_steal_pressure(gq, "WorkStealingQueue(growable)");
+    delete gq;
+
+    xthread::FixedWorkStealingQueue<value_type, 1024>* fq = new xthread::FixedWorkStealingQueue<value_type, 1024>;
+    bench_owner_only(fq, "FixedWorkStealingQueue<1024>");
+    bench_steal_pressure(fq, "FixedWorkStealingQueue<1024>");
+    delete fq;
+    return 0;
+}
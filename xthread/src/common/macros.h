@@ -4,6 +4,10 @@
 #define likely(x) __builtin_expect(!!(x), 1)
 #define unlikely(x) __builtin_expect(!!(x), 0)
 
+#define XTHREAD_CACHELINE_SIZE 64
+
+#define cpu_relax() asm volatile("pause\n": : :"memory")
+
 namespace xthread
 {
 namespace base
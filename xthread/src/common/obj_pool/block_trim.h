@@ -0,0 +1,80 @@
+#ifndef XTHREAD_COMMON_OBJ_POOL_BLOCK_TRIM_H
+#define XTHREAD_COMMON_OBJ_POOL_BLOCK_TRIM_H
+#include <cstddef>
+#include <stdint.h>
+#include <atomic>
+#include <sched.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "../../base/time.h"
+namespace xthread
+{
+    namespace base
+    {
+        namespace detail
+        {
+            /*
+             *  开启trim时每个Block用一个计数记录正在使用的对象数量, 高位记录trim的状态:
+             *  BLOCK_TRIMMING: trim正在释放这个Block的内存, 分配到其中对象的线程要等它结束;
+             *  BLOCK_TRIMMED : 内存已经释放, 之后再被使用时清除
+             */
+            static const size_t BLOCK_TRIMMING = static_cast<size_t>(1) << 62;
+            static const size_t BLOCK_TRIMMED = static_cast<size_t>(1) << 61;
+            static const size_t BLOCK_LIVE_MASK = BLOCK_TRIMMED - 1;
+            // 两次自动trim之间的最小间隔, 归还对象的线程不会频繁地扫描所有的Block
+            static const int64_t AUTO_TRIM_INTERVAL_NS = 100 * 1000000L;
+
+            // 不小于n的最小的2的幂
+            constexpr size_t round_up_block_align(size_t n, size_t align = 1) {
+                return align >= n ? align : round_up_block_align(n, align << 1);
+            }
+
+            // 在Block中的对象构造之前调用
+            inline void acquire_block_item(std::atomic<size_t>* nlive) {
+                size_t cur = nlive->fetch_add(1, std::memory_order_acquire) + 1;
+                while (cur & BLOCK_TRIMMING) {
+                    sched_yield();
+                    cur = nlive->load(std::memory_order_acquire);
+                }
+                // 等待的trim结束时才设置TRIMMED, 所以在等待之后检查. 持有计数时不会有新的trim开始
+                if (cur & BLOCK_TRIMMED) {
+                    nlive->fetch_and(~BLOCK_TRIMMED, std::memory_order_relaxed);
+                }
+            }
+
+            // 在Block中的对象析构之后调用, Block中的对象全部空闲时返回true
+            inline bool release_block_item(std::atomic<size_t>* nlive) {
+                return (nlive->fetch_sub(1, std::memory_order_release) & BLOCK_LIVE_MASK) == 1;
+            }
+
+            // Block中没有正在使用的对象时, 把[begin, begin + len)中完整的页还给操作系统, 至少释放了一页时返回true.
+            // 地址空间保留, 之后再次访问时重新分配为零页
+            inline bool trim_block(std::atomic<size_t>* nlive, char* begin, size_t len) {
+                size_t expected = 0;
+                if (!nlive->compare_exchange_strong(expected, BLOCK_TRIMMING, std::memory_order_acquire)) {
+                    return false;
+                }
+                const uintptr_t page_size = static_cast<uintptr_t>(sysconf(_SC_PAGESIZE));
+                const uintptr_t first = (reinterpret_cast<uintptr_t>(begin) + page_size - 1) & ~(page_size - 1);
+                const uintptr_t last = (reinterpret_cast<uintptr_t>(begin) + len) & ~(page_size - 1);
+                if (first >= last || madvise(reinterpret_cast<void*>(first), last - first, MADV_DONTNEED) != 0) {
+                    // 没有完整的页可以释放, 只清除TRIMMING
+                    nlive->fetch_sub(BLOCK_TRIMMING, std::memory_order_release);
+                    return false;
+                }
+                // 清除TRIMMING并设置TRIMMED, 保留期间其他线程增加的计数
+                nlive->fetch_add(BLOCK_TRIMMED - BLOCK_TRIMMING, std::memory_order_release);
+                return true;
+            }
+
+            // 距离上一次自动trim超过AUTO_TRIM_INTERVAL_NS时返回true, 同一时刻只有一个线程返回true
+            inline bool try_begin_auto_trim(std::atomic<int64_t>* next_trim_ns) {
+                const int64_t now = monotonic_time_ns();
+                int64_t next = next_trim_ns->load(std::memory_order_relaxed);
+                return now >= next && next_trim_ns->compare_exchange_strong(next, now + AUTO_TRIM_INTERVAL_NS,
+                        std::memory_order_relaxed);
+            }
+        }
+    }
+}
+#endif
@@ -0,0 +1,76 @@
+#ifndef XTHREAD_COMMON_OBJ_POOL_FREE_CHUNK_STACK_H
+#define XTHREAD_COMMON_OBJ_POOL_FREE_CHUNK_STACK_H
+#include <cstddef>
+#include <stdint.h>
+#include <atomic>
+#include "../../base/noncopyable.h"
+namespace xthread
+{
+    namespace base
+    {
+        /*
+         *  FreeChunk组成的无锁栈(Treiber stack), Node需要有std::atomic<Node*> next成员.
+         *  栈顶的低48位为节点地址, 高16位为每次修改加一的版本号, 防止ABA.
+         *  pop可能读到已经被其他线程取走的节点的next, 所以节点在栈的生命周期内不能释放
+         */
+        template <typename Node>
+            class FreeChunkStack : NonCopyable {
+                public:
+                    FreeChunkStack() : head_(0), size_(0) {}
+
+                    void push(Node* node) {
+                        uint64_t head = head_.load(std::memory_order_relaxed);
+                        do {
+                            node->next.store(to_node(head), std::memory_order_relaxed);
+                        } while (!head_.compare_exchange_weak(head, make_head(node, head),
+                                    std::memory_order_release, std::memory_order_relaxed));
+                        size_.fetch_add(1, std::memory_order_relaxed);
+                    }
+
+                    // 为空时返回NULL
+                    Node* pop() {
+                        uint64_t head = head_.load(std::memory_order_acquire);
+                        while (true) {
+                            Node* node = to_node(head);
+                            if (node == NULL) {
+                                return NULL;
+                            }
+                            Node* next = node->next.load(std::memory_order_relaxed);
+                            if (head_.compare_exchange_weak(head, make_head(next, head),
+                                        std::memory_order_acquire, std::memory_order_acquire)) {
+                                size_.fetch_sub(1, std::memory_order_relaxed);
+                                return node;
+                            }
+                        }
+                    }
+
+                    bool empty() const {
+                        return to_node(head_.load(std::memory_order_relaxed)) == NULL;
+                    }
+
+                    // 近似值, 只用于统计
+                    size_t size() const {
+                        const int64_t n = size_.load(std::memory_order_relaxed);
+                        return static_cast<size_t>(n < 0 ? 0 : n);
+                    }
+
+                private:
+                    static const int TAG_SHIFT = 48;
+                    static const uint64_t POINTER_MASK = (static_cast<uint64_t>(1) << TAG_SHIFT) - 1;
+
+                    static Node* to_node(uint64_t head) {
+                        return reinterpret_cast<Node*>(head & POINTER_MASK);
+                    }
+
+                    static uint64_t make_head(Node* node, uint64_t old_head) {
+                        const uint64_t tag = (old_head >> TAG_SHIFT) + 1;
+                        return (tag << TAG_SHIFT) | reinterpret_cast<uintptr_t>(node);
+                    }
+
+                private:
+                    std::atomic<uint64_t> head_;
+                    std::atomic<int64_t> size_;
+            };
+    }
+}
+#endif
@@ -1,29 +1,33 @@
 #ifndef XTHREAD_COMMON_OBJECT_POOL_MACROS_DEFINES_H
 #define XTHREAD_COMMON_OBJECT_POOL_MACROS_DEFINES_H
-#define GET_RESOURCE(CTOR_ARGS) \
-    if (local_free_.nitems > 0) {   \
-        *id = local_free_.items[--local_free_.nitems];    \
+#define GET_RESOURCE(CTOR_ARGS, HAS_ARGS) \
+    if (local_free_->nitems > 0 || pool_->pop_free_chunk(local_free_)) { \
+        *id = local_free_->items[--local_free_->nitems];  \
         T* ptr = get_addr_by_id_safe(*id);                \
+        if (ResourcePoolTrimPolicy<T>::ENABLE) {          \
+            /* 开启trim时空闲的资源已经析构 */            \
+            detail::acquire_block_item(&block_of_id(*id)->nlive);  \
+            new (ptr) T CTOR_ARGS;                        \
+        }                                                 \
+        else if (HAS_ARGS) {                              \
+            /* 复用的资源没有析构, 用参数重新构造 */      \
+            ptr->~T();                                    \
+            new (ptr) T CTOR_ARGS;                        \
+        }                                                 \
         return ptr;                                       \
     }                                                     \
-    else if (pool_->pop_free_chunk(local_free_)) {        \
-        *id = local_free_.items[--local_free_.nitems];    \
-        T* ptr = get_addr_by_id_safe(*id);                \
-        return ptr;                                       \
+    if (!local_block_ || local_block_->nitems >= ResourcePoolConfig<T>::RESOURCE_POOL_BLOCK_ITEM_NUM) { \
+        local_block_ = pool_->getBlock(&local_block_index_); \
+        if (!local_block_) {                              \
+            return NULL;                                  \
+        }                                                 \
     }                                                     \
-    if (local_block_ && local_block_->nitems < ResourcePoolConfig<T>::RESOURCE_POOL_BLOCK_ITEM_NUM) {  \
-        id->value = local_block_index_ * BLOCK_ITEM_NUM + local_block_->nitems;  \
-        T* ptr = new (reinterpret_cast<T*>(local_block_->items) + local_block_->nitems) T CTOR_ARGS;   \
-        local_block_->nitems++;                            \
-        return ptr;                                       \
-    }                                                     \
-    local_block_ = pool_->getBlock(&local_block_index_); \
-    if (local_block_ && local_block_->nitems < ResourcePoolConfig<T>::RESOURCE_POOL_BLOCK_ITEM_NUM) { \
-        id->value = local_block_index_ * BLOCK_ITEM_NUM + local_block_->nitems;  \
-        T* ptr = new (reinterpret_cast<T*>(local_block_->items) +  local_block_->nitems) T CTOR_ARGS;   \
-        local_block_->nitems++;                            \
-        return ptr;                                       \
+    if (ResourcePoolTrimPolicy<T>::ENABLE) {              \
+        detail::acquire_block_item(&local_block_->nlive); \
     }                                                     \
-    return NULL;
+    id->value = local_block_index_ * BLOCK_ITEM_NUM + local_block_->nitems;  \
+    T* ptr = new (reinterpret_cast<T*>(local_block_->items) + local_block_->nitems) T CTOR_ARGS;   \
+    local_block_->nitems++;                               \
+    return ptr;
 
 #endif
@@ -10,14 +10,10 @@ inline T* get_object() {
     return ObjectPool<T>::getInstance()->get_object();
 }
 
-template <typename T, typename A1>
-inline T* get_object(const A1& a1) {
-    return ObjectPool<T>::getInstance()->get_object(a1);
-}
-
-template <typename T, typename A1, typename A2>
-inline T* get_object(const A1& a1, const A2& a2) {
-    return ObjectPool<T>::getInstance()->get_object(a1, a2);
+// 参数完美转发给T的构造函数, 复用的空闲对象也会先析构再用参数构造
+template <typename T, typename... Args>
+inline T* get_object(Args&&... args) {
+    return ObjectPool<T>::getInstance()->get_object(std::forward<Args>(args)...);
 }
 
 template <typename T>
@@ -25,6 +21,23 @@ inline int return_object(T* obj) {
     return ObjectPool<T>::getInstance()->return_object(obj);
 }
 
+// 批量分配最多n个对象, 返回分配到的数量
+template <typename T>
+inline size_t get_objects(T** out, size_t n) {
+    return ObjectPool<T>::getInstance()->get_objects(out, n);
+}
+
+template <typename T>
+inline int return_objects(T* const* objs, size_t n) {
+    return ObjectPool<T>::getInstance()->return_objects(objs, n);
+}
+
+// 开启ObjectPoolTrimPolicy<T>时把全部空闲的Block的内存还给操作系统, 返回释放的Block数量
+template <typename T>
+inline size_t trim_objects() {
+    return ObjectPool<T>::getInstance()->trim();
+}
+
 template <typename T>
 inline void clear_objects() {
     return ObjectPool<T>::getInstance()->clear_objects();
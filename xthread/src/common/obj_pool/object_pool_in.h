@@ -1,14 +1,21 @@
 #ifndef XTHREAD_COMMON_OBJECT_POOL_IN_H
 #define XTHREAD_COMMON_OBJECT_POOL_IN_H
 #include <cstddef>
+#include <cstdlib>
 #include <atomic>
 #include <vector>
+#include <algorithm>
 #include <cstdio>
+#include <cstring>
 #include <string>
+#include <utility>
 #include "../../base/lock.h"
 #include "../../base/lock_guard.h"
 #include "../../base/thread_exit_helper.h"
+#include "../../base/numa.h"
 #include "object_pool_config.h"
+#include "free_chunk_stack.h"
+#include "block_trim.h"
 #include "../macros.h"
 
 namespace xthread
@@ -22,6 +29,14 @@ namespace xthread
         template <typename T> struct ObjectPoolValidator {
             static bool validate(const T*) { return true; }
         };
+
+        // ENABLE为true时归还的对象立即析构, 分配时重新构造, 对象全部空闲的Block可以通过trim()
+        // 把内存还给操作系统. TRIM_IDLE_BLOCK_NUM不为0时, 每有这么多个Block变为全部空闲就自动trim一次,
+        // 两次自动trim之间至少间隔detail::AUTO_TRIM_INTERVAL_NS
+        template <typename T> struct ObjectPoolTrimPolicy {
+            static const bool ENABLE = false;
+            static const size_t TRIM_IDLE_BLOCK_NUM = 0;
+        };
     }
 }
 
@@ -42,7 +57,10 @@ namespace xthread
         template <typename T, size_t NITEM>
         struct ObjectPoolFreeChunk {
             size_t nfree;
+            // 在全局的FreeChunkStack中时指向下一个FreeChunk
+            std::atomic<ObjectPoolFreeChunk*> next;
             T* ptrs[NITEM];
+            ObjectPoolFreeChunk() : nfree(0), next(NULL) {}
         };
 
         struct ObjectPoolInfo {
@@ -53,6 +71,8 @@ namespace xthread
             size_t block_item_num;
             size_t free_chunk_item_num;
             size_t total_size;
+            // 内存已经被trim释放的Block数量
+            size_t trimmed_block_num;
 #ifdef XTHREAD_OBJECT_POOL_NEED_FREE_ITEM_NUM
             size_t free_item_num;
 #endif
@@ -66,31 +86,47 @@ namespace xthread
                     static const size_t BLOCK_ITEM_NUM       = ObjectPoolConfig<T>::OBJECT_POOL_BLOCK_ITEM_NUM;
                     static const size_t FREE_LIST_INIT_SIZE  = ObjectPoolConfig<T>::OBJECT_POOL_FREE_LIST_INIT_SIZE;
                     static const size_t FREE_CHUNK_ITEM_NUM  = ObjectPoolConfig<T>::OBJECT_POOL_FREE_CHUNK_ITEM_NUM;
+                    // 其他NUMA节点积累的FreeChunk超过这个数量时才被复用, 限制只在一个节点上释放时占用的内存
+                    static const size_t REMOTE_REUSE_CHUNK_NUM = 4;
                     // 空闲的对象在进入全局空闲列表之前先放在这里
                     typedef ObjectPoolFreeChunk<T, FREE_CHUNK_ITEM_NUM> FreeChunk;
                 private:
-                    ObjectPool() {
+                    ObjectPool() : nnode_(numa_node_num()), nidle_blocks_(0), next_auto_trim_ns_(0) {
 
                     }
 
-                    bool pop_free_chunk(FreeChunk& c);
-                    bool push_free_chunk(const FreeChunk& c);
+                    // 用node上的一个非空FreeChunk替换c, c放回空的FreeChunk栈.
+                    // node上没有时, 只从积累了超过REMOTE_REUSE_CHUNK_NUM个FreeChunk的其他节点取
+                    bool pop_free_chunk(FreeChunk*& c, int node);
+                    // 把满的c放入node的FreeChunk栈, 换回一个空的FreeChunk
+                    bool push_free_chunk(FreeChunk*& c, int node);
+                    // 线程退出时归还LocalPool的FreeChunk
+                    void release_free_chunk(FreeChunk* c, int node);
+                    size_t free_chunk_num() const;
+                    FreeChunk* get_empty_chunk();
 
                 public:
 
                     // 每一个Block包含一个对象Item列表
                     struct Block {
                         size_t nitem;
+                        // 开启trim时正在使用的对象数量和trim的状态
+                        std::atomic<size_t> nlive;
                         char items[sizeof(T) * BLOCK_ITEM_NUM];
-                        Block() : nitem(0) {}
+                        Block() : nitem(0), nlive(0) {}
                     };
 
+                    // 开启trim时Block按照不小于自身大小的2的幂对齐, 通过对象的地址找到所在的Block
+                    static const size_t BLOCK_ALIGN = detail::round_up_block_align(sizeof(Block));
+
                     // 每一个BlockGroup包含一个Block指针数组
                     struct BlockGroup {
                         std::atomic<size_t> nblock;
                         std::atomic<Block*> blocks[GROUP_BLOCK_NUM];
                         BlockGroup() : nblock(0) {
-                            memset(blocks, 0, sizeof(std::atomic<Block*>) * GROUP_BLOCK_NUM);
+                            for (size_t i = 0; i < GROUP_BLOCK_NUM; ++i) {
+                                blocks[i].store(NULL, std::memory_order_relaxed);
+                            }
                         }
                     };
 
@@ -100,90 +136,184 @@ namespace xthread
                                 : pool_(pool)
                                   , cur_block_(NULL)
                                   , cur_block_index_(0)
+                                  , cur_free_(pool->get_empty_chunk())
+                                  , node_(current_numa_node())
                             {
-                                cur_free_.nfree = 0;
                             }
 
                             ~LocalPool() {
-                                if (cur_free_.nfree) {
-                                    pool_->push_free_chunk(cur_free_);
+                                if (cur_free_ == NULL) {
+                                    // 构造时没有拿到FreeChunk, 没有被注册
+                                    return;
                                 }
+                                pool_->release_free_chunk(cur_free_, node_);
                                 pool_->clear_local_pool();
                             }
 
+                            bool valid() const {
+                                return cur_free_ != NULL;
+                            }
+
 
                             static void deleteLocalPool(void* lp) {
                                 delete static_cast<LocalPool*>(lp);
                             }
 
 
-#define GET_OBJECT(CTOR_ARGS)                       \
-                            /* step1 : 从局部FreeChunks分配 */              \
-                            if (cur_free_.nfree) {                          \
-                                XTHREAD_OBJECT_POOL_FREE_ITEM_NUM_SUB1      \
-                                return cur_free_.ptrs[--cur_free_.nfree];   \
-                            }                                               \
-                            /* step2 : 从全局FreeChunk分配  */              \
-                            if (pool_->pop_free_chunk(cur_free_)) {         \
-                                XTHREAD_OBJECT_POOL_FREE_ITEM_NUM_SUB1      \
-                                return cur_free_.ptrs[--cur_free_.nfree];   \
-                            }                                               \
-                            /* step3 : 从本地block分配      */              \
-                            if (cur_block_ && cur_block_->nitem < BLOCK_ITEM_NUM) {                        \
-                                T* obj = new (reinterpret_cast<T*>(cur_block_->items) + cur_block_->nitem) T CTOR_ARGS;   \
+#define GET_OBJECT(CTOR_ARGS, HAS_ARGS)             \
+                            /* step1 : 从局部FreeChunk分配, 为空时从全局FreeChunk取 */                   \
+                            if (cur_free_->nfree || pool_->pop_free_chunk(cur_free_, node_)) {          \
+                                XTHREAD_OBJECT_POOL_FREE_ITEM_NUM_SUB1                                  \
+                                T* obj = cur_free_->ptrs[--cur_free_->nfree];                           \
+                                if (!ObjectPoolTrimPolicy<T>::ENABLE) {                                 \
+                                    if (HAS_ARGS) {                                                     \
+                                        /* 复用的对象没有析构, 有参数时析构之后用参数重新构造 */        \
+                                        obj->~T();                                                      \
+                                        new (obj) T CTOR_ARGS;                                          \
+                                        if (!ObjectPoolValidator<T>::validate(obj)) {                   \
+                                            cur_free_->ptrs[cur_free_->nfree++] = obj;                  \
+                                            return NULL;                                                \
+                                        }                                                               \
+                                    }                                                                   \
+                                    return obj;                                                         \
+                                }                                                                       \
+                                /* 开启trim时空闲的对象已经析构 */                                      \
+                                detail::acquire_block_item(&ObjectPool::block_of(obj)->nlive);          \
+                                new (obj) T CTOR_ARGS;                                                  \
                                 if (!ObjectPoolValidator<T>::validate(obj)) {                           \
                                     obj->~T();                                                          \
+                                    cur_free_->ptrs[cur_free_->nfree++] = obj;                          \
+                                    pool_->release_item(obj);                                           \
                                     return NULL;                                                        \
                                 }                                                                       \
-                                cur_block_->nitem++;                                                    \
                                 return obj;                                                             \
                             }                                                                           \
-                            /* step4: 获取新的Block */                                                  \
-                            cur_block_ = ObjectPool::add_block(&cur_block_index_);                      \
-                            if (cur_block_ && cur_block_->nitem < BLOCK_ITEM_NUM) {                        \
-                                T* obj = new (reinterpret_cast<T*>(cur_block_->items) + cur_block_->nitem) T CTOR_ARGS;   \
-                                if (!ObjectPoolValidator<T>::validate(obj)) {                           \
-                                    obj->~T();                                                          \
+                            /* step2 : 从本地block分配, 用完时获取新的Block */                          \
+                            if (cur_block_ == NULL || cur_block_->nitem >= BLOCK_ITEM_NUM) {            \
+                                cur_block_ = ObjectPool::add_block(&cur_block_index_);                  \
+                                if (cur_block_ == NULL) {                                               \
                                     return NULL;                                                        \
                                 }                                                                       \
-                                cur_block_->nitem++;                                                    \
-                                return obj;                                                             \
                             }                                                                           \
-                            return NULL;
+                            if (ObjectPoolTrimPolicy<T>::ENABLE) {                                      \
+                                detail::acquire_block_item(&cur_block_->nlive);                         \
+                            }                                                                           \
+                            T* obj = new (reinterpret_cast<T*>(cur_block_->items) + cur_block_->nitem) T CTOR_ARGS;   \
+                            if (!ObjectPoolValidator<T>::validate(obj)) {                               \
+                                obj->~T();                                                              \
+                                if (ObjectPoolTrimPolicy<T>::ENABLE) {                                  \
+                                    pool_->release_item(obj);                                           \
+                                }                                                                       \
+                                return NULL;                                                            \
+                            }                                                                           \
+                            cur_block_->nitem++;                                                        \
+                            return obj;
 
                             inline T* get() {
-                                GET_OBJECT();
+                                GET_OBJECT(, false);
                             }
 
-                            template <typename A1>
-                                inline T* get(const A1& a1) {
-                                    GET_OBJECT((a1));
+                            // 参数完美转发给构造函数, 可以直接构造只能移动的对象.
+                            // 复用的空闲对象先析构再用参数构造, 而不带参数的get()直接返回复用的对象
+                            template <typename... Args>
+                                inline T* get(Args&&... args) {
+                                    GET_OBJECT((std::forward<Args>(args)...), true);
                                 }
 
-                            template <typename A1, typename A2>
-                                inline T* get(const A1& a1, const A2& a2) {
-                                    GET_OBJECT((a1, a2));
+                            inline int return_object(T* obj) {
+                                if (cur_free_->nfree == ObjectPool::FREE_CHUNK_ITEM_NUM &&
+                                        !pool_->push_free_chunk(cur_free_, node_)) {
+                                    return -1;
                                 }
+                                if (ObjectPoolTrimPolicy<T>::ENABLE) {
+                                    obj->~T();
+                                    pool_->release_item(obj);
+                                }
+                                cur_free_->ptrs[cur_free_->nfree++] = obj;
+                                XTHREAD_OBJECT_POOL_FREE_ITEM_NUM_ADD1;
+                                return 0;
+                            }
 
-                            inline int return_object(T* obj) {
-                                if (cur_free_.nfree < ObjectPool::FREE_CHUNK_ITEM_NUM) {
-                                    cur_free_.ptrs[cur_free_.nfree++] = obj;
-                                    XTHREAD_OBJECT_POOL_FREE_ITEM_NUM_ADD1;
-                                    return 0;
+                            // 批量分配最多n个对象(默认构造), 返回分配到的数量.
+                            // 和FreeChunk之间整段复制指针, 新对象在Block中连续构造
+                            inline size_t get_objects(T** out, size_t n) {
+                                size_t got = 0;
+                                if (ObjectPoolTrimPolicy<T>::ENABLE) {
+                                    // 每个对象都要重新构造并计数, 逐个分配
+                                    for (; got < n; ++got) {
+                                        out[got] = get();
+                                        if (out[got] == NULL) {
+                                            break;
+                                        }
+                                    }
+                                    return got;
+                                }
+                                while (got < n) {
+                                    // step1 : 从局部FreeChunk取出
+                                    size_t k = std::min(n - got, cur_free_->nfree);
+                                    if (k) {
+                                        cur_free_->nfree -= k;
+                                        memcpy(out + got, cur_free_->ptrs + cur_free_->nfree, k * sizeof(T*));
+                                        got += k;
+                                        continue;
+                                    }
+                                    // step2 : 从全局FreeChunk取出
+                                    if (pool_->pop_free_chunk(cur_free_, node_)) {
+                                        continue;
+                                    }
+                                    // step3 : 在本地Block中构造, Block满了时获取新的Block
+                                    if (cur_block_ == NULL || cur_block_->nitem >= BLOCK_ITEM_NUM) {
+                                        cur_block_ = ObjectPool::add_block(&cur_block_index_);
+                                        if (cur_block_ == NULL) {
+                                            break;
+                                        }
+                                    }
+                                    T* objs = reinterpret_cast<T*>(cur_block_->items) + cur_block_->nitem;
+                                    k = std::min(n - got, BLOCK_ITEM_NUM - cur_block_->nitem);
+                                    for (size_t i = 0; i < k; ++i) {
+                                        T* obj = new (objs + i) T;
+                                        if (!ObjectPoolValidator<T>::validate(obj)) {
+                                            obj->~T();
+                                            cur_block_->nitem += i;
+                                            return got;
+                                        }
+                                        out[got++] = obj;
+                                    }
+                                    cur_block_->nitem += k;
                                 }
-                                if (pool_->push_free_chunk(cur_free_)) {
-                                    cur_free_.ptrs[0] = obj;
-                                    cur_free_.nfree = 1;
-                                    XTHREAD_OBJECT_POOL_FREE_ITEM_NUM_ADD1;
+                                return got;
+                            }
+
+                            // 失败时返回-1, 这时前面的一部分对象可能已经归还
+                            inline int return_objects(T* const* objs, size_t n) {
+                                if (ObjectPoolTrimPolicy<T>::ENABLE) {
+                                    for (size_t i = 0; i < n; ++i) {
+                                        if (return_object(objs[i]) != 0) {
+                                            return -1;
+                                        }
+                                    }
                                     return 0;
                                 }
-                                return -1;
+                                size_t done = 0;
+                                while (done < n) {
+                                    const size_t k = std::min(n - done, ObjectPool::FREE_CHUNK_ITEM_NUM - cur_free_->nfree);
+                                    if (k == 0) {
+                                        if (!pool_->push_free_chunk(cur_free_, node_)) {
+                                            return -1;
+                                        }
+                                        continue;
+                                    }
+                                    memcpy(cur_free_->ptrs + cur_free_->nfree, objs + done, k * sizeof(T*));
+                                    cur_free_->nfree += k;
+                                    done += k;
+                                }
+                                return 0;
                             }
 
                             inline std::string get_local_pool_info()const {
                                 const size_t max_size = 256;
                                 char str[max_size] = {0};
-                                ::snprintf(str, max_size, "pool[%p], local_pool[%p], cur_block[%p], cur_block_index[%zd], FreeChunk.nfree[%zd]", pool_, this, cur_block_, cur_block_index_, cur_free_.nfree);
+                                ::snprintf(str, max_size, "pool[%p], local_pool[%p], cur_block[%p], cur_block_index[%zd], FreeChunk.nfree[%zd]", pool_, this, cur_block_, cur_block_index_, cur_free_->nfree);
                                 return str;
                            }
 
@@ -194,18 +324,34 @@ namespace xthread
                             // 当前的Block对象,包含了对象列表的存储空间
                             Block* cur_block_;
                             size_t cur_block_index_;
-                            // 包含指向Item的指针,初始时为空,在有内存块归还时先归还给FreeChunk
-                            FreeChunk cur_free_;
+                            // 包含指向Item的指针,初始时为空,在有内存块归还时先归还给FreeChunk.
+                            // 和全局的FreeChunk栈之间只交换指针
+                            FreeChunk* cur_free_;
+                            // 创建LocalPool的线程所在的NUMA节点, 归还的对象放入这个节点的FreeChunk栈
+                            int node_;
                     };
 
                     friend class LocalPool;
 
+                private:
+                    static Block* new_block();
+                    static void delete_block(Block* b);
+                    // 开启trim时对象所在的Block
+                    static Block* block_of(T* obj) {
+                        return reinterpret_cast<Block*>(reinterpret_cast<uintptr_t>(obj) & ~(BLOCK_ALIGN - 1));
+                    }
+                    // 开启trim时对象析构之后调用, Block变为全部空闲时按照TRIM_IDLE_BLOCK_NUM触发trim
+                    void release_item(T* obj);
+
                 public:
                     static ObjectPool* getInstance();
                     LocalPool* get_or_new_local_pool();
                     static Block*   add_block(size_t* index);
                     static bool     add_block_group(size_t old_ngroup);
                     ObjectPoolInfo get_object_pool_info() const;
+                    // 把对象全部空闲的Block的内存还给操作系统, 返回这次释放的Block数量.
+                    // 只在开启ObjectPoolTrimPolicy时有效
+                    size_t trim();
 
                     static std::string config2String(){
                         const size_t max_size = 256;
@@ -222,20 +368,11 @@ namespace xthread
                     }
 
 
-                    template <typename A1>
-                        inline T* get_object(const A1& a1) {
+                    template <typename... Args>
+                        inline T* get_object(Args&&... args) {
                             LocalPool* lp = get_or_new_local_pool();
                             if (likely(lp != NULL)) {
-                                return lp->get(a1);
-                            }
-                            return NULL;
-                        }
-
-                    template <typename A1, typename A2>
-                        inline T* get_object(const A1& a1, const A2& a2) {
-                            LocalPool* lp = get_or_new_local_pool();
-                            if (likely(lp != NULL)) {
-                                return lp->get(a1, a2);
+                                return lp->get(std::forward<Args>(args)...);
                             }
                             return NULL;
                         }
@@ -248,6 +385,22 @@ namespace xthread
                         return -1;
                     }
 
+                    inline size_t get_objects(T** out, size_t n) {
+                        LocalPool* lp = get_or_new_local_pool();
+                        if (likely(lp != NULL)) {
+                            return lp->get_objects(out, n);
+                        }
+                        return 0;
+                    }
+
+                    inline int return_objects(T* const* objs, size_t n) {
+                        LocalPool* lp = get_or_new_local_pool();
+                        if (likely(lp != NULL)) {
+                            return lp->return_objects(objs, n);
+                        }
+                        return -1;
+                    }
+
                     void clear_objects() {
                         LocalPool* lp = local_pool_;
                         if (likely(lp)) {
@@ -265,13 +418,13 @@ namespace xthread
                     std::string get_pool_info() {
                         const int max_size = 255;
                         char str[max_size] = {0};
-                        snprintf(str, max_size, "pool_[%p], free_list_[%zd], nlocal_[%zd], local_pool_[%p], ngroup_[%zd]", singleton_.load(std::memory_order_relaxed), free_chunks_.size(), nlocal_.load(std::memory_order_relaxed), local_pool_, ngroup_.load(std::memory_order_relaxed));
+                        snprintf(str, max_size, "pool_[%p], free_list_[%zd], nlocal_[%zd], local_pool_[%p], ngroup_[%zd]", singleton_.load(std::memory_order_relaxed), free_chunk_num(), nlocal_.load(std::memory_order_relaxed), local_pool_, ngroup_.load(std::memory_order_relaxed));
                         return str;
                     }
 
                     void clear_local_pool() {
                         local_pool_ = NULL;
-                        if (nlocal_.fetch_sub(1, std::memory_order_relaxed)) {
+                        if (nlocal_.fetch_sub(1, std::memory_order_relaxed) != 1) {
                             return;
                         }
 #ifdef XTHREAD_CLEAR_OBJECT_POOL_AFTER_ALL_THREADS_QUIT
@@ -280,8 +433,15 @@ namespace xthread
                         if (nlocal_.load(std::memory_order_relaxed) != 0) {
                             return;
                         }
-                        FreeChunk dummy;
-                        while (pop_free_chunk(dummy));
+                        FreeChunk* c = NULL;
+                        for (int node = 0; node < nnode_; ++node) {
+                            while ((c = free_chunks_[node].pop()) != NULL) {
+                                delete c;
+                            }
+                        }
+                        while ((c = empty_chunks_.pop()) != NULL) {
+                            delete c;
+                        }
 
                         // 释放内存
                         const size_t ngroup = ngroup_.exchange(0, std::memory_order_relaxed);
@@ -290,21 +450,26 @@ namespace xthread
                             if (bg == NULL) {
                                 break;
                             }
-                            size_t nblock = std::min(bg->nblock.load(std::memory_order_relaxed), GROUP_BLOCK_NUM);
+                            size_t nblock = std::min(bg->nblock.load(std::memory_order_relaxed), static_cast<size_t>(GROUP_BLOCK_NUM));
                             for (size_t j = 0; j < nblock; ++j) {
-                                Block* b = bg->blocks_[j].load(std::memory_order_relaxed);
+                                Block* b = bg->blocks[j].load(std::memory_order_relaxed);
                                 if ( NULL == b) {
                                     continue;
                                 }
-                                for (size_t k = 0; k < b->nitem; ++k) {
-                                    T* const objs = (T*)b->items;
-                                    objs[k].~T();
+                                // 开启trim时空闲的对象已经析构
+                                if (!ObjectPoolTrimPolicy<T>::ENABLE) {
+                                    T* const objs = reinterpret_cast<T*>(b->items);
+                                    for (size_t k = 0; k < b->nitem; ++k) {
+                                        objs[k].~T();
+                                    }
                                 }
-                                delete b;
+                                delete_block(b);
                             }
                             delete bg;
                         }
-                        memset(block_groups_, 0, sizeof(std::aotimic<BlockGroup*>) * MAX_GROUP_NUM);
+                        for (size_t i = 0; i < MAX_GROUP_NUM; ++i) {
+                            block_groups_[i].store(NULL, std::memory_order_relaxed);
+                        }
 #endif
                     }
 
@@ -323,8 +488,15 @@ namespace xthread
                     static std::atomic<BlockGroup*> block_groups_[MAX_GROUP_NUM];
                     static MutexLock    block_group_mutex_;
 
-                    MutexLock               free_chunks_lock_;
-                    std::vector<FreeChunk*> free_chunks_;
+                    // 每个NUMA节点上装满的FreeChunk, 以及被取空之后留作复用的FreeChunk.
+                    // FreeChunk只在所有线程退出之后释放
+                    const int nnode_;
+                    FreeChunkStack<FreeChunk> free_chunks_[MAX_NUMA_NODE_NUM];
+                    FreeChunkStack<FreeChunk> empty_chunks_;
+                    // 上次trim之后变为全部空闲的Block数量
+                    std::atomic<size_t> nidle_blocks_;
+                    // 下一次允许自动trim的时间
+                    std::atomic<int64_t> next_auto_trim_ns_;
 
             };
 
@@ -368,34 +540,64 @@ namespace xthread
             }
 
         template <typename T>
-            bool ObjectPool<T>::pop_free_chunk(FreeChunk& c) {
-                // 如果为空,则直接返回(可能漏掉当前别的线程正在插入的情况)
-                // 如果大量的线程请求这里,这里直接不加锁判断可以降低锁争用
-                if (free_chunks_.empty()) {
-                    return false;
+            bool ObjectPool<T>::pop_free_chunk(FreeChunk*& c, int node) {
+                FreeChunk* full = free_chunks_[node].pop();
+                for (int i = 1; full == NULL && i < nnode_; ++i) {
+                    FreeChunkStack<FreeChunk>& remote = free_chunks_[(node + i) % nnode_];
+                    if (remote.size() > REMOTE_REUSE_CHUNK_NUM) {
+                        full = remote.pop();
+                    }
                 }
-                MutexGuard<MutexLock> g(free_chunks_lock_);
-                if (free_chunks_.empty()) {
+                if (full == NULL) {
                     return false;
                 }
-                FreeChunk* p = free_chunks_.back();
-                free_chunks_.pop_back();
-                c = *p;
-                delete p;
+                empty_chunks_.push(c);
+                c = full;
                 return true;
             }
 
         template <typename T>
-            bool ObjectPool<T>::push_free_chunk(const FreeChunk& c) {
-                FreeChunk* c2 = new (std::nothrow) FreeChunk(c);
-                if (c2 == NULL) {
+            bool ObjectPool<T>::push_free_chunk(FreeChunk*& c, int node) {
+                FreeChunk* empty = get_empty_chunk();
+                if (empty == NULL) {
                     return false;
                 }
-                MutexGuard<MutexLock> g(free_chunks_lock_);
-                free_chunks_.push_back(c2);
+                free_chunks_[node].push(c);
+                c = empty;
                 return true;
             }
 
+        template <typename T>
+            void ObjectPool<T>::release_free_chunk(FreeChunk* c, int node) {
+                if (c->nfree) {
+                    free_chunks_[node].push(c);
+                }
+                else {
+                    empty_chunks_.push(c);
+                }
+            }
+
+        template <typename T>
+            size_t ObjectPool<T>::free_chunk_num() const {
+                size_t n = 0;
+                for (int node = 0; node < nnode_; ++node) {
+                    n += free_chunks_[node].size();
+                }
+                return n;
+            }
+
+        template <typename T>
+            typename ObjectPool<T>::FreeChunk* ObjectPool<T>::get_empty_chunk() {
+                FreeChunk* c = empty_chunks_.pop();
+                if (c == NULL) {
+                    c = new (std::nothrow) FreeChunk;
+                }
+                else {
+                    c->nfree = 0;
+                }
+                return c;
+            }
+
         template <typename T>
             typename ObjectPool<T>::LocalPool* ObjectPool<T>::get_or_new_local_pool() {
                 ObjectPool<T>::LocalPool* lp = local_pool_;
@@ -406,6 +608,10 @@ namespace xthread
                 if (lp == NULL) {
                     return NULL;
                 }
+                if (!lp->valid()) {
+                    delete lp;
+                    return NULL;
+                }
                 MutexGuard<MutexLock> guard(local_pool_mutex_);
                 local_pool_ = lp;
                 registerThreadExitFunc(LocalPool::deleteLocalPool, static_cast<LocalPool*>(lp));
@@ -415,8 +621,9 @@ namespace xthread
 
         template <typename T>
             typename ObjectPool<T>::Block* ObjectPool<T>::add_block(size_t* index) {
-                // step1 新建Block
-                Block* new_block = new (std::nothrow) Block;
+                // step1 新建Block. 构造时只写了nitem, 对象由LocalPool所在的线程构造,
+                // 新分配的物理页按照first-touch落在这个线程的NUMA节点上
+                Block* const new_block = ObjectPool::new_block();
                 if (new_block == NULL) {
                     return NULL;
                 }
@@ -435,10 +642,68 @@ namespace xthread
                         g->nblock.fetch_sub(1, std::memory_order_relaxed);
                     }
                 }while (add_block_group(ngroup));
-                delete new_block;
+                delete_block(new_block);
                 return NULL;
             }
 
+        template <typename T>
+            typename ObjectPool<T>::Block* ObjectPool<T>::new_block() {
+                if (!ObjectPoolTrimPolicy<T>::ENABLE) {
+                    return new (std::nothrow) Block;
+                }
+                void* mem = NULL;
+                if (posix_memalign(&mem, BLOCK_ALIGN, sizeof(Block)) != 0) {
+                    return NULL;
+                }
+                return new (mem) Block;
+            }
+
+        template <typename T>
+            void ObjectPool<T>::delete_block(Block* b) {
+                if (!ObjectPoolTrimPolicy<T>::ENABLE) {
+                    delete b;
+                    return;
+                }
+                b->~Block();
+                free(b);
+            }
+
+        template <typename T>
+            void ObjectPool<T>::release_item(T* obj) {
+                if (!detail::release_block_item(&block_of(obj)->nlive)) {
+                    return;
+                }
+                const size_t threshold = ObjectPoolTrimPolicy<T>::TRIM_IDLE_BLOCK_NUM;
+                if (threshold && nidle_blocks_.fetch_add(1, std::memory_order_relaxed) + 1 >= threshold &&
+                        detail::try_begin_auto_trim(&next_auto_trim_ns_)) {
+                    nidle_blocks_.store(0, std::memory_order_relaxed);
+                    trim();
+                }
+            }
+
+        template <typename T>
+            size_t ObjectPool<T>::trim() {
+                if (!ObjectPoolTrimPolicy<T>::ENABLE) {
+                    return 0;
+                }
+                size_t ntrimmed = 0;
+                const size_t ngroup = ngroup_.load(std::memory_order_acquire);
+                for (size_t i = 0; i < ngroup; ++i) {
+                    BlockGroup* group = block_groups_[i].load(std::memory_order_consume);
+                    if (group == NULL) {
+                        continue;
+                    }
+                    const size_t nblock = std::min(group->nblock.load(std::memory_order_relaxed), static_cast<size_t>(GROUP_BLOCK_NUM));
+                    for (size_t j = 0; j < nblock; ++j) {
+                        Block* block = group->blocks[j].load(std::memory_order_consume);
+                        if (block && detail::trim_block(&block->nlive, block->items, sizeof(block->items))) {
+                            ++ntrimmed;
+                        }
+                    }
+                }
+                return ntrimmed;
+            }
+
         template <typename T>
             bool ObjectPool<T>::add_block_group(size_t old_ngroup) {
                 BlockGroup* bg = NULL;
@@ -468,6 +733,7 @@ namespace xthread
             info.block_num = 0;
             info.block_item_num = 0;
             info.item_num = 0;
+            info.trimmed_block_num = 0;
 #ifdef XTHREAD_OBJECT_POOL_NEED_FREE_ITEM_NUM
             info.free_item_num = _global_nfree.load(std::memory_order_relaxed);
 #endif
@@ -482,6 +748,9 @@ namespace xthread
                         if (block) {
                             info.block_item_num += block->nitem;
                             info.item_num += block->nitem;
+                            if (block->nlive.load(std::memory_order_relaxed) & detail::BLOCK_TRIMMED) {
+                                ++info.trimmed_block_num;
+                            }
                         }
                     }
                 }
@@ -16,14 +16,27 @@ bool return_resource(ResourceId<T> id) {
     return ResourcePool<T>::getInstance()->return_resource(id);
 }
 
-template <typename T, typename PARAM_A>
-T* get_resource(ResourceId<T>* id, const PARAM_A& a) {
-    return ResourcePool<T>::getInstance()->get_resource(id, a);
+// 批量分配最多n个资源, 返回分配到的数量, ptrs可以为NULL
+template <typename T>
+size_t get_resources(ResourceId<T>* ids, T** ptrs, size_t n) {
+    return ResourcePool<T>::getInstance()->get_resources(ids, ptrs, n);
+}
+
+template <typename T>
+bool return_resources(const ResourceId<T>* ids, size_t n) {
+    return ResourcePool<T>::getInstance()->return_resources(ids, n);
 }
 
-template <typename T, typename PARAM_A, typename PARAM_B>
-T* get_resource(ResourceId<T>* id, const PARAM_A& a, const PARAM_B& b) {
-    return ResourcePool<T>::getInstance()->get_resource(id, a, b);
+// 参数完美转发给T的构造函数, 复用的空闲资源也会先析构再用参数构造
+template <typename T, typename... Args>
+T* get_resource(ResourceId<T>* id, Args&&... args) {
+    return ResourcePool<T>::getInstance()->get_resource(id, std::forward<Args>(args)...);
+}
+
+// 开启ResourcePoolTrimPolicy<T>时把全部空闲的Block的内存还给操作系统, 返回释放的Block数量
+template <typename T>
+size_t trim_resources() {
+    return ResourcePool<T>::getInstance()->trim();
 }
 
 template <typename T>
@@ -3,16 +3,29 @@
 #include <cstddef>
 #include <atomic>
 #include <vector>
+#include <algorithm>
 #include <string>
+#include <utility>
+#include <cstring>
 #include <stdio.h>
 #include "../macros.h"
 #include "../../base/thread_exit_helper.h"
 #include "../../base/lock.h"
 #include "../../base/lock_guard.h"
+#include "free_chunk_stack.h"
+#include "block_trim.h"
 namespace xthread
 {
     namespace base
     {
+        // ENABLE为true时归还的资源立即析构, 分配时重新构造, 资源全部空闲的Block可以通过trim()
+        // 把内存还给操作系统, id保持不变. TRIM_IDLE_BLOCK_NUM不为0时, 每有这么多个Block变为全部空闲就自动trim一次,
+        // 两次自动trim之间至少间隔detail::AUTO_TRIM_INTERVAL_NS
+        template <typename T> struct ResourcePoolTrimPolicy {
+            static const bool ENABLE = false;
+            static const size_t TRIM_IDLE_BLOCK_NUM = 0;
+        };
+
         template <typename T>
             struct ResourceId {
                 uint64_t value;
@@ -53,9 +66,11 @@ namespace xthread
                     struct FreeChunkItems
                     {
                         size_t nitems;
+                        // 在全局的FreeChunkStack中时指向下一个FreeChunkItems
+                        std::atomic<FreeChunkItems*> next;
                         ResourceId<T>     items[FREE_CHUNK_ITEM_NUM];
                         FreeChunkItems()
-                            : nitems(0)
+                            : nitems(0), next(NULL)
                         {
                             memset(items, 0, sizeof(ResourceId<T>) * FREE_CHUNK_ITEM_NUM);
                         }
@@ -64,9 +79,11 @@ namespace xthread
                     struct ResourceBlock
                     {
                         size_t  nitems;
+                        // 开启trim时正在使用的资源数量和trim的状态
+                        std::atomic<size_t> nlive;
                         char    items[sizeof(T) * BLOCK_ITEM_NUM];
                         ResourceBlock()
-                            : nitems(0) {
+                            : nitems(0), nlive(0) {
                             memset(items, 0, sizeof(T) * BLOCK_ITEM_NUM);
                         }
                     };
@@ -78,17 +95,24 @@ namespace xthread
                         ResourceBlockGroup()
                             : nblock(0)
                         {
-                            memset(blocks, 0, sizeof(ResourceBlock*) * GROUP_BLOCK_NUM);
+                            for (size_t i = 0; i < GROUP_BLOCK_NUM; ++i) {
+                                blocks[i].store(NULL, std::memory_order_relaxed);
+                            }
                         }
                     };
 
-                    typedef std::vector<FreeChunkItems*> FreeChunkList;
-
                 public:
                     ResourceBlock* getBlock(size_t* index);
                     bool addGroup(size_t curr_ngroup);
-                    bool push_free_chunk(const FreeChunkItems& curr_free);
-                    bool pop_free_chunk(FreeChunkItems& ret_free);
+                    // 把满的curr_free放入全局的FreeChunk栈, 换回一个空的FreeChunkItems
+                    bool push_free_chunk(FreeChunkItems*& curr_free);
+                    // 用全局的一个非空FreeChunkItems替换ret_free, ret_free放回空的FreeChunk栈
+                    bool pop_free_chunk(FreeChunkItems*& ret_free);
+                    void release_free_chunk(FreeChunkItems* c);
+                    FreeChunkItems* get_empty_chunk();
+                    // 把资源全部空闲的Block的内存还给操作系统, 返回这次释放的Block数量.
+                    // 只在开启ResourcePoolTrimPolicy时有效
+                    size_t trim();
                     static std::string config2String(){
                         const size_t max_size = 256;
                         char str[max_size] = {0};
@@ -100,18 +124,25 @@ namespace xthread
                     {
                         public:
                             LocalPool(ResourcePool* pool)
-                                : pool_(pool), local_block_(NULL), local_block_index_(0){
+                                : pool_(pool), local_free_(pool->get_empty_chunk()),
+                                local_block_(NULL), local_block_index_(0){
                                 }
 
                             ~LocalPool() {
-                                if (local_free_.nitems > 0) {
-                                    pool_->push_free_chunk(local_free_);
+                                if (local_free_ == NULL) {
+                                    // 构造时没有拿到FreeChunkItems, 没有被注册
+                                    return;
                                 }
+                                pool_->release_free_chunk(local_free_);
                                 pool_->clearLocalPoolFromDctr();
                             }
 
+                            bool valid() const {
+                                return local_free_ != NULL;
+                            }
+
                             void clear_objects() {
-                                if (local_free_.nitems > 0) {
+                                if (local_free_->nitems > 0) {
                                     pool_->push_free_chunk(local_free_);
                                 }
                             }
@@ -119,49 +150,133 @@ namespace xthread
                             #include "macro_defines.h"
                             bool return_resource(ResourceId<T> id) {
                                 // printf("return resource id[%ld]\n", id.value);
-                                if (local_free_.nitems < FREE_CHUNK_ITEM_NUM) {
-                                    local_free_.items[local_free_.nitems++] = id;
-                                    return true;
+                                if (local_free_->nitems >= FREE_CHUNK_ITEM_NUM && !pool_->push_free_chunk(local_free_)) {
+                                    return false;
                                 }
-                                else {
-                                    bool ret = pool_->push_free_chunk(local_free_);
-                                    if (ret) {
-                                        local_free_.nitems = 0;
-                                        local_free_.items[local_free_.nitems++] = id;
-                                        return true;
-                                    }
+                                if (ResourcePoolTrimPolicy<T>::ENABLE) {
+                                    get_addr_by_id_safe(id)->~T();
+                                    pool_->release_item(id);
                                 }
-                                return false;
+                                local_free_->items[local_free_->nitems++] = id;
+                                return true;
                             }
 
                             T* get_resource(ResourceId<T>* id) {
-                                GET_RESOURCE();
+                                GET_RESOURCE(, false);
+                            }
+
+                            // 参数完美转发给构造函数, 可以直接构造只能移动的对象.
+                            // 复用的空闲资源先析构再用参数构造, 而不带参数的get_resource直接返回复用的资源
+                            template <typename... Args>
+                            T* get_resource(ResourceId<T>* id, Args&&... args) {
+                                GET_RESOURCE((std::forward<Args>(args)...), true);
                             }
 
-                            template <typename A1>
-                            T* get_resource(ResourceId<T>* id, const A1& a1) {
-                                GET_RESOURCE((a1));
+                            // 批量分配最多n个资源(默认构造), 返回分配到的数量, ptrs可以为NULL.
+                            // 和FreeChunkItems之间整段复制id, 新资源在Block中连续构造
+                            size_t get_resources(ResourceId<T>* ids, T** ptrs, size_t n) {
+                                size_t got = 0;
+                                if (ResourcePoolTrimPolicy<T>::ENABLE) {
+                                    // 每个资源都要重新构造并计数, 逐个分配
+                                    for (; got < n; ++got) {
+                                        T* ptr = get_resource(ids + got);
+                                        if (ptr == NULL) {
+                                            break;
+                                        }
+                                        if (ptrs) {
+                                            ptrs[got] = ptr;
+                                        }
+                                    }
+                                    return got;
+                                }
+                                while (got < n) {
+                                    size_t k = std::min(n - got, local_free_->nitems);
+                                    if (k > 0) {
+                                        local_free_->nitems -= k;
+                                        memcpy(ids + got, local_free_->items + local_free_->nitems, k * sizeof(ResourceId<T>));
+                                        if (ptrs) {
+                                            for (size_t i = got; i < got + k; ++i) {
+                                                ptrs[i] = get_addr_by_id_safe(ids[i]);
+                                            }
+                                        }
+                                        got += k;
+                                        continue;
+                                    }
+                                    if (pool_->pop_free_chunk(local_free_)) {
+                                        continue;
+                                    }
+                                    if (!local_block_ || local_block_->nitems >= BLOCK_ITEM_NUM) {
+                                        local_block_ = pool_->getBlock(&local_block_index_);
+                                        if (!local_block_) {
+                                            break;
+                                        }
+                                    }
+                                    T* items = reinterpret_cast<T*>(local_block_->items) + local_block_->nitems;
+                                    const size_t first_id = local_block_index_ * BLOCK_ITEM_NUM + local_block_->nitems;
+                                    k = std::min(n - got, BLOCK_ITEM_NUM - local_block_->nitems);
+                                    for (size_t i = 0; i < k; ++i) {
+                                        T* ptr = new (items + i) T;
+                                        ids[got].value = first_id + i;
+                                        if (ptrs) {
+                                            ptrs[got] = ptr;
+                                        }
+                                        ++got;
+                                    }
+                                    local_block_->nitems += k;
+                                }
+                                return got;
                             }
 
-                            template <typename A1, typename A2>
-                            T* get_resource(ResourceId<T>* id, const A1& a1, const A2& a2) {
-                                GET_RESOURCE((a1,a2));
+                            // 失败时返回false, 这时前面的一部分id可能已经归还
+                            bool return_resources(const ResourceId<T>* ids, size_t n) {
+                                if (ResourcePoolTrimPolicy<T>::ENABLE) {
+                                    for (size_t i = 0; i < n; ++i) {
+                                        if (!return_resource(ids[i])) {
+                                            return false;
+                                        }
+                                    }
+                                    return true;
+                                }
+                                size_t done = 0;
+                                while (done < n) {
+                                    const size_t k = std::min(n - done, FREE_CHUNK_ITEM_NUM - local_free_->nitems);
+                                    if (k == 0) {
+                                        if (!pool_->push_free_chunk(local_free_)) {
+                                            return false;
+                                        }
+                                        continue;
+                                    }
+                                    memcpy(local_free_->items + local_free_->nitems, ids + done, k * sizeof(ResourceId<T>));
+                                    local_free_->nitems += k;
+                                    done += k;
+                                }
+                                return true;
                             }
 
                             inline std::string getLocalPoolInfo()const {
                                 const size_t max_size = 256;
                                 char str[max_size] = {0};
-                                ::snprintf(str, max_size, "pool[%p], local_pool[%p], cur_block[%p], cur_block_index[%zd], FreeChunk.nfree[%zd]", pool_, this, local_block_, local_block_index_, local_free_.nitems);
+                                ::snprintf(str, max_size, "pool[%p], local_pool[%p], cur_block[%p], cur_block_index[%zd], FreeChunk.nfree[%zd]", pool_, this, local_block_, local_block_index_, local_free_->nitems);
                                 return str;
                            }
 
                         private:
                             ResourcePool*   pool_;
-                            FreeChunkItems  local_free_;
+                            // 和全局的FreeChunk栈之间只交换指针
+                            FreeChunkItems* local_free_;
                             ResourceBlock*  local_block_;
                             size_t          local_block_index_;
                     };
                     friend class LocalPool;
+                private:
+                    // 开启trim时id所在的Block
+                    static ResourceBlock* block_of_id(ResourceId<T> id) {
+                        const size_t block_index = id.value / BLOCK_ITEM_NUM;
+                        ResourceBlockGroup* group = groups_[block_index / GROUP_BLOCK_NUM].load(std::memory_order_consume);
+                        return group->blocks[block_index & (GROUP_BLOCK_NUM - 1)].load(std::memory_order_consume);
+                    }
+                    // 开启trim时资源析构之后调用, Block变为全部空闲时按照TRIM_IDLE_BLOCK_NUM触发trim
+                    void release_item(ResourceId<T> id);
                 public:
 
                     static inline T* get_addr_by_id_unsafe(ResourceId<T> id) {
@@ -209,30 +324,36 @@ namespace xthread
                         return NULL;
                     }
 
-                    template <typename PARAM_A>
-                    T* get_resource(ResourceId<T>* id, const PARAM_A& a) {
+                    template <typename... Args>
+                    T* get_resource(ResourceId<T>* id, Args&&... args) {
                         LocalPool* lp = get_or_new_local_pool();
                         if (likely(lp)) {
-                            T* ret = lp->get_resource(id, a);
+                            T* ret = lp->get_resource(id, std::forward<Args>(args)...);
                             return ret;
                         }
                         return NULL;
                     }
 
-                    template <typename PARAM_A, typename PARAM_B>
-                    T* get_resource(ResourceId<T>* id, const PARAM_A& a, const PARAM_B& b) {
+                    bool return_resource(ResourceId<T> id) {
                         LocalPool* lp = get_or_new_local_pool();
                         if (likely(lp)) {
-                            T* ret = lp->get_resource(id, a, b);
-                            return ret;
+                            return lp->return_resource(id);
                         }
-                        return NULL;
+                        return false;
                     }
 
-                    bool return_resource(ResourceId<T> id) {
+                    size_t get_resources(ResourceId<T>* ids, T** ptrs, size_t n) {
                         LocalPool* lp = get_or_new_local_pool();
                         if (likely(lp)) {
-                            return lp->return_resource(id);
+                            return lp->get_resources(ids, ptrs, n);
+                        }
+                        return 0;
+                    }
+
+                    bool return_resources(const ResourceId<T>* ids, size_t n) {
+                        LocalPool* lp = get_or_new_local_pool();
+                        if (likely(lp)) {
+                            return lp->return_resources(ids, n);
                         }
                         return false;
                     }
@@ -243,21 +364,25 @@ namespace xthread
                             local_pool_->clear_objects();
                             local_pool_ = NULL;
                         }
-                        FreeChunkItems notUse;
-                        while( pop_free_chunk(notUse));
+                        FreeChunkItems* notUse = NULL;
+                        while ((notUse = free_list_.pop()) != NULL) {
+                            notUse->nitems = 0;
+                            empty_list_.push(notUse);
+                        }
 
                         if (nlocal_.fetch_sub(1, std::memory_order_relaxed) == 1) {
                             size_t ngroup = ngroup_.load(std::memory_order_relaxed);
                             while (ngroup) {
                                 ResourceBlockGroup* curr_group = groups_[--ngroup].load(std::memory_order_relaxed);
                                 if (curr_group) {
-                                    size_t block_num = curr_group->nblock.load(std::memory_order_release);
+                                    size_t block_num = std::min(curr_group->nblock.load(std::memory_order_acquire), static_cast<size_t>(GROUP_BLOCK_NUM));
                                     while (block_num) {
                                         ResourceBlock* block = curr_group->blocks[--block_num].load(std::memory_order_relaxed);
                                         if (!block) {
                                             continue;
                                         }
-                                        size_t item_num = block->nitems;
+                                        // 开启trim时空闲的资源已经析构
+                                        size_t item_num = ResourcePoolTrimPolicy<T>::ENABLE ? 0 : block->nitems;
                                         while (item_num > 0) {
                                             T* arr_ptr = reinterpret_cast<T*>(block->items);
                                             // NOTE : 这里不能使用 T obj = arr_ptr[--item_num], 这将导致将数组中的对象赋值给obj临时变量
@@ -268,7 +393,9 @@ namespace xthread
                                     }
                                 }
                                 delete curr_group;
+                                groups_[ngroup].store(NULL, std::memory_order_relaxed);
                             }
+                            ngroup_.store(0, std::memory_order_relaxed);
                         }
                     }
 
@@ -284,8 +411,7 @@ namespace xthread
                         return str;
                     }
                 private:
-                    ResourcePool() {
-                        free_list_.reserve(FREE_LIST_INIT_SIZE);
+                    ResourcePool() : nidle_blocks_(0), next_auto_trim_ns_(0) {
                     };
 
                     static void clearLocalPoolFromDctr() {
@@ -302,8 +428,13 @@ namespace xthread
                 private:
                     static std::atomic<ResourcePool*> instance_;
                     static MutexLock instance_lock_;
-                    FreeChunkList   free_list_;
-                    MutexLock       free_list_lock_;
+                    // 装满的FreeChunkItems, 以及被取空之后留作复用的FreeChunkItems, 都不会被释放
+                    FreeChunkStack<FreeChunkItems> free_list_;
+                    FreeChunkStack<FreeChunkItems> empty_list_;
+                    // 上次trim之后变为全部空闲的Block数量
+                    std::atomic<size_t> nidle_blocks_;
+                    // 下一次允许自动trim的时间
+                    std::atomic<int64_t> next_auto_trim_ns_;
 
                     static std::atomic<size_t> nlocal_;
                     static thread_local LocalPool* local_pool_;
@@ -386,7 +517,6 @@ namespace xthread
                 if (curr_ngroup != ngroup_.load(std::memory_order_acquire)) {
                     return true;
                 }
-                size_t MAX_GROUP_NUM = ResourcePool<T>::MAX_GROUP_NUM;
                 MutexGuard<MutexLock> guard(groups_lock_);
                 size_t ngroup = ngroup_.load(std::memory_order_acquire);
                 if (curr_ngroup != ngroup) {
@@ -398,7 +528,7 @@ namespace xthread
                         return false;
                     }
                     groups_[ngroup].store(newGroup, std::memory_order_release);
-                    ngroup_.store(ngroup + 1, std::memory_order_acquire);
+                    ngroup_.store(ngroup + 1, std::memory_order_release);
                     // printf("new group [%zd] ----------------\n", ngroup + 1);
                     return true;
                 }
@@ -417,6 +547,10 @@ namespace xthread
                 if (!lp) {
                     return NULL;
                 }
+                if (!lp->valid()) {
+                    delete lp;
+                    return NULL;
+                }
                 local_pool_ = lp;
                 registerThreadExitFunc(ResourcePool<T>::deleteLocalPool, reinterpret_cast<void*>(lp));
                 nlocal_.fetch_add(1, std::memory_order_relaxed);
@@ -424,31 +558,84 @@ namespace xthread
             }
 
         template <typename T>
-            bool ResourcePool<T>::push_free_chunk(const typename ResourcePool<T>::FreeChunkItems& curr_free) {
-                FreeChunkItems* newFreeChunkItems = new (std::nothrow) FreeChunkItems(curr_free);
-                if (!newFreeChunkItems) {
+            bool ResourcePool<T>::push_free_chunk(typename ResourcePool<T>::FreeChunkItems*& curr_free) {
+                FreeChunkItems* empty = get_empty_chunk();
+                if (!empty) {
                     return false;
                 }
-                MutexGuard<MutexLock> guard(free_list_lock_);
-                free_list_.push_back(newFreeChunkItems);
+                free_list_.push(curr_free);
+                curr_free = empty;
                 return true;
             }
 
         template <typename T>
-            bool ResourcePool<T>::pop_free_chunk(ResourcePool<T>::FreeChunkItems& ret_free) {
-                if (free_list_.empty()) {
-                    return false;
-                }
-                MutexGuard<MutexLock> guard(free_list_lock_);
-                if (free_list_.empty()) {
+            bool ResourcePool<T>::pop_free_chunk(typename ResourcePool<T>::FreeChunkItems*& ret_free) {
+                FreeChunkItems* full = free_list_.pop();
+                if (!full) {
                     return false;
                 }
-                FreeChunkItems *p = free_list_.back();
-                free_list_.pop_back();
-                ret_free = *p;
-                delete p;
+                empty_list_.push(ret_free);
+                ret_free = full;
                 return true;
             }
+
+        template <typename T>
+            void ResourcePool<T>::release_free_chunk(typename ResourcePool<T>::FreeChunkItems* c) {
+                if (c->nitems > 0) {
+                    free_list_.push(c);
+                }
+                else {
+                    empty_list_.push(c);
+                }
+            }
+
+        template <typename T>
+            typename ResourcePool<T>::FreeChunkItems* ResourcePool<T>::get_empty_chunk() {
+                FreeChunkItems* c = empty_list_.pop();
+                if (!c) {
+                    c = new (std::nothrow) FreeChunkItems;
+                }
+                else {
+                    c->nitems = 0;
+                }
+                return c;
+            }
+
+        template <typename T>
+            void ResourcePool<T>::release_item(ResourceId<T> id) {
+                if (!detail::release_block_item(&block_of_id(id)->nlive)) {
+                    return;
+                }
+                const size_t threshold = ResourcePoolTrimPolicy<T>::TRIM_IDLE_BLOCK_NUM;
+                if (threshold && nidle_blocks_.fetch_add(1, std::memory_order_relaxed) + 1 >= threshold &&
+                        detail::try_begin_auto_trim(&next_auto_trim_ns_)) {
+                    nidle_blocks_.store(0, std::memory_order_relaxed);
+                    trim();
+                }
+            }
+
+        template <typename T>
+            size_t ResourcePool<T>::trim() {
+                if (!ResourcePoolTrimPolicy<T>::ENABLE) {
+                    return 0;
+                }
+                size_t ntrimmed = 0;
+                const size_t ngroup = ngroup_.load(std::memory_order_acquire);
+                for (size_t i = 0; i < ngroup; ++i) {
+                    ResourceBlockGroup* group = groups_[i].load(std::memory_order_consume);
+                    if (!group) {
+                        continue;
+                    }
+                    const size_t nblock = std::min(group->nblock.load(std::memory_order_relaxed), static_cast<size_t>(GROUP_BLOCK_NUM));
+                    for (size_t j = 0; j < nblock; ++j) {
+                        ResourceBlock* block = group->blocks[j].load(std::memory_order_consume);
+                        if (block && detail::trim_block(&block->nlive, block->items, sizeof(block->items))) {
+                            ++ntrimmed;
+                        }
+                    }
+                }
+                return ntrimmed;
+            }
     }
 }
 #endif
@@ -0,0 +1,78 @@
+#ifndef XTHREAD_COMMON_PARKING_LOT_H
+#define XTHREAD_COMMON_PARKING_LOT_H
+#include <limits.h>
+#include <atomic>
+#include "macros.h"
+#include "../base/futex.h"
+#include "../base/noncopyable.h"
+namespace xthread
+{
+    /*
+     *  空闲的工作线程在pending_signal_上做futex等待.
+     *  pending_signal_的最低位表示已经停止, 其余的位是信号计数:
+     *  等待者先get_state再检查任务, 没有任务时wait(state), 如果在这期间有新的信号,
+     *  futex比较失败立即返回, 不会丢失唤醒
+     */
+    class ParkingLot : base::NonCopyable {
+    public:
+        class State {
+        public:
+            State() : val_(0) {}
+            bool stopped() const {
+                return val_ & 1;
+            }
+            bool operator==(const State& other) const {
+                return val_ == other.val_;
+            }
+            bool operator!=(const State& other) const {
+                return val_ != other.val_;
+            }
+        private:
+            friend class ParkingLot;
+            explicit State(int val) : val_(val) {}
+            int val_;
+        };
+
+        ParkingLot()
+            : pending_signal_(0),
+              nwaiters_(0)
+        {
+
+        }
+
+        // 最多唤醒num_task个等待者, 返回实际唤醒的数量, 没有等待者时不进入内核
+        int signal(int num_task) {
+            pending_signal_.fetch_add((num_task << 1), std::memory_order_seq_cst);
+            // 和wait中的nwaiters_构成Dekker式同步: 这里读到0时,
+            // 等待者的futex一定能看到上面的修改
+            if (nwaiters_.load(std::memory_order_seq_cst) == 0) {
+                return 0;
+            }
+            return static_cast<int>(base::futex_wake_private(&pending_signal_, num_task));
+        }
+
+        State get_state() const {
+            return State(pending_signal_.load(std::memory_order_acquire));
+        }
+
+        // 如果状态仍然等于expected则阻塞
+        void wait(const State& expected) {
+            nwaiters_.fetch_add(1, std::memory_order_seq_cst);
+            base::futex_wait_private(&pending_signal_, expected.val_, NULL);
+            nwaiters_.fetch_sub(1, std::memory_order_relaxed);
+        }
+
+        // 唤醒所有等待者, 之后的wait都立即返回
+        void stop() {
+            pending_signal_.fetch_or(1, std::memory_order_seq_cst);
+            base::futex_wake_private(&pending_signal_, INT_MAX);
+        }
+
+    private:
+        std::atomic<int> pending_signal_;
+        std::atomic<int> nwaiters_;
+        char pad_[XTHREAD_CACHELINE_SIZE - 2 * sizeof(std::atomic<int>)];
+    };
+}
+
+#endif
@@ -0,0 +1,149 @@
+#ifndef XTHREAD_COMMON_REMOTE_TASK_QUEUE_H
+#define XTHREAD_COMMON_REMOTE_TASK_QUEUE_H
+#include <cstddef>
+#include <stdint.h>
+#include <atomic>
+#include <new>
+#include "macros.h"
+#include "work_stealing_queue.h"
+#include "../base/noncopyable.h"
+namespace xthread
+{
+    /*
+     *  有界的无锁队列, 任意线程都可以push, 拥有者通过pop_batch批量取出,
+     *  偷取者也可以并发的pop.
+     *  每个槽位带一个序号: 序号等于pos表示可写, 等于pos+1表示可读,
+     *  生产者和消费者分别只CAS enqueue_pos_/dequeue_pos_
+     */
+    template <typename T>
+    class RemoteTaskQueue : base::NonCopyable {
+    private:
+        struct Cell {
+            std::atomic<size_t> seq;
+            T data;
+        };
+
+    public:
+        RemoteTaskQueue()
+            : cells_(NULL),
+              mask_(0),
+              enqueue_pos_(0),
+              dequeue_pos_(0)
+        {
+
+        }
+
+        ~RemoteTaskQueue() {
+            delete[] cells_;
+        }
+
+        // 容量向上取整为2的幂
+        bool init(size_t capacity) {
+            if (cells_ != NULL || capacity == 0) {
+                return false;
+            }
+            const size_t cap = detail::round_up_power_of_2(capacity);
+            cells_ = new (std::nothrow) Cell[cap];
+            if (cells_ == NULL) {
+                return false;
+            }
+            for (size_t i = 0; i < cap; ++i) {
+                cells_[i].seq.store(i, std::memory_order_relaxed);
+            }
+            mask_ = cap - 1;
+            return true;
+        }
+
+        size_t capacity() const {
+            return mask_ + 1;
+        }
+
+        // 队列满时返回false
+        bool push(const T& val) {
+            size_t pos = enqueue_pos_.load(std::memory_order_relaxed);
+            Cell* cell = NULL;
+            while (true) {
+                cell = &cells_[pos & mask_];
+                const size_t seq = cell->seq.load(std::memory_order_acquire);
+                const intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+                if (diff == 0) {
+                    if (enqueue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                        break;
+                    }
+                }
+                else if (diff < 0) {
+                    return false;
+                }
+                else {
+                    pos = enqueue_pos_.load(std::memory_order_relaxed);
+                }
+            }
+            cell->data = val;
+            cell->seq.store(pos + 1, std::memory_order_release);
+            return true;
+        }
+
+        bool pop(T* val) {
+            return pop_batch(val, 1) == 1;
+        }
+
+        /*
+         *  一次CAS dequeue_pos_取出最多max个连续可读的元素, 返回取出的数量.
+         *  CAS成功之后[pos, pos+n)的槽位只属于当前线程, 生产者要等序号更新之后才能复用
+         */
+        size_t pop_batch(T* out, size_t max) {
+            if (max == 0) {
+                return 0;
+            }
+            size_t pos = dequeue_pos_.load(std::memory_order_relaxed);
+            size_t n = 0;
+            while (true) {
+                n = 0;
+                while (n < max) {
+                    const size_t seq = cells_[(pos + n) & mask_].seq.load(std::memory_order_acquire);
+                    if (seq != pos + n + 1) {
+                        break;
+                    }
+                    ++n;
+                }
+                if (n == 0) {
+                    const size_t seq = cells_[pos & mask_].seq.load(std::memory_order_acquire);
+                    const intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos + 1);
+                    if (diff < 0) {
+                        // 队列为空, 或者生产者还没有写完
+                        return 0;
+                    }
+                    // 其他消费者已经取走了pos
+                    pos = dequeue_pos_.load(std::memory_order_relaxed);
+                    continue;
+                }
+                if (dequeue_pos_.compare_exchange_weak(pos, pos + n, std::memory_order_relaxed)) {
+                    break;
+                }
+            }
+            for (size_t i = 0; i < n; ++i) {
+                Cell* cell = &cells_[(pos + i) & mask_];
+                out[i] = cell->data;
+                cell->seq.store(pos + i + mask_ + 1, std::memory_order_release);
+            }
+            return n;
+        }
+
+        size_t volatile_size() const {
+            const size_t d = dequeue_pos_.load(std::memory_order_relaxed);
+            const size_t e = enqueue_pos_.load(std::memory_order_relaxed);
+            return (e < d ? 0 : (e - d));
+        }
+
+    private:
+        Cell* cells_;
+        size_t mask_;
+        char cells_pad_[XTHREAD_CACHELINE_SIZE - sizeof(Cell*) - sizeof(size_t)];
+        std::atomic<size_t> enqueue_pos_;
+        char enqueue_pad_[XTHREAD_CACHELINE_SIZE - sizeof(std::atomic<size_t>)];
+        std::atomic<size_t> dequeue_pos_;
+        char dequeue_pad_[XTHREAD_CACHELINE_SIZE - sizeof(std::atomic<size_t>)];
+    };
+}
+
+#endif
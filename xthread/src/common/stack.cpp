@@ -1,8 +1,20 @@
 #include <unistd.h>
 #include <sys/mman.h>
 #include <algorithm>
+#include <vector>
+#include <atomic>
 #include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <pthread.h>
+#include <cstdint>
 #include "stack.h"
+#include "log.h"
+#include "obj_pool/object_pool_in.h"
+#include "../base/lock_guard.h"
+#include "../base/thread_exit_helper.h"
+#include "../base/futex.h"
+#include "../base/time.h"
 
 namespace xthread
 {
@@ -12,18 +24,205 @@ namespace xthread
     const int MIN_STACKSIZE      = PAGESIZE * 2;
     const int MIN_GUARDSIZE      = PAGESIZE;
 
-    int SmallStackClass::stack_size_flag = StackConfig::STACK_SIZE_SMALL;
-    int NormalStackClass::stack_size_flag = StackConfig::STACK_SIZE_NORMAL;
-    int LargeStackClass::stack_size_flag = StackConfig::STACK_SIZE_LARGE;
+    std::atomic<int> SmallStackClass::stack_size_flag(StackConfig::STACK_SIZE_SMALL);
+    std::atomic<int> NormalStackClass::stack_size_flag(StackConfig::STACK_SIZE_NORMAL);
+    std::atomic<int> LargeStackClass::stack_size_flag(StackConfig::STACK_SIZE_LARGE);
+
+    std::atomic<int> SmallStackClass::guard_size_flag(StackConfig::GUARD_PAGE_SIZE);
+    std::atomic<int> NormalStackClass::guard_size_flag(StackConfig::GUARD_PAGE_SIZE);
+    std::atomic<int> LargeStackClass::guard_size_flag(StackConfig::GUARD_PAGE_SIZE);
+
+    std::atomic<int> SmallStackClass::max_cached(StackCacheConfig::MAX_CACHED_SMALL);
+    std::atomic<int> NormalStackClass::max_cached(StackCacheConfig::MAX_CACHED_NORMAL);
+    std::atomic<int> LargeStackClass::max_cached(StackCacheConfig::MAX_CACHED_LARGE);
+
+    std::atomic<int> SmallStackClass::generation(0);
+    std::atomic<int> NormalStackClass::generation(0);
+    std::atomic<int> LargeStackClass::generation(0);
+
+    // 栈和guard的上限, 避免int溢出
+    static const int MAX_STACK_SIZE = 1 << 30;
+
+    struct StackClassFlags {
+        std::atomic<int>* stack_size;
+        std::atomic<int>* guard_size;
+        std::atomic<int>* max_cached;
+        std::atomic<int>* generation;
+    };
+
+    template <typename StackClass>
+    static void fill_class_flags(StackClassFlags* flags) {
+        flags->stack_size = &StackClass::stack_size_flag;
+        flags->guard_size = &StackClass::guard_size_flag;
+        flags->max_cached = &StackClass::max_cached;
+        flags->generation = &StackClass::generation;
+    }
+
+    static bool lookup_class_flags(int stacktype, StackClassFlags* flags) {
+        switch (stacktype) {
+            case StackType::STACK_TYPE_SMALL:
+                fill_class_flags<SmallStackClass>(flags);
+                return true;
+            case StackType::STACK_TYPE_NORMAL:
+                fill_class_flags<NormalStackClass>(flags);
+                return true;
+            case StackType::STACK_TYPE_LARGE:
+                fill_class_flags<LargeStackClass>(flags);
+                return true;
+        }
+        return false;
+    }
+
+    static int load_stack_config();
+
+    // 环境变量中的配置在第一次使用栈的配置时加载, 不在静态初始化阶段读取
+    static pthread_once_t g_stack_config_once = PTHREAD_ONCE_INIT;
+
+    static void load_stack_config_once() {
+        load_stack_config();
+    }
+
+    static bool get_class_flags(int stacktype, StackClassFlags* flags) {
+        pthread_once(&g_stack_config_once, load_stack_config_once);
+        return lookup_class_flags(stacktype, flags);
+    }
+
+    static int round_up_to_page(int size) {
+        return (size + PAGESIZE_M1) & ~PAGESIZE_M1;
+    }
+
+    // 以下do_set_*不触发环境变量的加载, 供加载环境变量时使用
+    static int do_set_max_cached_stacks(int stacktype, int num) {
+        StackClassFlags flags;
+        if (num < 0 || !lookup_class_flags(stacktype, &flags)) {
+            return -1;
+        }
+        flags.max_cached->store(num, std::memory_order_relaxed);
+        return 0;
+    }
+
+    static int do_set_stack_size(int stacktype, int stacksize) {
+        StackClassFlags flags;
+        if (stacksize <= 0 || stacksize > MAX_STACK_SIZE || !lookup_class_flags(stacktype, &flags)) {
+            return -1;
+        }
+        flags.stack_size->store(round_up_to_page(stacksize), std::memory_order_relaxed);
+        flags.generation->fetch_add(1, std::memory_order_relaxed);
+        return 0;
+    }
+
+    static int do_set_guard_size(int stacktype, int guardsize) {
+        StackClassFlags flags;
+        if (guardsize < 0 || guardsize > MAX_STACK_SIZE || !lookup_class_flags(stacktype, &flags)) {
+            return -1;
+        }
+        flags.guard_size->store(round_up_to_page(guardsize), std::memory_order_relaxed);
+        flags.generation->fetch_add(1, std::memory_order_relaxed);
+        return 0;
+    }
+
+    int set_max_cached_stacks(int stacktype, int num) {
+        pthread_once(&g_stack_config_once, load_stack_config_once);
+        return do_set_max_cached_stacks(stacktype, num);
+    }
+
+    static int get_max_cached_stacks(int stacktype) {
+        StackClassFlags flags;
+        if (!get_class_flags(stacktype, &flags)) {
+            return 0;
+        }
+        return flags.max_cached->load(std::memory_order_relaxed);
+    }
+
+    int set_stack_size(int stacktype, int stacksize) {
+        pthread_once(&g_stack_config_once, load_stack_config_once);
+        return do_set_stack_size(stacktype, stacksize);
+    }
+
+    int set_guard_size(int stacktype, int guardsize) {
+        pthread_once(&g_stack_config_once, load_stack_config_once);
+        return do_set_guard_size(stacktype, guardsize);
+    }
+
+    int get_stack_size(int stacktype) {
+        StackClassFlags flags;
+        if (!get_class_flags(stacktype, &flags)) {
+            return -1;
+        }
+        return flags.stack_size->load(std::memory_order_relaxed);
+    }
+
+    int get_guard_size(int stacktype) {
+        StackClassFlags flags;
+        if (!get_class_flags(stacktype, &flags)) {
+            return -1;
+        }
+        return flags.guard_size->load(std::memory_order_relaxed);
+    }
+
+    // 环境变量不存在时返回0, 格式错误时返回-1
+    static int read_env_int(const char* name, int (*setter)(int, int), int stacktype) {
+        const char* value = getenv(name);
+        if (value == NULL) {
+            return 0;
+        }
+        char* end = NULL;
+        errno = 0;
+        const long v = strtol(value, &end, 10);
+        if (errno != 0 || end == value || *end != '\0' || v < 0 || v > MAX_STACK_SIZE ||
+                setter(stacktype, static_cast<int>(v)) != 0) {
+            log_error("invalid %s=%s", name, value);
+            return -1;
+        }
+        return 0;
+    }
+
+    static int load_stack_config() {
+        static const struct {
+            const char* suffix;
+            int stacktype;
+        } classes[] = {
+            {"SMALL", StackType::STACK_TYPE_SMALL},
+            {"NORMAL", StackType::STACK_TYPE_NORMAL},
+            {"LARGE", StackType::STACK_TYPE_LARGE},
+        };
+        int nerror = 0;
+        char name[64];
+        for (size_t i = 0; i < ARRAY_SIZE(classes); ++i) {
+            snprintf(name, sizeof(name), "XTHREAD_STACK_SIZE_%s", classes[i].suffix);
+            nerror -= read_env_int(name, do_set_stack_size, classes[i].stacktype);
+            snprintf(name, sizeof(name), "XTHREAD_GUARD_SIZE_%s", classes[i].suffix);
+            nerror -= read_env_int(name, do_set_guard_size, classes[i].stacktype);
+            snprintf(name, sizeof(name), "XTHREAD_MAX_CACHED_STACKS_%s", classes[i].suffix);
+            nerror -= read_env_int(name, do_set_max_cached_stacks, classes[i].stacktype);
+        }
+        return nerror;
+    }
+
+    int load_stack_config_from_env() {
+        // 先完成自动加载, 避免之后第一次使用配置时再次加载覆盖这里的结果
+        pthread_once(&g_stack_config_once, load_stack_config_once);
+        return load_stack_config();
+    }
+
+    // 每种栈的mmap/munmap统计, 只在缓存未命中的慢路径中修改
+    struct StackClassCounter {
+        std::atomic<uint64_t> mapped_bytes;
+        std::atomic<uint64_t> nmmap;
+        std::atomic<uint64_t> nmunmap;
+    };
+    static StackClassCounter g_class_counters[StackType::STACK_TYPE_LARGE + 1];
+
     /*
      * alloc stack , return the higher address
+     * 使用MAP_NORESERVE并且不预先访问, 只有真正用到的页才占用物理内存
      */
     void* alloc_stack(int* inout_stacksize, int* inout_guardsize){
         int stacksize = (std::max(*inout_stacksize, MIN_STACKSIZE) + PAGESIZE_M1) & ~PAGESIZE_M1;
         int guardsize = (std::max(*inout_guardsize, MIN_GUARDSIZE) + PAGESIZE_M1) & ~PAGESIZE_M1;
 
         const int memsize = stacksize + guardsize;
-        void* mem = mmap(NULL, memsize, (PROT_READ | PROT_WRITE), (MAP_PRIVATE | MAP_ANONYMOUS), -1, 0);
+        void* mem = mmap(NULL, memsize, (PROT_READ | PROT_WRITE), (MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE), -1, 0);
         if (mem == MAP_FAILED) {
             return NULL;
         }
@@ -45,4 +244,328 @@ namespace xthread
             munmap(static_cast<char*>(mem) - memsize, memsize);
         }
     }
+
+    StackContainer* new_stack(int stacktype) {
+        StackContainer* sc = base::ObjectPool<StackContainer>::getInstance()->get_object();
+        if (unlikely(sc == NULL)) {
+            return NULL;
+        }
+        sc->context = NULL;
+        sc->stacksize = 0;
+        sc->guardsize = 0;
+        sc->stack = NULL;
+        sc->stacktype = stacktype;
+        sc->next = NULL;
+        sc->idle_epoch = 0;
+        sc->trimmed = false;
+        sc->generation = 0;
+        StackClassFlags flags;
+        if (!get_class_flags(stacktype, &flags)) {
+            return sc;
+        }
+        // 先读取generation, 并发修改配置时宁可之后多释放一次也不会缓存错误大小的栈
+        sc->generation = flags.generation->load(std::memory_order_relaxed);
+        sc->stacksize = flags.stack_size->load(std::memory_order_relaxed);
+        sc->guardsize = flags.guard_size->load(std::memory_order_relaxed);
+        sc->stack = alloc_stack(&(sc->stacksize), &(sc->guardsize));
+        if (unlikely(sc->stack == NULL)) {
+            base::ObjectPool<StackContainer>::getInstance()->return_object(sc);
+            return NULL;
+        }
+        StackClassCounter& counter = g_class_counters[stacktype];
+        counter.nmmap.fetch_add(1, std::memory_order_relaxed);
+        counter.mapped_bytes.fetch_add(static_cast<uint64_t>(sc->stacksize + sc->guardsize),
+                std::memory_order_relaxed);
+        return sc;
+    }
+
+    void delete_stack(StackContainer* sc) {
+        if (sc->stack) {
+            dealloc_stack(sc->stack, sc->stacksize, sc->guardsize);
+            sc->stack = NULL;
+            StackClassCounter& counter = g_class_counters[sc->stacktype];
+            counter.nmunmap.fetch_add(1, std::memory_order_relaxed);
+            counter.mapped_bytes.fetch_sub(static_cast<uint64_t>(sc->stacksize + sc->guardsize),
+                    std::memory_order_relaxed);
+        }
+        base::ObjectPool<StackContainer>::getInstance()->return_object(sc);
+    }
+
+    // 所有线程的栈缓存, trimmer扫描期间持有锁, 线程退出时等待扫描结束再释放
+    static base::MutexLock g_caches_lock;
+    static std::vector<StackCache*> g_caches;
+    static std::atomic<uint64_t> g_trim_epoch(0);
+    // 已经退出的线程中get_stack的次数, 被g_caches_lock保护
+    static uint64_t g_exited_nget[StackType::STACK_TYPE_LARGE + 1];
+
+    static std::atomic<uint64_t> g_trim_npasses(0);
+    static std::atomic<uint64_t> g_trim_ntrimmed(0);
+    static std::atomic<uint64_t> g_trim_bytes(0);
+    static std::atomic<uint64_t> g_trim_ncached(0);
+    static std::atomic<uint64_t> g_trim_ncached_trimmed(0);
+
+    uint64_t stack_trim_epoch() {
+        return g_trim_epoch.load(std::memory_order_relaxed);
+    }
+
+    static void delete_stack_cache(void* arg) {
+        StackCache* c = static_cast<StackCache*>(arg);
+        {
+            base::MutexGuard<base::MutexLock> guard(g_caches_lock);
+            std::vector<StackCache*>::iterator it = std::find(g_caches.begin(), g_caches.end(), c);
+            if (it != g_caches.end()) {
+                g_caches.erase(it);
+            }
+            g_exited_nget[c->stacktype] += c->nget;
+        }
+        *c->owner_slot = NULL;
+        while (c->head != NULL) {
+            StackContainer* sc = c->head;
+            c->head = sc->next;
+            delete_stack(sc);
+        }
+        delete c;
+    }
+
+    StackCache* new_stack_cache(int stacktype, StackCache** owner_slot) {
+        StackCache* c = new (std::nothrow) StackCache;
+        if (c == NULL) {
+            return NULL;
+        }
+        c->head = NULL;
+        c->nfree = 0;
+        c->stacktype = stacktype;
+        c->nget = 0;
+        c->owner_slot = owner_slot;
+        {
+            base::MutexGuard<base::MutexLock> guard(g_caches_lock);
+            try {
+                g_caches.push_back(c);
+            } catch (...) {
+                delete c;
+                return NULL;
+            }
+        }
+        if (base::registerThreadExitFunc(delete_stack_cache, c) != 0) {
+            delete_stack_cache(c);
+            return NULL;
+        }
+        *owner_slot = c;
+        return c;
+    }
+
+    static int madvise_stack(StackContainer* sc, bool use_madv_free) {
+        // 保留栈顶的一页, make_fcontext和task开始运行时会用到
+        char* low = static_cast<char*>(sc->stack) - sc->stacksize;
+        const size_t len = static_cast<size_t>(sc->stacksize - PAGESIZE);
+#ifdef MADV_FREE
+        if (use_madv_free && madvise(low, len, MADV_FREE) == 0) {
+            return 0;
+        }
+#else
+        (void)use_madv_free;
+#endif
+        return madvise(low, len, MADV_DONTNEED);
+    }
+
+    /*
+     *  缓存链表是LIFO的, 第一个空闲足够久的栈之后的栈都更早放入.
+     *  先在锁内摘下这一段, 在锁外madvise, 再放回链表尾部, 拥有者线程只会短暂的看到更少的缓存
+     */
+    static size_t trim_stack_cache(StackCache* c, uint64_t epoch, uint64_t idle_epochs, bool use_madv_free,
+            uint64_t* ncached_out, uint64_t* ncached_trimmed_out) {
+        StackContainer* idle = NULL;
+        int nidle = 0;
+        uint64_t ncached = 0;
+        c->lock.lock();
+        StackContainer** prev = &c->head;
+        while (*prev != NULL && (*prev)->idle_epoch + idle_epochs > epoch) {
+            prev = &(*prev)->next;
+            ++ncached;
+        }
+        idle = *prev;
+        *prev = NULL;
+        for (StackContainer* sc = idle; sc != NULL; sc = sc->next) {
+            ++nidle;
+        }
+        c->nfree -= nidle;
+        c->lock.unlock();
+        if (idle == NULL) {
+            *ncached_out += ncached;
+            return 0;
+        }
+
+        size_t ntrimmed = 0;
+        uint64_t ntrimmed_resident = 0;
+        StackContainer* tail = NULL;
+        for (StackContainer* sc = idle; sc != NULL; sc = sc->next) {
+            if (!sc->trimmed) {
+                if (madvise_stack(sc, use_madv_free) == 0) {
+                    sc->trimmed = true;
+                    ++ntrimmed;
+                    g_trim_bytes.fetch_add(static_cast<uint64_t>(sc->stacksize - PAGESIZE),
+                            std::memory_order_relaxed);
+                }
+            }
+            if (sc->trimmed) {
+                ++ntrimmed_resident;
+            }
+            tail = sc;
+        }
+
+        // 放回链表尾部, 超过上限的部分直接释放
+        StackContainer* overflow = NULL;
+        c->lock.lock();
+        const int room = get_max_cached_stacks(c->stacktype) - c->nfree;
+        if (room < nidle) {
+            StackContainer** cut = &idle;
+            for (int i = 0; i < room && *cut != NULL; ++i) {
+                cut = &(*cut)->next;
+            }
+            overflow = *cut;
+            *cut = NULL;
+            nidle = std::max(room, 0);
+            tail = NULL;
+            for (StackContainer* sc = idle; sc != NULL; sc = sc->next) {
+                tail = sc;
+            }
+        }
+        if (idle != NULL) {
+            StackContainer** end = &c->head;
+            while (*end != NULL) {
+                end = &(*end)->next;
+            }
+            *end = idle;
+            tail->next = NULL;
+            c->nfree += nidle;
+        }
+        c->lock.unlock();
+        while (overflow != NULL) {
+            StackContainer* sc = overflow;
+            overflow = sc->next;
+            delete_stack(sc);
+        }
+        g_trim_ntrimmed.fetch_add(ntrimmed, std::memory_order_relaxed);
+        *ncached_out += ncached + static_cast<uint64_t>(nidle);
+        *ncached_trimmed_out += std::min(ntrimmed_resident, static_cast<uint64_t>(nidle));
+        return ntrimmed;
+    }
+
+    size_t trim_cached_stacks(uint64_t idle_epochs, bool use_madv_free) {
+        const uint64_t epoch = g_trim_epoch.fetch_add(1, std::memory_order_relaxed);
+        size_t ntrimmed = 0;
+        uint64_t ncached = 0;
+        uint64_t ncached_trimmed = 0;
+        base::MutexGuard<base::MutexLock> guard(g_caches_lock);
+        for (size_t i = 0; i < g_caches.size(); ++i) {
+            ntrimmed += trim_stack_cache(g_caches[i], epoch, idle_epochs, use_madv_free,
+                    &ncached, &ncached_trimmed);
+        }
+        g_trim_ncached.store(ncached, std::memory_order_relaxed);
+        g_trim_ncached_trimmed.store(ncached_trimmed, std::memory_order_relaxed);
+        g_trim_npasses.fetch_add(1, std::memory_order_relaxed);
+        return ntrimmed;
+    }
+
+    int get_stack_class_stats(int stacktype, StackClassStats* stats) {
+        StackClassFlags flags;
+        if (!get_class_flags(stacktype, &flags)) {
+            return -1;
+        }
+        stats->stacksize = flags.stack_size->load(std::memory_order_relaxed);
+        stats->guardsize = flags.guard_size->load(std::memory_order_relaxed);
+        stats->npooled = 0;
+        stats->nget = 0;
+        {
+            base::MutexGuard<base::MutexLock> guard(g_caches_lock);
+            for (size_t i = 0; i < g_caches.size(); ++i) {
+                StackCache* c = g_caches[i];
+                if (c->stacktype != stacktype) {
+                    continue;
+                }
+                c->lock.lock();
+                stats->npooled += static_cast<uint64_t>(c->nfree);
+                stats->nget += c->nget;
+                c->lock.unlock();
+            }
+            stats->nget += g_exited_nget[stacktype];
+        }
+        const StackClassCounter& counter = g_class_counters[stacktype];
+        stats->nmmap = counter.nmmap.load(std::memory_order_relaxed);
+        stats->nmunmap = counter.nmunmap.load(std::memory_order_relaxed);
+        stats->mapped_bytes = counter.mapped_bytes.load(std::memory_order_relaxed);
+        const uint64_t nmapped = stats->nmmap - stats->nmunmap;
+        stats->nlive = (nmapped > stats->npooled ? nmapped - stats->npooled : 0);
+        return 0;
+    }
+
+    void get_stack_trim_stats(StackTrimStats* stats) {
+        stats->npasses = g_trim_npasses.load(std::memory_order_relaxed);
+        stats->ntrimmed = g_trim_ntrimmed.load(std::memory_order_relaxed);
+        stats->trimmed_bytes = g_trim_bytes.load(std::memory_order_relaxed);
+        stats->ncached = g_trim_ncached.load(std::memory_order_relaxed);
+        stats->ncached_trimmed = g_trim_ncached_trimmed.load(std::memory_order_relaxed);
+    }
+
+    StackTrimOptions::StackTrimOptions()
+        : idle_time_us(10 * 1000000L),
+          interval_us(1000000L),
+          use_madv_free(false) {
+    }
+
+    // trimmer线程在g_trimmer_stop上做futex等待, stop时修改并唤醒
+    static base::MutexLock g_trimmer_lock;
+    static bool g_trimmer_started = false;
+    static pthread_t g_trimmer_thread;
+    static StackTrimOptions g_trimmer_options;
+    static std::atomic<int> g_trimmer_stop(0);
+
+    static void* stack_trimmer_thread(void*) {
+        const StackTrimOptions opt = g_trimmer_options;
+        // 空闲时间换算成扫描的轮数, 至少要经过一轮
+        uint64_t idle_epochs = static_cast<uint64_t>((opt.idle_time_us + opt.interval_us - 1) / opt.interval_us);
+        if (idle_epochs == 0) {
+            idle_epochs = 1;
+        }
+        while (g_trimmer_stop.load(std::memory_order_acquire) == 0) {
+            const size_t n = trim_cached_stacks(idle_epochs, opt.use_madv_free);
+            if (n != 0) {
+                log_debug("stack trimmer released %zu stacks", n);
+            }
+            const timespec timeout = base::us2timespec(opt.interval_us);
+            base::futex_wait_private(&g_trimmer_stop, 0, &timeout);
+        }
+        return NULL;
+    }
+
+    int start_stack_trimmer(const StackTrimOptions* options) {
+        base::MutexGuard<base::MutexLock> guard(g_trimmer_lock);
+        if (g_trimmer_started) {
+            return -1;
+        }
+        if (options != NULL) {
+            if (options->interval_us <= 0 || options->idle_time_us < 0) {
+                return -1;
+            }
+            g_trimmer_options = *options;
+        }
+        g_trimmer_stop.store(0, std::memory_order_relaxed);
+        if (pthread_create(&g_trimmer_thread, NULL, stack_trimmer_thread, NULL) != 0) {
+            log_error("create stack trimmer thread failed");
+            return -1;
+        }
+        g_trimmer_started = true;
+        return 0;
+    }
+
+    void stop_stack_trimmer() {
+        base::MutexGuard<base::MutexLock> guard(g_trimmer_lock);
+        if (!g_trimmer_started) {
+            return;
+        }
+        g_trimmer_stop.store(1, std::memory_order_release);
+        base::futex_wake_private(&g_trimmer_stop, 1);
+        pthread_join(g_trimmer_thread, NULL);
+        g_trimmer_started = false;
+    }
 }
@@ -2,15 +2,20 @@
 #define XTHREAD_COMMON_STACK_H
 #include <boost/context/all.hpp>
 #include <new>
+#include <cassert>
+#include <stdint.h>
+#include <atomic>
 
 #include "macros.h"
+#include "../base/lock.h"
 
 namespace xthread
 {
     // BOOST_VERSION > 1.56
     typedef boost::context::fcontext_t Context;
-    inline void jump(Context c1, Context c2) {
-        boost::context::jump_fcontext(&c1, c2, 0);
+    // 保存当前上下文到from, 然后切换到to
+    inline void jump(Context* from, Context to) {
+        boost::context::jump_fcontext(from, to, 0);
     }
 
     struct StackType {
@@ -28,82 +33,239 @@ namespace xthread
         static const int STACK_SIZE_LARGE  = 8388608;
     };
 
+    // 每个线程为每种栈缓存的最大数量
+    struct StackCacheConfig {
+        static const int MAX_CACHED_SMALL  = 64;
+        static const int MAX_CACHED_NORMAL = 32;
+        static const int MAX_CACHED_LARGE  = 4;
+    };
+
     struct StackContainer {
         Context context;
         int stacksize;
         int guardsize;
         void *stack;
         int stacktype;
+        // 在线程的缓存链表中时指向下一个
+        StackContainer* next;
+        // 放入缓存时的trim轮次, 以及是否已经被madvise释放了物理内存
+        uint64_t idle_epoch;
+        bool trimmed;
+        // 分配时所属种类的配置版本, 配置修改之后旧的栈不再放入缓存
+        int generation;
     };
 
     struct MainStackClass {};
 
+    /*
+     *  每种栈的配置可以在运行时修改, 修改栈大小或者guard大小会增加generation,
+     *  已经缓存的旧栈在下次获取或者归还时释放
+     */
     struct SmallStackClass {
-        static int stack_size_flag;
+        static std::atomic<int> stack_size_flag;
+        static std::atomic<int> guard_size_flag;
+        static std::atomic<int> max_cached;
+        static std::atomic<int> generation;
         const static int stacktype = StackType::STACK_TYPE_SMALL;
     };
 
     struct NormalStackClass {
-        static int stack_size_flag;
+        static std::atomic<int> stack_size_flag;
+        static std::atomic<int> guard_size_flag;
+        static std::atomic<int> max_cached;
+        static std::atomic<int> generation;
         const static int stacktype = StackType::STACK_TYPE_NORMAL;
     };
 
     struct LargeStackClass {
-        static int stack_size_flag;
+        static std::atomic<int> stack_size_flag;
+        static std::atomic<int> guard_size_flag;
+        static std::atomic<int> max_cached;
+        static std::atomic<int> generation;
         const static int stacktype = StackType::STACK_TYPE_LARGE;
     };
 
     void* alloc_stack(int* stacksize, int* guardsize);
     void dealloc_stack(void* mem, int stacksize, int guardsize);
 
+    // 设置每个线程缓存的某种栈的最大数量, 只影响之后归还的栈
+    int set_max_cached_stacks(int stacktype, int num);
+    // 设置之后新分配的栈的大小和guard大小, 会向上取整为页大小
+    int set_stack_size(int stacktype, int stacksize);
+    int set_guard_size(int stacktype, int guardsize);
+    int get_stack_size(int stacktype);
+    int get_guard_size(int stacktype);
+
+    /*
+     *  从环境变量读取配置, 第一次分配栈或者读写栈的配置时自动调用一次. 支持的环境变量:
+     *  XTHREAD_STACK_SIZE_{SMALL,NORMAL,LARGE}, XTHREAD_GUARD_SIZE_{SMALL,NORMAL,LARGE},
+     *  XTHREAD_MAX_CACHED_STACKS_{SMALL,NORMAL,LARGE}. 返回非法的变量个数
+     */
+    int load_stack_config_from_env();
+
+    struct StackClassStats {
+        int stacksize;
+        int guardsize;
+        // 正在被使用的栈, 在线程缓存中的栈
+        uint64_t nlive;
+        uint64_t npooled;
+        // 所有已经映射的栈(包括guard)的字节数
+        uint64_t mapped_bytes;
+        // 累计的mmap/munmap次数和get_stack次数, 两次采样之差除以时间间隔得到每秒的调用次数
+        uint64_t nmmap;
+        uint64_t nmunmap;
+        uint64_t nget;
+    };
+    int get_stack_class_stats(int stacktype, StackClassStats* stats);
+
+    /*
+     *  一个线程中某种栈的缓存. 后台的trimmer也会访问, 所以用自旋锁保护,
+     *  拥有者线程和trimmer很少同时访问, 加锁不会进入内核
+     */
+    struct StackCache {
+        base::SpinLock lock;
+        StackContainer* head;
+        int nfree;
+        int stacktype;
+        // 在这个线程中调用get_stack的次数
+        uint64_t nget;
+        // 指向拥有者线程中保存这个缓存的TLS变量, 线程退出时置为NULL
+        StackCache** owner_slot;
+    };
+
+    // 创建当前线程的缓存并注册到全局列表中, 线程退出时自动释放
+    StackCache* new_stack_cache(int stacktype, StackCache** owner_slot);
+    // 按照当前的配置分配StackContainer和栈内存, 不设置context
+    StackContainer* new_stack(int stacktype);
+    // 释放栈内存并归还StackContainer
+    void delete_stack(StackContainer* sc);
+    // 当前的trim轮次, 每次trim增加1
+    uint64_t stack_trim_epoch();
+
+    /*
+     *  StackContainer通过ObjectPool复用, 归还的栈先放入线程局部的缓存链表,
+     *  缓存满时才munmap, 稳定状态下创建task不需要任何系统调用.
+     *  栈可能在其他线程归还(task迁移), 所以缓存只是线程局部的空闲列表, 不区分来源
+     */
     template <typename StackClass>
         class StackContainerFactory {
             public:
                 static StackContainer* get_stack(void (*entry)(intptr_t)) {
-                    StackContainer* newSC = new (std::nothrow) StackContainer;
-                    if (unlikely(newSC == NULL)) {
-                        return NULL;
+                    StackContainer* sc = NULL;
+                    StackCache* c = local_cache();
+                    if (likely(c != NULL)) {
+                        c->lock.lock();
+                        sc = c->head;
+                        if (sc != NULL) {
+                            c->head = sc->next;
+                            --c->nfree;
+                        }
+                        ++c->nget;
+                        c->lock.unlock();
                     }
-                    newSC->stacksize = StackClass::stack_size_flag;
-                    newSC->guardsize = StackConfig::GUARD_PAGE_SIZE;
-                    newSC->stack = alloc_stack(&(newSC->stacksize), &(newSC->guardsize));
-                    if (unlikely(newSC->stack == NULL)) {
-                        newSC->context = NULL;
-                        return newSC;
+                    if (unlikely(sc != NULL &&
+                                sc->generation != StackClass::generation.load(std::memory_order_relaxed))) {
+                        delete_stack(sc);
+                        sc = NULL;
                     }
-                    newSC->context = boost::context::make_fcontext(newSC->stack, newSC->stacksize, entry);
-                    newSC->stacktype = StackClass::stacktype;
-                    return newSC;
+                    if (sc == NULL) {
+                        sc = new_stack(StackClass::stacktype);
+                        if (unlikely(sc == NULL)) {
+                            return NULL;
+                        }
+                    }
+                    sc->next = NULL;
+                    sc->trimmed = false;
+                    sc->context = boost::context::make_fcontext(sc->stack, sc->stacksize, entry);
+                    return sc;
                 }
 
                 static void return_stack(StackContainer* sc) {
-                    if (sc->stack) {
-                        dealloc_stack(sc->stack, sc->stacksize, sc->guardsize);
-                        sc->stack = NULL;
+                    StackCache* c = local_cache();
+                    if (likely(c != NULL &&
+                                sc->generation == StackClass::generation.load(std::memory_order_relaxed))) {
+                        sc->idle_epoch = stack_trim_epoch();
+                        c->lock.lock();
+                        if (c->nfree < StackClass::max_cached.load(std::memory_order_relaxed)) {
+                            sc->next = c->head;
+                            c->head = sc;
+                            ++c->nfree;
+                            c->lock.unlock();
+                            return;
+                        }
+                        c->lock.unlock();
+                    }
+                    delete_stack(sc);
+                }
+
+                // 当前线程缓存的栈数量
+                static int local_cached_num() {
+                    StackCache* c = tls_cache_;
+                    if (c == NULL) {
+                        return 0;
+                    }
+                    c->lock.lock();
+                    const int n = c->nfree;
+                    c->lock.unlock();
+                    return n;
+                }
+
+            private:
+                static StackCache* local_cache() {
+                    StackCache* c = tls_cache_;
+                    if (unlikely(c == NULL)) {
+                        c = new_stack_cache(StackClass::stacktype, &tls_cache_);
                     }
-                    delete sc;
+                    return c;
                 }
+
+            private:
+                static thread_local StackCache* tls_cache_;
         };
 
+    template <typename StackClass>
+        thread_local StackCache* StackContainerFactory<StackClass>::tls_cache_ = NULL;
+
     template<>
         class StackContainerFactory<MainStackClass> {
             public:
                 static StackContainer* get_stack(void (*)(intptr_t)) {
-                    StackContainer *sc = new (std::nothrow) StackContainer;
-                    if (unlikely(sc == NULL)) {
-                        return NULL;
-                    }
-                    sc->stacksize = 0;
-                    sc->guardsize = 0;
-                    sc->stacktype = StackType::STACK_TYPE_MAIN;
-                    return sc;
+                    return new_stack(StackType::STACK_TYPE_MAIN);
                 }
 
                 static void return_stack(StackContainer *sc) {
-                    delete sc;
+                    delete_stack(sc);
                 }
         };
 
+    struct StackTrimOptions {
+        // 在缓存中空闲超过这个时间的栈才会被释放物理内存
+        int64_t idle_time_us;
+        // trimmer线程两次扫描之间的间隔
+        int64_t interval_us;
+        // 优先使用MADV_FREE(内存紧张时才回收, 不降低RSS), 否则使用MADV_DONTNEED
+        bool use_madv_free;
+        StackTrimOptions();
+    };
+
+    struct StackTrimStats {
+        uint64_t npasses;
+        // 被madvise的栈数量和字节数
+        uint64_t ntrimmed;
+        uint64_t trimmed_bytes;
+        // 扫描时在缓存中的栈数量和其中已经被trim过的数量
+        uint64_t ncached;
+        uint64_t ncached_trimmed;
+    };
+
+    // 启动后台trimmer线程, 重复启动返回-1
+    int start_stack_trimmer(const StackTrimOptions* options);
+    void stop_stack_trimmer();
+    // 立即扫描一遍所有线程的缓存, 释放空闲超过idle_epochs轮的栈的物理内存, 返回trim的栈数量.
+    // 栈顶的一页保留, 之后复用时不会立刻缺页
+    size_t trim_cached_stacks(uint64_t idle_epochs, bool use_madv_free);
+    void get_stack_trim_stats(StackTrimStats* stats);
+
     inline StackContainer* get_stack(const int type, void(*entry)(intptr_t)) {
         switch(type) {
             case StackType::STACK_TYPE_PTHREAD:
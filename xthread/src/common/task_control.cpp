@@ -0,0 +1,239 @@
+#include <unistd.h>
+#include <limits.h>
+#include <sched.h>
+#include <new>
+#include "task_control.h"
+#include "task_group.h"
+#include "macros.h"
+#include "util.h"
+#include "log.h"
+#include "../base/futex.h"
+
+namespace xthread
+{
+    TaskControl::TaskControl()
+        : stop_(false),
+          concurrency_(0),
+          next_group_(0) {
+    }
+
+    TaskControl::~TaskControl() {
+        stop_and_join();
+        for (size_t i = 0; i < groups_.size(); ++i) {
+            delete groups_[i];
+        }
+        groups_.clear();
+    }
+
+    void* TaskControl::worker_thread(void* arg) {
+        TaskGroup* g = static_cast<TaskGroup*>(arg);
+        g->run_main_task();
+        return NULL;
+    }
+
+    int TaskControl::init(int concurrency) {
+        if (concurrency_ != 0) {
+            return -1;
+        }
+        if (concurrency <= 0 || concurrency > MAX_CONCURRENCY) {
+            return -1;
+        }
+        // 先创建所有的TaskGroup再启动工作线程, 工作线程运行时groups_不再变化
+        for (int i = 0; i < concurrency; ++i) {
+            TaskGroup* g = new (std::nothrow) TaskGroup(this, static_cast<size_t>(i));
+            if (g == NULL || g->init(RUNQUEUE_CAPACITY, REMOTE_QUEUE_CAPACITY) != 0) {
+                delete g;
+                return -1;
+            }
+            groups_.push_back(g);
+        }
+        concurrency_ = concurrency;
+        for (int i = 0; i < concurrency; ++i) {
+            pthread_t tid;
+            if (pthread_create(&tid, NULL, TaskControl::worker_thread, groups_[i]) != 0) {
+                log_error("create worker thread failed");
+                stop_and_join();
+                return -1;
+            }
+            workers_.push_back(tid);
+        }
+        return 0;
+    }
+
+    void TaskControl::stop_and_join() {
+        stop_.store(true, std::memory_order_release);
+        for (size_t i = 0; i < PARKING_LOT_NUM; ++i) {
+            pl_[i].stop();
+        }
+        for (size_t i = 0; i < workers_.size(); ++i) {
+            pthread_join(workers_[i], NULL);
+        }
+        workers_.clear();
+    }
+
+    TaskGroup* TaskControl::choose_one_group() {
+        const size_t ngroup = groups_.size();
+        if (unlikely(ngroup == 0)) {
+            return NULL;
+        }
+        return groups_[next_group_.fetch_add(1, std::memory_order_relaxed) % ngroup];
+    }
+
+    int TaskControl::start_task(TaskId* tid, TaskFn fn, void* arg, int stack_type) {
+        if (unlikely(stopped() || concurrency_ == 0)) {
+            return -1;
+        }
+        TaskGroup* g = get_current_task_group();
+        if (g != NULL && g->control() == this) {
+            return g->start_background(tid, fn, arg, stack_type);
+        }
+        TaskMeta* m = TaskGroup::new_meta(tid, fn, arg, stack_type);
+        if (unlikely(m == NULL)) {
+            return -1;
+        }
+        return ready_to_run_remote(m);
+    }
+
+    int TaskControl::start_task_in_group(size_t group_index, TaskId* tid, TaskFn fn, void* arg, int stack_type) {
+        if (unlikely(stopped() || concurrency_ == 0)) {
+            return -1;
+        }
+        if (group_index >= groups_.size()) {
+            return start_task(tid, fn, arg, stack_type);
+        }
+        TaskMeta* m = TaskGroup::new_meta(tid, fn, arg, stack_type);
+        if (unlikely(m == NULL)) {
+            return -1;
+        }
+        TaskGroup* g = groups_[group_index];
+        if (g->ready_to_run_remote(m->tid)) {
+            signal_task(1, g->index());
+            return 0;
+        }
+        return ready_to_run_remote(m);
+    }
+
+    int TaskControl::ready_to_run_remote(TaskMeta* m) {
+        // 选中的group队列满时尝试下一个, 全部满了则让出CPU等待工作线程消费
+        const size_t ngroup = groups_.size();
+        while (true) {
+            for (size_t i = 0; i < ngroup; ++i) {
+                TaskGroup* g = choose_one_group();
+                if (g->ready_to_run_remote(m->tid)) {
+                    signal_task(1, g->index());
+                    return 0;
+                }
+            }
+            if (unlikely(stopped())) {
+                TaskGroup::release_task(m);
+                return -1;
+            }
+            signal_task(concurrency_, 0);
+            sched_yield();
+        }
+    }
+
+    int TaskControl::join_task(TaskId tid) {
+        TaskMeta* m = TaskGroup::address_meta(tid);
+        if (unlikely(m == NULL)) {
+            return -1;
+        }
+        const uint32_t expected_version = get_task_version(tid);
+        if (expected_version == 0) {
+            return -1;
+        }
+        m->nwaiters.fetch_add(1, std::memory_order_seq_cst);
+        while (m->version.load(std::memory_order_seq_cst) == expected_version) {
+            base::futex_wait_private(&m->version, static_cast<int>(expected_version), NULL);
+        }
+        m->nwaiters.fetch_sub(1, std::memory_order_relaxed);
+        return 0;
+    }
+
+    // 偷取时遍历的步长, 和group数量互质时才能遍历到所有的group
+    static const size_t STEAL_OFFSETS[] = {1, 3, 5, 7, 11, 13, 17, 19, 23, 29, 31, 37, 41, 43, 47, 53};
+
+    size_t TaskControl::steal_tasks(TaskId* tids, size_t max, uint64_t* seed) {
+        const size_t ngroup = groups_.size();
+        if (unlikely(ngroup == 0)) {
+            return 0;
+        }
+        const uint64_t r = xorshift64(seed);
+        size_t offset = STEAL_OFFSETS[(r >> 32) % ARRAY_SIZE(STEAL_OFFSETS)];
+        if (gcd(offset, ngroup) != 1) {
+            offset = 1;
+        }
+        size_t s = static_cast<size_t>(r % ngroup);
+        for (size_t i = 0; i < ngroup; ++i, s = (s + offset) % ngroup) {
+            const size_t n = groups_[s]->steal_batch(tids, max);
+            if (n != 0) {
+                return n;
+            }
+        }
+        return 0;
+    }
+
+    void TaskControl::get_steal_stats(StealStats* stats) const {
+        stats->nsuccess = 0;
+        stats->nfail = 0;
+        stats->nstolen = 0;
+        for (size_t i = 0; i < groups_.size(); ++i) {
+            const TaskGroup* g = groups_[i];
+            stats->nsuccess += g->nsteal_success_.load(std::memory_order_relaxed);
+            stats->nfail += g->nsteal_fail_.load(std::memory_order_relaxed);
+            stats->nstolen += g->nstolen_.load(std::memory_order_relaxed);
+        }
+    }
+
+    void TaskControl::get_inline_task_stats(InlineTaskStats* stats) const {
+        stats->ninline = 0;
+        stats->npromoted = 0;
+        for (size_t i = 0; i < groups_.size(); ++i) {
+            const TaskGroup* g = groups_[i];
+            stats->ninline += g->ninline_.load(std::memory_order_relaxed);
+            stats->npromoted += g->npromoted_.load(std::memory_order_relaxed);
+        }
+    }
+
+    void TaskControl::signal_task(int num_task, size_t hint) {
+        size_t index = hint % PARKING_LOT_NUM;
+        for (size_t i = 0; i < PARKING_LOT_NUM && num_task > 0; ++i) {
+            num_task -= pl_[index].signal(num_task);
+            index = (index + 1) % PARKING_LOT_NUM;
+        }
+    }
+
+    static pthread_once_t g_task_control_once = PTHREAD_ONCE_INIT;
+    static TaskControl* g_task_control = NULL;
+
+    static void init_global_task_control() {
+        g_task_control = new (std::nothrow) TaskControl();
+        long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        int concurrency = (ncpu > 0 ? static_cast<int>(ncpu) : 1);
+        if (concurrency > TaskControl::MAX_CONCURRENCY) {
+            concurrency = TaskControl::MAX_CONCURRENCY;
+        }
+        g_task_control->init(concurrency);
+    }
+
+    TaskControl* get_or_create_global_task_control() {
+        pthread_once(&g_task_control_once, init_global_task_control);
+        return g_task_control;
+    }
+
+    int start_task(TaskId* tid, TaskFn fn, void* arg) {
+        return get_or_create_global_task_control()->start_task(tid, fn, arg);
+    }
+
+    int join_task(TaskId tid) {
+        return TaskControl::join_task(tid);
+    }
+
+    void yield_task() {
+        TaskGroup::yield();
+    }
+
+    TaskId current_task() {
+        return TaskGroup::current_tid();
+    }
+}
@@ -0,0 +1,102 @@
+#ifndef XTHREAD_TASK_CONTROL_H
+#define XTHREAD_TASK_CONTROL_H
+#include <vector>
+#include <atomic>
+#include <pthread.h>
+#include "task_meta.h"
+#include "parking_lot.h"
+#include "../base/noncopyable.h"
+namespace xthread {
+class TaskGroup;
+
+struct StealStats {
+    // 成功/失败的偷取轮数, 以及偷取到的task总数
+    uint64_t nsuccess;
+    uint64_t nfail;
+    uint64_t nstolen;
+};
+
+struct InlineTaskStats {
+    // STACK_TYPE_PTHREAD的task直接在调度栈上运行完成的数量, 以及挂起时被提升为独立栈的数量
+    uint64_t ninline;
+    uint64_t npromoted;
+};
+
+// M:N调度: concurrency个工作线程, 每个线程拥有一个TaskGroup,
+// 空闲的工作线程从其他TaskGroup中偷取任务
+class TaskControl : base::NonCopyable {
+public:
+    static const int MAX_CONCURRENCY = 1024;
+    // 本地队列的初始容量, 队列满时自动扩容
+    static const size_t RUNQUEUE_CAPACITY = 256;
+    // 每个TaskGroup接收其他线程投递任务的队列容量, 不会扩容
+    static const size_t REMOTE_QUEUE_CAPACITY = 2048;
+    // 空闲工作线程按照TaskGroup的下标分散在多个ParkingLot上等待
+    static const size_t PARKING_LOT_NUM = 4;
+
+    TaskControl();
+    ~TaskControl();
+
+    int init(int concurrency);
+    // 停止所有工作线程, 队列中还未运行的task被丢弃
+    void stop_and_join();
+
+    int concurrency() const {
+        return concurrency_;
+    }
+
+    bool stopped() const {
+        return stop_.load(std::memory_order_acquire);
+    }
+
+    // 任意线程都可以调用, 在工作线程中调用时task放入当前线程的队列
+    int start_task(TaskId* tid, TaskFn fn, void* arg,
+            int stack_type = StackType::STACK_TYPE_NORMAL);
+
+    // 优先放入第group_index个TaskGroup的远程队列, 队列满或者下标不合法时和start_task一样选择其他TaskGroup
+    int start_task_in_group(size_t group_index, TaskId* tid, TaskFn fn, void* arg,
+            int stack_type = StackType::STACK_TYPE_NORMAL);
+
+    // 阻塞当前线程直到task结束, 在task中调用会阻塞整个工作线程
+    static int join_task(TaskId tid);
+
+    // 以随机的顺序遍历所有TaskGroup, 从第一个有任务的TaskGroup批量偷取最多max个任务,
+    // seed为调用者的xorshift状态, 返回偷取到的数量
+    size_t steal_tasks(TaskId* tids, size_t max, uint64_t* seed);
+
+    void get_steal_stats(StealStats* stats) const;
+    void get_inline_task_stats(InlineTaskStats* stats) const;
+
+    // 最多唤醒num_task个等待任务的工作线程, 优先唤醒第hint个TaskGroup所在ParkingLot上的线程,
+    // 没有等待者时再依次尝试其他的ParkingLot
+    void signal_task(int num_task, size_t hint);
+
+    ParkingLot* parking_lot(size_t group_index) {
+        return &pl_[group_index % PARKING_LOT_NUM];
+    }
+
+    TaskGroup* choose_one_group();
+
+private:
+    static void* worker_thread(void* arg);
+    // 把其他线程创建的task放入某个TaskGroup的远程队列
+    int ready_to_run_remote(TaskMeta* m);
+
+private:
+    std::atomic<bool> stop_;
+    int concurrency_;
+    std::vector<TaskGroup*> groups_;
+    std::vector<pthread_t> workers_;
+    std::atomic<size_t> next_group_;
+
+    ParkingLot pl_[PARKING_LOT_NUM];
+};
+
+TaskControl* get_or_create_global_task_control();
+
+int start_task(TaskId* tid, TaskFn fn, void* arg);
+int join_task(TaskId tid);
+void yield_task();
+TaskId current_task();
+}
+#endif
@@ -0,0 +1,323 @@
+#include <limits.h>
+#include <sched.h>
+#include <new>
+#include "task_group.h"
+#include "task_control.h"
+#include "macros.h"
+#include "util.h"
+#include "obj_pool/resource_pool.h"
+#include "../base/futex.h"
+
+namespace xthread
+{
+    static thread_local TaskGroup* tls_task_group = NULL;
+
+    // 一次最多偷取的任务数量
+    static const size_t STEAL_BATCH_SIZE = 32;
+    // 进入futex等待之前自旋重试的轮数, 每轮执行SPIN_PAUSES次pause
+    static const int WAIT_SPIN_ROUNDS = 16;
+    static const int SPIN_PAUSES = 64;
+
+    // task可能在yield之后被其他工作线程恢复运行, 编译器可能缓存TLS变量的地址,
+    // 所以每次都通过不内联的函数重新读取
+    __attribute__((noinline)) TaskGroup* get_current_task_group() {
+        return tls_task_group;
+    }
+
+    __attribute__((noinline)) static void set_current_task_group(TaskGroup* g) {
+        tls_task_group = g;
+    }
+
+    TaskGroup::TaskGroup(TaskControl* control, size_t index)
+        : control_(control),
+          index_(index),
+          pl_(control->parking_lot(index)),
+          pthread_stack_(NULL),
+          main_stack_(NULL),
+          cur_meta_(NULL),
+          remained_fn_(NULL),
+          remained_arg_(NULL),
+          steal_seed_(fmix64(index + 1)),
+          nsteal_success_(0),
+          nsteal_fail_(0),
+          nstolen_(0),
+          ninline_(0),
+          npromoted_(0) {
+    }
+
+    TaskGroup::~TaskGroup() {
+    }
+
+    int TaskGroup::init(size_t runqueue_capacity, size_t remote_queue_capacity) {
+        if (!rq_.init(runqueue_capacity, true)) {
+            return -1;
+        }
+        if (!remote_rq_.init(remote_queue_capacity)) {
+            return -1;
+        }
+        return 0;
+    }
+
+    TaskMeta* TaskGroup::address_meta(TaskId tid) {
+        base::ResourceId<TaskMeta> id;
+        id.value = get_task_slot(tid);
+        return base::ResourcePool<TaskMeta>::get_addr_by_id_safe(id);
+    }
+
+    TaskMeta* TaskGroup::new_meta(TaskId* tid, TaskFn fn, void* arg, int stack_type) {
+        base::ResourceId<TaskMeta> id;
+        TaskMeta* m = base::get_resource<TaskMeta>(&id);
+        if (unlikely(m == NULL)) {
+            return NULL;
+        }
+        m->fn = fn;
+        m->arg = arg;
+        m->stack_type = stack_type;
+        m->stack = NULL;
+        m->tid = make_task_id(m->version.load(std::memory_order_relaxed), id.value);
+        *tid = m->tid;
+        return m;
+    }
+
+    int TaskGroup::start_background(TaskId* tid, TaskFn fn, void* arg, int stack_type) {
+        TaskMeta* m = new_meta(tid, fn, arg, stack_type);
+        if (unlikely(m == NULL)) {
+            return -1;
+        }
+        ready_to_run(m->tid);
+        control_->signal_task(1, index_);
+        return 0;
+    }
+
+    void TaskGroup::ready_to_run(TaskId tid) {
+        while (unlikely(!rq_.push(tid))) {
+            // 本地队列扩容失败, 放入remote_rq_, 也满了则等待其他线程取走
+            if (ready_to_run_remote(tid)) {
+                return;
+            }
+            sched_yield();
+        }
+    }
+
+    bool TaskGroup::ready_to_run_remote(TaskId tid) {
+        return remote_rq_.push(tid);
+    }
+
+    bool TaskGroup::pop_remote_rq(TaskId* tid) {
+        TaskId tids[STEAL_BATCH_SIZE];
+        const size_t n = remote_rq_.pop_batch(tids, STEAL_BATCH_SIZE);
+        if (n == 0) {
+            return false;
+        }
+        // 运行第一个, 其余的逆序放入本地队列, 拥有者pop时仍然按照提交的顺序运行
+        *tid = tids[0];
+        for (size_t i = n - 1; i > 0; --i) {
+            ready_to_run(tids[i]);
+        }
+        if (n > 1) {
+            control_->signal_task(1, index_);
+        }
+        return true;
+    }
+
+    size_t TaskGroup::steal_batch(TaskId* tids, size_t max) {
+        const size_t n = rq_.steal_batch(tids, max);
+        if (n != 0) {
+            return n;
+        }
+        return remote_rq_.pop_batch(tids, max);
+    }
+
+    bool TaskGroup::steal_task(TaskId* tid) {
+        TaskId tids[STEAL_BATCH_SIZE];
+        const size_t n = control_->steal_tasks(tids, STEAL_BATCH_SIZE, &steal_seed_);
+        if (n == 0) {
+            nsteal_fail_.store(nsteal_fail_.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+            return false;
+        }
+        nsteal_success_.store(nsteal_success_.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        nstolen_.store(nstolen_.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+        // 运行第一个, 其余的放入本地队列, 其他空闲线程可以继续从这里偷取
+        *tid = tids[0];
+        for (size_t i = 1; i < n; ++i) {
+            ready_to_run(tids[i]);
+        }
+        if (n > 1) {
+            control_->signal_task(1, index_);
+        }
+        return true;
+    }
+
+    bool TaskGroup::wait_task(TaskId* tid) {
+        while (true) {
+            if (rq_.pop(tid) || pop_remote_rq(tid)) {
+                return true;
+            }
+            // 先读取状态再偷取, 偷取失败之后如果有新任务到来, wait会立即返回
+            const ParkingLot::State st = pl_->get_state();
+            if (st.stopped() || control_->stopped()) {
+                return false;
+            }
+            if (steal_task(tid)) {
+                return true;
+            }
+            // 任务经常在很短的时间内到来, 先自旋几轮再进入内核等待
+            for (int i = 0; i < WAIT_SPIN_ROUNDS && pl_->get_state() == st; ++i) {
+                for (int j = 0; j < SPIN_PAUSES; ++j) {
+                    cpu_relax();
+                }
+                if (pop_remote_rq(tid) || steal_task(tid)) {
+                    return true;
+                }
+            }
+            pl_->wait(st);
+        }
+    }
+
+    /*
+     *  调度循环运行在从栈池中获取的栈上, 而不是工作线程自身的栈上:
+     *  STACK_TYPE_PTHREAD的task直接在调度栈上运行, 挂起时把当前的调度栈交给task,
+     *  调度循环换到新的栈上继续, 工作线程自身的栈只用于退出
+     */
+    void TaskGroup::run_main_task() {
+        pthread_stack_ = get_stack(StackType::STACK_TYPE_MAIN, NULL);
+        if (unlikely(pthread_stack_ == NULL)) {
+            return;
+        }
+        main_stack_ = get_stack(StackType::STACK_TYPE_NORMAL, TaskGroup::main_loop_entry);
+        if (unlikely(main_stack_ == NULL)) {
+            return_stack(pthread_stack_);
+            pthread_stack_ = NULL;
+            return;
+        }
+        set_current_task_group(this);
+        jump(&pthread_stack_->context, main_stack_->context);
+        // 调度循环结束, 此时已经回到工作线程自身的栈上
+        set_current_task_group(NULL);
+        return_stack(main_stack_);
+        main_stack_ = NULL;
+        return_stack(pthread_stack_);
+        pthread_stack_ = NULL;
+    }
+
+    void TaskGroup::main_loop_entry(intptr_t) {
+        TaskGroup* g = get_current_task_group();
+        // 由挂起的STACK_TYPE_PTHREAD task启动时, 需要把它放回队列
+        g->cur_meta_ = NULL;
+        g->run_remained();
+        TaskId tid;
+        while (g->wait_task(&tid)) {
+            g->sched_to(tid);
+        }
+        jump(&g->main_stack_->context, g->pthread_stack_->context);
+    }
+
+    void TaskGroup::sched_to(TaskId tid) {
+        TaskMeta* m = address_meta(tid);
+        if (unlikely(m == NULL)) {
+            return;
+        }
+        if (m->stack == NULL && m->stack_type != StackType::STACK_TYPE_PTHREAD) {
+            m->stack = get_stack(m->stack_type, TaskGroup::task_runner);
+        }
+        cur_meta_ = m;
+        if (m->stack != NULL) {
+            jump(&main_stack_->context, m->stack->context);
+        }
+        else {
+            // 没有独立的栈(STACK_TYPE_PTHREAD或者分配失败), 直接在调度栈上运行
+            m->fn(m->arg);
+            if (unlikely(m->stack != NULL)) {
+                // 运行期间挂起过, 当前栈已经属于task, 这里和task_runner的结尾一样处理.
+                // task可能已经迁移到其他工作线程, 这个栈上原来的调度循环不会再恢复
+                TaskGroup* g = get_current_task_group();
+                g->set_remained(TaskGroup::release_task, m);
+                jump(&m->stack->context, g->main_stack_->context);
+            }
+            ninline_.store(ninline_.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+            set_remained(TaskGroup::release_task, m);
+        }
+        cur_meta_ = NULL;
+        run_remained();
+    }
+
+    void TaskGroup::run_remained() {
+        if (remained_fn_) {
+            void (*fn)(void*) = remained_fn_;
+            remained_fn_ = NULL;
+            fn(remained_arg_);
+        }
+    }
+
+    void TaskGroup::task_runner(intptr_t) {
+        TaskGroup* g = get_current_task_group();
+        TaskMeta* m = g->cur_meta_;
+        m->fn(m->arg);
+
+        // task可能已经迁移到其他工作线程
+        g = get_current_task_group();
+        g->set_remained(TaskGroup::release_task, m);
+        jump(&m->stack->context, g->main_stack_->context);
+    }
+
+    void TaskGroup::release_task(void* arg) {
+        TaskMeta* m = static_cast<TaskMeta*>(arg);
+        return_stack(m->stack);
+        m->stack = NULL;
+        base::ResourceId<TaskMeta> id;
+        id.value = get_task_slot(m->tid);
+
+        uint32_t version = m->version.fetch_add(1, std::memory_order_seq_cst) + 1;
+        if (unlikely(version == 0)) {
+            // 0不是合法的version
+            m->version.fetch_add(1, std::memory_order_seq_cst);
+        }
+        if (m->nwaiters.load(std::memory_order_seq_cst) > 0) {
+            base::futex_wake_private(&m->version, INT_MAX);
+        }
+        base::return_resource<TaskMeta>(id);
+    }
+
+    void TaskGroup::ready_to_run_in_worker(void* arg) {
+        TaskMeta* m = static_cast<TaskMeta*>(arg);
+        // rq_是LIFO的, 放入rq_会被立刻重新调度, 所以放入FIFO的remote_rq_
+        TaskGroup* g = get_current_task_group();
+        if (unlikely(!g->ready_to_run_remote(m->tid))) {
+            g->ready_to_run(m->tid);
+        }
+    }
+
+    void TaskGroup::yield() {
+        TaskGroup* g = get_current_task_group();
+        if (g == NULL || g->cur_meta_ == NULL) {
+            return;
+        }
+        TaskMeta* m = g->cur_meta_;
+        if (m->stack == NULL && !g->promote_inline_task(m)) {
+            return;
+        }
+        // 切换回调度栈之后才能放入队列, 否则可能被其他线程偷走并在当前栈上运行
+        g->set_remained(TaskGroup::ready_to_run_in_worker, m);
+        jump(&m->stack->context, g->main_stack_->context);
+    }
+
+    bool TaskGroup::promote_inline_task(TaskMeta* m) {
+        // 当前的调度栈交给task, 调度循环从新的栈的main_loop_entry重新开始
+        StackContainer* loop = get_stack(StackType::STACK_TYPE_NORMAL, TaskGroup::main_loop_entry);
+        if (unlikely(loop == NULL)) {
+            return false;
+        }
+        m->stack = main_stack_;
+        main_stack_ = loop;
+        npromoted_.store(npromoted_.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        return true;
+    }
+
+    TaskId TaskGroup::current_tid() {
+        TaskGroup* g = get_current_task_group();
+        if (g == NULL || g->cur_meta_ == NULL) {
+            return INVALID_TASK_ID;
+        }
+        return g->cur_meta_->tid;
+    }
+}
@@ -1,9 +1,104 @@
 #ifndef XTHREAD_TASK_GROUP_H
 #define XTHREAD_TASK_GROUP_H
+#include "task_meta.h"
+#include "work_stealing_queue.h"
+#include "remote_task_queue.h"
+#include "parking_lot.h"
+#include "../base/noncopyable.h"
 namespace xthread {
 class TaskControl;
-class TaskGroup {
 
+// 每个工作线程拥有一个TaskGroup, 只有拥有者线程可以push/pop本地队列rq_,
+// 其他线程通过steal获取任务, 非工作线程通过remote_rq_投递任务
+class TaskGroup : base::NonCopyable {
+public:
+    TaskGroup(TaskControl* control, size_t index);
+    ~TaskGroup();
+
+    int init(size_t runqueue_capacity, size_t remote_queue_capacity);
+
+    // 工作线程的调度循环, 直到TaskControl停止才返回
+    void run_main_task();
+
+    // 在当前group中创建task, 只能由拥有者线程调用
+    int start_background(TaskId* tid, TaskFn fn, void* arg, int stack_type);
+
+    // 将task放入本地队列, 只能由拥有者线程调用
+    void ready_to_run(TaskId tid);
+    // 任意线程都可以调用, remote_rq_满时返回false
+    bool ready_to_run_remote(TaskId tid);
+
+    // 被其他工作线程调用, 本地队列为空时从remote_rq_中批量取出
+    size_t steal_batch(TaskId* tids, size_t max);
+
+    TaskControl* control() const {
+        return control_;
+    }
+
+    size_t index() const {
+        return index_;
+    }
+
+    // 让出CPU, 当前task重新进入队列尾部
+    static void yield();
+    // 当前正在运行的task, 不在task中调用时返回INVALID_TASK_ID
+    static TaskId current_tid();
+
+    static TaskMeta* address_meta(TaskId tid);
+    // 分配TaskMeta并生成TaskId, 不会放入任何队列
+    static TaskMeta* new_meta(TaskId* tid, TaskFn fn, void* arg, int stack_type);
+
+private:
+    bool wait_task(TaskId* tid);
+    bool steal_task(TaskId* tid);
+    bool pop_remote_rq(TaskId* tid);
+    void sched_to(TaskId tid);
+
+    // 在切换回调度栈之后执行, 此时原task的栈已经不再被使用
+    void set_remained(void (*fn)(void*), void* arg) {
+        remained_fn_ = fn;
+        remained_arg_ = arg;
+    }
+    void run_remained();
+
+    // 把在调度栈上直接运行的task提升为拥有独立栈的task, 失败时返回false
+    bool promote_inline_task(TaskMeta* m);
+
+    static void main_loop_entry(intptr_t);
+    static void task_runner(intptr_t);
+    static void release_task(void* arg);
+    static void ready_to_run_in_worker(void* arg);
+
+private:
+    TaskControl* control_;
+    size_t index_;
+    // 没有任务时在这里等待
+    ParkingLot* pl_;
+    WorkStealingQueue<TaskId> rq_;
+
+    RemoteTaskQueue<TaskId> remote_rq_;
+
+    // 工作线程自身的栈, 调度循环结束时切换回这里
+    StackContainer* pthread_stack_;
+    // 调度循环所在的栈
+    StackContainer* main_stack_;
+    TaskMeta* cur_meta_;
+
+    void (*remained_fn_)(void*);
+    void* remained_arg_;
+
+    // xorshift状态, 决定偷取时的遍历顺序
+    uint64_t steal_seed_;
+    // 只被拥有者线程修改
+    std::atomic<uint64_t> nsteal_success_;
+    std::atomic<uint64_t> nsteal_fail_;
+    std::atomic<uint64_t> nstolen_;
+    // 直接在调度栈上运行完成的task数量, 以及挂起时被提升为独立栈的数量
+    std::atomic<uint64_t> ninline_;
+    std::atomic<uint64_t> npromoted_;
+    friend class TaskControl;
 };
+
+TaskGroup* get_current_task_group();
 }
 #endif
@@ -0,0 +1,53 @@
+#ifndef XTHREAD_COMMON_TASK_META_H
+#define XTHREAD_COMMON_TASK_META_H
+#include <stdint.h>
+#include <atomic>
+#include "stack.h"
+
+namespace xthread
+{
+    // TaskId : 高32位为version, 低32位为TaskMeta在ResourcePool中的slot
+    typedef uint64_t TaskId;
+    const TaskId INVALID_TASK_ID = 0;
+
+    typedef void* (*TaskFn)(void*);
+
+    struct TaskMeta {
+        // task结束时version加一, join在version上做futex等待
+        std::atomic<uint32_t> version;
+        // 正在join的线程数量, 为0时结束task不需要调用futex_wake
+        std::atomic<int> nwaiters;
+
+        TaskFn fn;
+        void* arg;
+        TaskId tid;
+        int stack_type;
+        // 第一次被调度时才分配
+        StackContainer* stack;
+
+        TaskMeta()
+            : version(1),
+              nwaiters(0),
+              fn(NULL),
+              arg(NULL),
+              tid(INVALID_TASK_ID),
+              stack_type(StackType::STACK_TYPE_NORMAL),
+              stack(NULL)
+        {
+
+        }
+    };
+
+    inline TaskId make_task_id(uint32_t version, uint64_t slot) {
+        return (static_cast<uint64_t>(version) << 32) | (slot & 0xFFFFFFFFUL);
+    }
+
+    inline uint64_t get_task_slot(TaskId tid) {
+        return tid & 0xFFFFFFFFUL;
+    }
+
+    inline uint32_t get_task_version(TaskId tid) {
+        return static_cast<uint32_t>(tid >> 32);
+    }
+}
+#endif
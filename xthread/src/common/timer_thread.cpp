@@ -1,362 +1,1620 @@
-#include <list>
-#include <memory>
 #include <limits>
 #include <atomic>
 #include <algorithm>
 #include <new>
+#include <stdlib.h>
+#include <limits.h>
 #include "timer_thread.h"
+#include "task_meta.h"
+#include "task_group.h"
+#include "task_control.h"
 #include "macros.h"
-#include "../base/lock.h"
-#include "../base/lock_guard.h"
 #include "../base/time.h"
 #include "../base/futex.h"
 #include "log.h"
+#include "obj_pool/resource_pool.h"
+#include "obj_pool/object_pool_in.h"
+#include "../base/lock.h"
+#include "../base/lock_guard.h"
 
 namespace xthread
 {
     TimerThreadOptions::TimerThreadOptions()
         : num_buckets(12),
+        num_shards(1),
         begin_fn(NULL),
         end_fn(NULL),
-        args(NULL){
+        args(NULL),
+        engine(ENGINE_HEAP),
+        wheel_tick_us(1000),
+        executor(EXECUTOR_INLINE),
+        executor_threads(2),
+        task_control(NULL),
+        slow_callback_us(10000),
+        use_tsc(false),
+        slack_ns(0){
 
         }
 
-    struct TimerThreadTaskStat {
-        static const uint32_t TASK_STATUS_INIT     = 0;
-        static const uint32_t TASK_STATUS_RUNNING  = 1;
-        static const uint32_t TASK_STATUS_FINISHED = 2;
+    const TimerThread::TaskId TimerThread::INVALID_TASK_ID;
+    const int TimerThreadStats::LATENESS_BUCKET_NUM;
+
+    /*
+     *  Task在TimerThread中的位置, 只被TimerThread访问(schedule时在压入Bucket之前初始化).
+     *  被取消的Task只在TimerThread处理取消链表时归还, 保证只归还一次
+     */
+    struct TimerThreadTaskState {
+        // 还在Bucket中
+        static const int IN_BUCKET    = 0;
+        // 在Engine中
+        static const int IN_ENGINE    = 1;
+        // 已经被取消并且不在Bucket/Engine中, 等待处理取消链表时归还
+        static const int DETACHED     = 2;
+        // 处理取消链表时还在Bucket中, 取出时直接归还
+        static const int CANCEL_SEEN  = 3;
     };
 
+    /*
+     *  Task从ResourcePool中分配, TaskId的高32位是调度时的version, 低32位是slot.
+     *  version等于id中的version时Task等待执行, 加1表示正在执行, 加2表示已经结束或者被取消,
+     *  Task只由TimerThread归还给ResourcePool, 归还之后旧的TaskId因为version不同而失效
+     */
     struct TimerThread::Task
     {
+        // Bucket中的单向链表, 进入时间轮之后和prev组成槽中的双向链表
+        Task* next;
+        Task* prev;
+        // 取消链表
+        Task* cancel_next;
+        // TimerThread::now_ns()时间轴上的到期时间
         int64_t run_time;
         void (*fn)(void*);
         void *arg;
 
         TaskId task_id;
-        std::atomic<uint32_t> task_status;
+        std::atomic<uint32_t> version;
+
+        // 周期Task的周期, 一次性的Task为0
+        int64_t period_ns;
+        int periodic_flags;
+        // 调度时选择的分片
+        Shard* shard;
+        // 交给xthread执行时优先投递到的TaskGroup, -1表示不指定
+        int owner;
+        // 在Engine中的位置: 堆中的下标或者时间轮的槽号, 不在Engine中时为-1
+        int engine_index;
+        int state;
 
-        bool run_and_del();
-        bool try_del();
+        Task()
+            : next(NULL),
+            prev(NULL),
+            cancel_next(NULL),
+            run_time(0),
+            fn(NULL),
+            arg(NULL),
+            task_id(INVALID_TASK_ID),
+            version(2),
+            period_ns(0),
+            periodic_flags(0),
+            shard(NULL),
+            owner(-1),
+            engine_index(-1),
+            state(TimerThreadTaskState::IN_BUCKET)
+        {
+
+        }
+
+        // 把Task置为正在执行, 已经被取消时返回false
+        bool claim();
+        // 执行claim成功的一次性Task并归还
+        void run_and_del();
+        bool cancelled() const;
     };
 
+    // TaskId的编码和TaskMeta相同, 使用task_meta.h中的make_task_id/get_task_slot/get_task_version
+    inline TimerThread::Task* address_task(TimerThread::TaskId task_id) {
+        base::ResourceId<TimerThread::Task> id;
+        id.value = get_task_slot(task_id);
+        return base::ResourcePool<TimerThread::Task>::get_addr_by_id_safe(id);
+    }
+
+    // now + delay_ns, 很大的delay_ns截断为int64_t的最大值, 避免溢出
+    inline int64_t add_delay_ns(int64_t now, int64_t delay_ns) {
+        if (delay_ns > std::numeric_limits<int64_t>::max() - now) {
+            return std::numeric_limits<int64_t>::max();
+        }
+        return now + delay_ns;
+    }
+
+    inline void return_task(TimerThread::Task* task) {
+        base::ResourceId<TimerThread::Task> id;
+        id.value = get_task_slot(task->task_id);
+        base::return_resource<TimerThread::Task>(id);
+    }
+
 
+    /*
+     *  无锁的侵入式栈: 任意线程CAS压入, TimerThread一次exchange取走整条链表.
+     *  _nearest_run_time是链表中最早的run_time的提示值, 只可能偏小:
+     *  TimerThread先重置提示值再取走链表, 两者之间压入的Task被取走后提示值仍然保留,
+     *  所以TimerThread计算睡眠时间时要把所有Bucket的提示值也算进去
+     */
     class TimerThread::Bucket {
         public:
-            typedef std::list<std::shared_ptr<TimerThread::Task> >* TaskListPtr;
             Bucket()
-                : _nearest_run_time(std::numeric_limits<int64_t>::max())
+                : _nearest_run_time(std::numeric_limits<int64_t>::max()),
+                tasks_(NULL),
+                _ntask(0)
             {
-                tasks_ = new (std::nothrow) std::list<std::shared_ptr<TimerThread::Task> >();
             }
 
-            ~Bucket() {
-                delete tasks_;
+            // 压入Task, wake_time为最晚需要唤醒分片线程的时间, 提示值因此变小时返回true
+            bool push(Task* task, int64_t wake_time);
+            // 取出所有的Task, 通过Task::next串成链表, 处理完之后调用consumed减去取出的数量
+            Task* consume_tasks();
+            void consumed(int64_t n) {
+                _ntask.fetch_sub(n, std::memory_order_relaxed);
+            }
+            // 还没有被分片线程取走的Task数量
+            int64_t size() const {
+                return _ntask.load(std::memory_order_relaxed);
             }
 
-            std::weak_ptr<TimerThread::Task> schedule(void (*fn)(void*), void* arg, const timespec& abstime, bool* earlier);
-            TaskListPtr consume_tasks();
+            int64_t nearest_run_time() const {
+                return _nearest_run_time.load(std::memory_order_seq_cst);
+            }
 
         private:
-            base::MutexLock lock_;
-            int64_t _nearest_run_time;
-            TaskListPtr tasks_;
+            std::atomic<int64_t> _nearest_run_time;
+            std::atomic<Task*> tasks_;
+            std::atomic<int64_t> _ntask;
+            char pad_[XTHREAD_CACHELINE_SIZE - 2 * sizeof(std::atomic<int64_t>) - sizeof(std::atomic<Task*>)];
     };
 
 
-    TimerThread::Bucket::TaskListPtr TimerThread::Bucket::consume_tasks() {
-        TaskListPtr ret = NULL;
-        base::MutexGuard<base::MutexLock>  guard(lock_);
-        ret = tasks_;
-        tasks_ = new (std::nothrow) std::list<std::shared_ptr<TimerThread::Task> >();
-        _nearest_run_time = std::numeric_limits<int64_t>::max();
-        return ret;
+    TimerThread::Task* TimerThread::Bucket::consume_tasks() {
+        if (tasks_.load(std::memory_order_relaxed) == NULL &&
+                _nearest_run_time.load(std::memory_order_relaxed) == std::numeric_limits<int64_t>::max()) {
+            return NULL;
+        }
+        _nearest_run_time.store(std::numeric_limits<int64_t>::max(), std::memory_order_seq_cst);
+        return tasks_.exchange(NULL, std::memory_order_acquire);
     }
 
-    std::weak_ptr<TimerThread::Task>  TimerThread::Bucket::schedule(void (*fn)(void*),
-            void* arg,
-            const timespec& abstime,
-            bool *earlier) {
-        std::shared_ptr<Task> spTask = std::make_shared<TimerThread::Task>();
-        if (unlikely(spTask == NULL)) {
-            *earlier = false;
-            return std::weak_ptr<TimerThread::Task>();
-        }
-        Task* pTask = spTask.get();
-        pTask->fn = fn;
-        pTask->arg = arg;
-        pTask->run_time = xthread::base::timespec_to_microseconds(abstime);
-        pTask->task_status.store(TimerThreadTaskStat::TASK_STATUS_INIT, std::memory_order_relaxed);
-        //TaskId id = make_task_id(task, 0);
-        *earlier = false;
-        {
-            base::MutexGuard<base::MutexLock> guard(lock_);
-            if (pTask->run_time < _nearest_run_time) {
-                _nearest_run_time = pTask->run_time;
-                *earlier = true;
+    bool TimerThread::Bucket::push(Task* pTask, int64_t wake_time) {
+        Task* head = tasks_.load(std::memory_order_relaxed);
+        do {
+            pTask->next = head;
+        } while (!tasks_.compare_exchange_weak(head, pTask,
+                    std::memory_order_release, std::memory_order_relaxed));
+        _ntask.fetch_add(1, std::memory_order_relaxed);
+
+        // 压入之后再更新提示值: 要么提示值不大于wake_time, 要么Task会在这一轮被取走
+        int64_t nearest = _nearest_run_time.load(std::memory_order_relaxed);
+        while (wake_time < nearest) {
+            if (_nearest_run_time.compare_exchange_weak(nearest, wake_time,
+                        std::memory_order_seq_cst, std::memory_order_relaxed)) {
+                return true;
             }
-            tasks_->push_back(spTask);
         }
-        std::weak_ptr<Task> wp(spTask);
-        return wp;
+        return false;
     }
 
+    typedef TimerThread::Task* TaskPtr;
+
     /*
-    inline TimerThread::TaskId make_task_id(TimerThread::Task* task_addr,
-            int initial_stat)
-    {
-        return TimerThread::TaskId((uint64_t)( (uint64_t)task_addr | initial_stat));
-    }
+     *  保存还没有到期的Task, 只被TimerThread访问
+     */
+    class TimerThread::Engine {
+        public:
+            virtual ~Engine() {}
+            virtual void push(TaskPtr task) = 0;
+            // 取出一个run_time <= now的Task, 没有时返回false
+            virtual bool pop_expired(int64_t now, TaskPtr* task) = 0;
+            // 移除被取消的Task
+            virtual void erase(TaskPtr task) = 0;
+            // 下一次需要唤醒的时间, 没有Task时返回int64_t的最大值
+            virtual int64_t next_run_time() = 0;
+            virtual size_t size() const = 0;
+            // 取出所有的Task, 通过Task::next串成链表. 只在分片线程退出之后用来归还剩余的Task
+            virtual TaskPtr take_all() = 0;
+    };
 
-    inline TimerThread::Task* get_task_addr(TimerThread::TaskId task_id) {
-        return (TimerThread::Task*) (task_id & 0xFFFFFFFFC);
-    }
+    /*
+     *  二叉堆, Task::engine_index记录Task在堆中的下标, 取消时O(log n)移除
+     */
+    class HeapEngine : public TimerThread::Engine {
+        public:
+            HeapEngine() {
+                tasks_.reserve(4096);
+            }
 
-    inline uint32_t get_task_status(TimerThread::TaskId task_id) {
-        return (uint32_t)(task_id & 0x00000003);
-    }
+            virtual void push(TaskPtr task) {
+                tasks_.push_back(task);
+                task->engine_index = static_cast<int>(tasks_.size() - 1);
+                sift_up(tasks_.size() - 1);
+            }
 
-    */
+            virtual bool pop_expired(int64_t now, TaskPtr* task) {
+                if (tasks_.empty() || tasks_[0]->run_time > now) {
+                    return false;
+                }
+                *task = tasks_[0];
+                remove_at(0);
+                return true;
+            }
 
-    inline bool task_greater(const std::shared_ptr<TimerThread::Task>& a, const std::shared_ptr<TimerThread::Task>& b) {
-        return a->run_time > b->run_time;
-    }
+            virtual void erase(TaskPtr task) {
+                remove_at(task->engine_index);
+            }
 
-    void* TimerThread::run_timer_thread(void* arg) {
-        TimerThread* timer_thread = static_cast<TimerThread*>(arg);
-        timer_thread->run();
-        return NULL;
-    }
+            virtual int64_t next_run_time() {
+                if (tasks_.empty()) {
+                    return std::numeric_limits<int64_t>::max();
+                }
+                return tasks_[0]->run_time;
+            }
 
-    TimerThread::TimerThread()
-        : _started(false),
-        _stop(false),
-        _buckets(NULL),
-        _nearest_run_time(std::numeric_limits<int64_t>::max()),
-        _nsignals(0),
-        _thread(0) {
-    }
+            virtual size_t size() const {
+                return tasks_.size();
+            }
 
-    TimerThread::~TimerThread() {
-        delete [] _buckets;
-        _buckets = NULL;
-    }
+            virtual TaskPtr take_all() {
+                TaskPtr head = NULL;
+                for (size_t i = 0; i < tasks_.size(); ++i) {
+                    tasks_[i]->engine_index = -1;
+                    tasks_[i]->next = head;
+                    head = tasks_[i];
+                }
+                tasks_.clear();
+                return head;
+            }
 
-    int TimerThread::start(const TimerThreadOptions* options) {
-        if (_started) {
-            return 0;
+        private:
+            void set(size_t i, TaskPtr task) {
+                tasks_[i] = task;
+                task->engine_index = static_cast<int>(i);
+            }
+
+            void remove_at(size_t i) {
+                TaskPtr task = tasks_[i];
+                TaskPtr last = tasks_.back();
+                tasks_.pop_back();
+                task->engine_index = -1;
+                if (i < tasks_.size()) {
+                    set(i, last);
+                    sift_down(i);
+                    sift_up(i);
+                }
+            }
+
+            void sift_up(size_t i) {
+                TaskPtr task = tasks_[i];
+                while (i > 0) {
+                    const size_t parent = (i - 1) / 2;
+                    if (tasks_[parent]->run_time <= task->run_time) {
+                        break;
+                    }
+                    set(i, tasks_[parent]);
+                    i = parent;
+                }
+                set(i, task);
+            }
+
+            void sift_down(size_t i) {
+                TaskPtr task = tasks_[i];
+                const size_t n = tasks_.size();
+                while (true) {
+                    size_t child = 2 * i + 1;
+                    if (child >= n) {
+                        break;
+                    }
+                    if (child + 1 < n && tasks_[child + 1]->run_time < tasks_[child]->run_time) {
+                        ++child;
+                    }
+                    if (task->run_time <= tasks_[child]->run_time) {
+                        break;
+                    }
+                    set(i, tasks_[child]);
+                    i = child;
+                }
+                set(i, task);
+            }
+
+        private:
+            std::vector<TaskPtr> tasks_;
+    };
+
+    /*
+     *  分层时间轮: LEVEL_NUM层, 每层SLOT_NUM个槽, 第L层的一个槽覆盖SLOT_NUM^L个tick.
+     *  Task按照到期的tick放入对应层的槽中, 当前tick走到高层槽的起点时, 把这个槽中的Task重新分配到低层.
+     *  run_time向上取整到tick, 所以Task最多晚一个tick执行, 不会提前执行.
+     *  每个槽是侵入式的双向链表, Task::engine_index记录所在的槽, 取消时O(1)移除
+     */
+    class TimingWheelEngine : public TimerThread::Engine {
+        public:
+            static const int SLOT_BITS = 8;
+            static const uint64_t SLOT_NUM = 1UL << SLOT_BITS;
+            static const uint64_t SLOT_MASK = SLOT_NUM - 1;
+            static const int LEVEL_NUM = 4;
+            // 超过时间轮范围的Task先放在最高层的最后一个槽中, 重新分配时再计算位置
+            static const uint64_t MAX_DELTA = (1UL << (SLOT_BITS * LEVEL_NUM)) - 1;
+            // 已经到期的Task所在链表的槽号
+            static const int READY_INDEX = LEVEL_NUM * SLOT_NUM;
+
+            TimingWheelEngine(int64_t tick_ns, int64_t now_ns)
+                : tick_ns_(tick_ns > 0 ? tick_ns : 1),
+                  cur_tick_(to_tick_floor(now_ns)),
+                  ntask_(0),
+                  nready_(0) {
+                for (int i = 0; i < LEVEL_NUM; ++i) {
+                    nlevel_task_[i] = 0;
+                }
+                for (int i = 0; i <= READY_INDEX; ++i) {
+                    slots_[i] = NULL;
+                }
+            }
+
+            virtual void push(TaskPtr task) {
+                add(task);
+            }
+
+            virtual bool pop_expired(int64_t now, TaskPtr* task) {
+                advance(to_tick_floor(now));
+                if (slots_[READY_INDEX] == NULL) {
+                    return false;
+                }
+                *task = slots_[READY_INDEX];
+                unlink(*task);
+                return true;
+            }
+
+            virtual void erase(TaskPtr task) {
+                unlink(task);
+            }
+
+            virtual int64_t next_run_time() {
+                if (slots_[READY_INDEX] != NULL) {
+                    return 0;
+                }
+                if (ntask_ == 0) {
+                    return std::numeric_limits<int64_t>::max();
+                }
+                // 第0层的Task和当前tick的距离小于SLOT_NUM, 槽号唯一确定到期的tick;
+                // 高层取下一个需要重新分配的槽的起点. 各层之间取最小值
+                int64_t next = std::numeric_limits<int64_t>::max();
+                for (int level = 0; level < LEVEL_NUM; ++level) {
+                    if (nlevel_task_[level] == 0) {
+                        continue;
+                    }
+                    const int shift = SLOT_BITS * level;
+                    const uint64_t cur = cur_tick_ >> shift;
+                    for (uint64_t i = 1; i <= SLOT_NUM; ++i) {
+                        const uint64_t idx = cur + i;
+                        if (slot(level, idx) != NULL) {
+                            next = std::min(next, static_cast<int64_t>(idx << shift) * tick_ns_);
+                            break;
+                        }
+                    }
+                }
+                if (next == std::numeric_limits<int64_t>::max()) {
+                    // 最多一个最高层周期之后重新检查
+                    next = static_cast<int64_t>(cur_tick_ + MAX_DELTA) * tick_ns_;
+                }
+                return next;
+            }
+
+            virtual size_t size() const {
+                return ntask_ + nready_;
+            }
+
+            virtual TaskPtr take_all() {
+                TaskPtr head = NULL;
+                for (int i = 0; i <= READY_INDEX; ++i) {
+                    TaskPtr t = slots_[i];
+                    slots_[i] = NULL;
+                    while (t != NULL) {
+                        TaskPtr next = t->next;
+                        t->prev = NULL;
+                        t->engine_index = -1;
+                        t->next = head;
+                        head = t;
+                        t = next;
+                    }
+                }
+                for (int i = 0; i < LEVEL_NUM; ++i) {
+                    nlevel_task_[i] = 0;
+                }
+                ntask_ = 0;
+                nready_ = 0;
+                return head;
+            }
+
+        private:
+            uint64_t to_tick_floor(int64_t ns) const {
+                return static_cast<uint64_t>(ns < 0 ? 0 : ns / tick_ns_);
+            }
+
+            uint64_t to_tick_ceil(int64_t ns) const {
+                // 不计算ns + tick_ns_ - 1, 避免ns接近int64_t的最大值时溢出
+                return static_cast<uint64_t>(ns <= 0 ? 0 : ns / tick_ns_ + (ns % tick_ns_ != 0 ? 1 : 0));
+            }
+
+            static int slot_index(int level, uint64_t idx) {
+                return static_cast<int>(level * SLOT_NUM + (idx & SLOT_MASK));
+            }
+
+            TaskPtr& slot(int level, uint64_t idx) {
+                return slots_[slot_index(level, idx)];
+            }
+
+            void link(TaskPtr task, int index) {
+                TaskPtr& head = slots_[index];
+                task->prev = NULL;
+                task->next = head;
+                if (head != NULL) {
+                    head->prev = task;
+                }
+                head = task;
+                task->engine_index = index;
+                if (index != READY_INDEX) {
+                    ++nlevel_task_[index / SLOT_NUM];
+                    ++ntask_;
+                }
+                else {
+                    ++nready_;
+                }
+            }
+
+            void unlink(TaskPtr task) {
+                const int index = task->engine_index;
+                if (task->prev != NULL) {
+                    task->prev->next = task->next;
+                }
+                else {
+                    slots_[index] = task->next;
+                }
+                if (task->next != NULL) {
+                    task->next->prev = task->prev;
+                }
+                task->prev = NULL;
+                task->next = NULL;
+                task->engine_index = -1;
+                if (index != READY_INDEX) {
+                    --nlevel_task_[index / SLOT_NUM];
+                    --ntask_;
+                }
+                else {
+                    --nready_;
+                }
+            }
+
+            // 取走一个槽中的所有Task
+            TaskPtr take(int index) {
+                TaskPtr head = slots_[index];
+                slots_[index] = NULL;
+                size_t n = 0;
+                for (TaskPtr t = head; t != NULL; t = t->next) {
+                    t->engine_index = -1;
+                    ++n;
+                }
+                nlevel_task_[index / SLOT_NUM] -= n;
+                ntask_ -= n;
+                return head;
+            }
+
+            void add(TaskPtr task) {
+                const uint64_t tick = to_tick_ceil(task->run_time);
+                if (tick <= cur_tick_) {
+                    link(task, READY_INDEX);
+                    return;
+                }
+                uint64_t delta = tick - cur_tick_;
+                uint64_t target = tick;
+                if (delta > MAX_DELTA) {
+                    delta = MAX_DELTA;
+                    target = cur_tick_ + MAX_DELTA;
+                }
+                int level = 0;
+                while (level < LEVEL_NUM - 1 && delta >= (1UL << (SLOT_BITS * (level + 1)))) {
+                    ++level;
+                }
+                link(task, slot_index(level, target >> (SLOT_BITS * level)));
+            }
+
+            // 把高层的一个槽重新分配到低层
+            void cascade(int level, uint64_t idx) {
+                TaskPtr t = take(slot_index(level, idx));
+                while (t != NULL) {
+                    TaskPtr next = t->next;
+                    add(t);
+                    t = next;
+                }
+            }
+
+            void advance(uint64_t target_tick) {
+                if (ntask_ == 0) {
+                    if (target_tick > cur_tick_) {
+                        cur_tick_ = target_tick;
+                    }
+                    return;
+                }
+                while (cur_tick_ < target_tick) {
+                    // 低层都为空时直接跳到下一个需要重新分配的高层槽的起点
+                    for (int level = 0; level < LEVEL_NUM - 1 && nlevel_task_[level] == 0; ++level) {
+                        const int shift = SLOT_BITS * (level + 1);
+                        const uint64_t boundary = ((cur_tick_ >> shift) + 1) << shift;
+                        cur_tick_ = std::min(target_tick, boundary) - 1;
+                    }
+                    ++cur_tick_;
+                    // 走到高层槽的起点时逐层重新分配
+                    for (int level = 1; level < LEVEL_NUM; ++level) {
+                        const int shift = SLOT_BITS * level;
+                        if ((cur_tick_ & ((1UL << shift) - 1)) != 0) {
+                            break;
+                        }
+                        cascade(level, cur_tick_ >> shift);
+                    }
+                    TaskPtr t = take(slot_index(0, cur_tick_));
+                    while (t != NULL) {
+                        TaskPtr next = t->next;
+                        link(t, READY_INDEX);
+                        t = next;
+                    }
+                    if (ntask_ == 0) {
+                        cur_tick_ = target_tick;
+                        break;
+                    }
+                }
+            }
+
+        private:
+            const int64_t tick_ns_;
+            uint64_t cur_tick_;
+            // 时间轮中(每一层)的Task数量, 不包括已经到期的Task
+            size_t ntask_;
+            size_t nlevel_task_[LEVEL_NUM];
+            // 已经到期还没有取出的Task数量
+            size_t nready_;
+            // 每个槽中链表的头, 最后一个是已经到期的Task
+            TaskPtr slots_[READY_INDEX + 1];
+    };
+
+    /*
+     *  一批已经claim的到期Task, 从ObjectPool中分配, 整批交给Executor执行
+     */
+    struct TimerTaskBatch {
+        static const size_t MAX_TASK_NUM = 32;
+
+        TimerThread* timer_thread;
+        TimerThread::Executor* executor;
+        TimerTaskBatch* next;
+        // XthreadExecutor中还没有开始执行的batch串成的双向链表
+        TimerTaskBatch* prev;
+        // 由开始执行这个batch的一方置为1, 工作线程和XthreadExecutor::stop_and_join之间只有一方执行
+        std::atomic<int> claimed;
+        int owner;
+        size_t ntask;
+        TimerThread::Task* tasks[MAX_TASK_NUM];
+    };
+
+    /*
+     *  执行到期Task的线程, 分片线程只负责取出到期的Task, 一个慢回调不会推迟其他Task的到期时间
+     */
+    class TimerThread::Executor {
+        public:
+            virtual ~Executor() {}
+            virtual int start() = 0;
+            // 执行完成之后归还batch
+            virtual void submit(TimerTaskBatch* batch) = 0;
+            // 执行完所有已经提交的batch之后返回
+            virtual void stop_and_join() = 0;
+            // 当前线程调度的Task到期时优先投递到哪里, 只对EXECUTOR_XTHREAD有意义
+            virtual int current_owner() {
+                return -1;
+            }
+
+            static void run_batch(TimerTaskBatch* batch) {
+                run_batch_tasks(batch);
+                base::ObjectPool<TimerTaskBatch>::getInstance()->return_object(batch);
+            }
+
+            static void run_batch_tasks(TimerTaskBatch* batch) {
+                for (size_t i = 0; i < batch->ntask; ++i) {
+                    batch->timer_thread->run_task(batch->tasks[i]);
+                }
+            }
+    };
+
+    class PthreadPoolExecutor : public TimerThread::Executor {
+        public:
+            explicit PthreadPoolExecutor(size_t nthreads)
+                : nthreads_(nthreads),
+                head_(NULL),
+                tail_(NULL),
+                stop_(false),
+                nsignals_(0) {
+            }
+
+            virtual int start() {
+                for (size_t i = 0; i < nthreads_; ++i) {
+                    pthread_t th;
+                    if (pthread_create(&th, NULL, PthreadPoolExecutor::run_thread, this) != 0) {
+                        stop_and_join();
+                        return -1;
+                    }
+                    threads_.push_back(th);
+                }
+                return 0;
+            }
+
+            virtual void submit(TimerTaskBatch* batch) {
+                batch->next = NULL;
+                {
+                    base::MutexGuard<base::MutexLock> guard(lock_);
+                    if (tail_ == NULL) {
+                        head_ = batch;
+                    }
+                    else {
+                        tail_->next = batch;
+                    }
+                    tail_ = batch;
+                }
+                nsignals_.fetch_add(1, std::memory_order_seq_cst);
+                base::futex_wake_private(&nsignals_, 1);
+            }
+
+            virtual void stop_and_join() {
+                stop_.store(true, std::memory_order_seq_cst);
+                nsignals_.fetch_add(1, std::memory_order_seq_cst);
+                base::futex_wake_private(&nsignals_, INT_MAX);
+                for (size_t i = 0; i < threads_.size(); ++i) {
+                    pthread_join(threads_[i], NULL);
+                }
+                threads_.clear();
+            }
+
+        private:
+            TimerTaskBatch* pop() {
+                base::MutexGuard<base::MutexLock> guard(lock_);
+                TimerTaskBatch* batch = head_;
+                if (batch != NULL) {
+                    head_ = batch->next;
+                    if (head_ == NULL) {
+                        tail_ = NULL;
+                    }
+                }
+                return batch;
+            }
+
+            static void* run_thread(void* arg) {
+                PthreadPoolExecutor* executor = static_cast<PthreadPoolExecutor*>(arg);
+                while (true) {
+                    const int expected_signal = executor->nsignals_.load(std::memory_order_seq_cst);
+                    TimerTaskBatch* batch = executor->pop();
+                    if (batch != NULL) {
+                        run_batch(batch);
+                        continue;
+                    }
+                    // 队列为空之后才退出, 已经提交的batch都会被执行
+                    if (executor->stop_.load(std::memory_order_seq_cst)) {
+                        break;
+                    }
+                    base::futex_wait_private(&executor->nsignals_, expected_signal, NULL);
+                }
+                return NULL;
+            }
+
+        private:
+            const size_t nthreads_;
+            std::vector<pthread_t> threads_;
+            base::MutexLock lock_;
+            TimerTaskBatch* head_;
+            TimerTaskBatch* tail_;
+            std::atomic<bool> stop_;
+            std::atomic<int> nsignals_;
+    };
+
+    /*
+     *  每个batch作为一个xthread task运行, 工作线程调度的Task投递回调度它的TaskGroup
+     */
+    class XthreadExecutor : public TimerThread::Executor {
+        public:
+            explicit XthreadExecutor(TaskControl* control)
+                : control_(control),
+                npending_(0),
+                head_(NULL) {
+            }
+
+            virtual int start() {
+                return control_ != NULL ? 0 : -1;
+            }
+
+            virtual void submit(TimerTaskBatch* batch) {
+                batch->claimed.store(0, std::memory_order_relaxed);
+                npending_.fetch_add(1, std::memory_order_relaxed);
+                link(batch);
+                TaskId tid;
+                int rc = 0;
+                if (batch->owner >= 0) {
+                    rc = control_->start_task_in_group(batch->owner, &tid, XthreadExecutor::run_task_fn, batch);
+                }
+                else {
+                    rc = control_->start_task(&tid, XthreadExecutor::run_task_fn, batch);
+                }
+                if (unlikely(rc != 0)) {
+                    // TaskControl已经停止, 在当前线程执行
+                    run_task_fn(batch);
+                }
+            }
+
+            /*
+             *  等待所有已经投递到TaskControl的batch执行完成, TimerThread在这之后才能释放.
+             *  TaskControl停止时丢弃队列中的task, 这时在当前线程执行还没有开始的batch.
+             *  在同一个TaskControl的工作线程中调用时不等待: 剩余的batch可能正排在当前工作线程的队列中
+             */
+            virtual void stop_and_join() {
+                if (current_owner() >= 0) {
+                    log_error("XthreadExecutor::stop_and_join called in a worker of its TaskControl, not waiting");
+                    return;
+                }
+                while (true) {
+                    const int npending = npending_.load(std::memory_order_acquire);
+                    if (npending == 0) {
+                        break;
+                    }
+                    if (control_->stopped()) {
+                        run_unclaimed_batches();
+                        continue;
+                    }
+                    // TaskControl可能在等待期间停止, 定期醒来检查
+                    timespec timeout = base::milliseconds2timespec(10);
+                    base::futex_wait_private(&npending_, npending, &timeout);
+                }
+            }
+
+            virtual int current_owner() {
+                TaskGroup* g = get_current_task_group();
+                if (g != NULL && g->control() == control_) {
+                    return static_cast<int>(g->index());
+                }
+                return -1;
+            }
+
+        private:
+            static bool claim(TimerTaskBatch* batch) {
+                int expected = 0;
+                return batch->claimed.compare_exchange_strong(expected, 1, std::memory_order_acquire);
+            }
+
+            void link(TimerTaskBatch* batch) {
+                base::MutexGuard<base::MutexLock> guard(lock_);
+                batch->prev = NULL;
+                batch->next = head_;
+                if (head_ != NULL) {
+                    head_->prev = batch;
+                }
+                head_ = batch;
+            }
+
+            // 调用者持有lock_
+            void unlink(TimerTaskBatch* batch) {
+                if (batch->prev != NULL) {
+                    batch->prev->next = batch->next;
+                }
+                else {
+                    head_ = batch->next;
+                }
+                if (batch->next != NULL) {
+                    batch->next->prev = batch->prev;
+                }
+            }
+
+            void finish_one() {
+                if (npending_.fetch_sub(1, std::memory_order_release) == 1) {
+                    base::futex_wake_private(&npending_, INT_MAX);
+                }
+            }
+
+            void run_unclaimed_batches() {
+                TimerTaskBatch* batches = NULL;
+                {
+                    base::MutexGuard<base::MutexLock> guard(lock_);
+                    TimerTaskBatch* batch = head_;
+                    while (batch != NULL) {
+                        TimerTaskBatch* next = batch->next;
+                        // claim失败的batch正在工作线程中执行, 由工作线程移出链表
+                        if (claim(batch)) {
+                            unlink(batch);
+                            batch->next = batches;
+                            batches = batch;
+                        }
+                        batch = next;
+                    }
+                }
+                while (batches != NULL) {
+                    TimerTaskBatch* next = batches->next;
+                    // 被丢弃的task可能仍然引用这个batch, 不归还到ObjectPool
+                    run_batch_tasks(batches);
+                    finish_one();
+                    batches = next;
+                }
+            }
+
+            static void* run_task_fn(void* arg) {
+                TimerTaskBatch* batch = static_cast<TimerTaskBatch*>(arg);
+                if (!claim(batch)) {
+                    // stop_and_join已经执行了这个batch, 之后executor可能已经释放
+                    return NULL;
+                }
+                // run_batch会归还batch, 先取出executor
+                XthreadExecutor* executor = static_cast<XthreadExecutor*>(batch->executor);
+                {
+                    base::MutexGuard<base::MutexLock> guard(executor->lock_);
+                    executor->unlink(batch);
+                }
+                run_batch(batch);
+                executor->finish_one();
+                return NULL;
+            }
+
+        private:
+            TaskControl* control_;
+            // 已经提交还没有执行完成的batch数量
+            std::atomic<int> npending_;
+            base::MutexLock lock_;
+            // 还没有开始执行的batch
+            TimerTaskBatch* head_;
+    };
+
+    /*
+     *  一个分片: 独立的线程, Bucket, Engine和futex. Task的整个生命周期都属于调度时选择的分片
+     */
+    class TimerThread::Shard {
+        public:
+            // 每取消这么多Task唤醒一次分片线程, 限制取消之后还留在Engine中的Task数量
+            static const int64_t CANCEL_WAKE_THRESHOLD = 1024;
+
+            Shard()
+                : _timer_thread(NULL),
+                _buckets(NULL),
+                _engine(NULL),
+                _nearest_run_time(std::numeric_limits<int64_t>::max()),
+                _nsignals(0),
+                _thread(0),
+                _started(false),
+                _cancelled_tasks(NULL),
+                _ncancelled(0),
+                _ncancelled_resident(0),
+                _nwakeups(0),
+                _nbatches(0),
+                _nfired(0),
+                _queue_depth(0) {
+                for (int i = 0; i < TimerThreadStats::LATENESS_BUCKET_NUM; ++i) {
+                    _lateness_hist[i].store(0, std::memory_order_relaxed);
+                }
+            }
+
+            ~Shard() {
+                delete [] _buckets;
+                _buckets = NULL;
+                delete _engine;
+                _engine = NULL;
+            }
+
+            int init(TimerThread* timer_thread);
+            int start_thread();
+            void stop_and_join();
+            // 分片线程和Executor都退出之后, 归还Bucket, Engine和取消链表中剩余的Task
+            void release_remaining_tasks();
+
+            // run_time为TimerThread::now_ns()时间轴上的纳秒数
+            TaskId schedule(void (*fn)(void*), void* arg, int64_t run_time, int owner,
+                    int64_t period_ns, int periodic_flags);
+            // 把Task放入Bucket, 需要时唤醒分片线程. 任意线程都可以调用
+            void push_task(Task* task);
+            void cancel(Task* task);
+
+            void add_stats(TimerThreadStats* stats) const {
+                stats->ncancelled_resident += _ncancelled_resident.load(std::memory_order_relaxed);
+                stats->nwakeups += _nwakeups.load(std::memory_order_relaxed);
+                stats->nbatches += _nbatches.load(std::memory_order_relaxed);
+                stats->nfired += _nfired.load(std::memory_order_relaxed);
+                stats->queue_depth += _queue_depth.load(std::memory_order_relaxed);
+                for (size_t i = 0; i < _timer_thread->_options.num_buckets; ++i) {
+                    stats->queue_depth += _buckets[i].size();
+                }
+                for (int i = 0; i < TimerThreadStats::LATENESS_BUCKET_NUM; ++i) {
+                    stats->lateness_hist[i] += _lateness_hist[i].load(std::memory_order_relaxed);
+                }
+            }
+
+        private:
+            static void* run_thread(void* arg);
+            void run();
+            void wake();
+            // 把claim成功的Task放入owner对应的batch, batch满了就提交给Executor
+            void add_to_batch(Task* task);
+            void submit_batches();
+            void remove_cancelled_tasks();
+            void release_cancelled_task(Task* task);
+            // 记录Task的执行时间比run_time晚了多少
+            void record_lateness(int64_t lateness_ns);
+
+        private:
+            TimerThread* _timer_thread;
+            Bucket* _buckets;
+            // 只被分片线程访问
+            Engine* _engine;
+
+            // 分片线程下一次醒来的时间, 提前Task的线程通过CAS把它改小
+            std::atomic<int64_t> _nearest_run_time;
+            // _nsignals: 用来判断futex需要等待的数据是否发生变化
+            std::atomic<int> _nsignals;
+            pthread_t _thread;
+            bool _started;
+
+            // unschedule成功的Task通过cancel_next串成的无锁栈
+            std::atomic<Task*> _cancelled_tasks;
+            std::atomic<int64_t> _ncancelled;
+            std::atomic<int64_t> _ncancelled_resident;
+            // 只被分片线程修改: futex等待返回的次数, 执行了Task的轮数和执行的Task数量
+            std::atomic<int64_t> _nwakeups;
+            std::atomic<int64_t> _nbatches;
+            std::atomic<int64_t> _nfired;
+            std::atomic<int64_t> _queue_depth;
+            std::atomic<int64_t> _lateness_hist[TimerThreadStats::LATENESS_BUCKET_NUM];
+            // 这一轮还没有提交的batch, 每个owner一个
+            std::vector<TimerTaskBatch*> _batches;
+            char pad_[XTHREAD_CACHELINE_SIZE];
+    };
+
+    int TimerThread::Shard::init(TimerThread* timer_thread) {
+        _timer_thread = timer_thread;
+        const TimerThreadOptions& options = timer_thread->_options;
+        if (options.engine == TimerThreadOptions::ENGINE_HEAP) {
+            _engine = new (std::nothrow) HeapEngine();
         }
-        if (options) {
-            _options = *options;
+        else if (options.engine == TimerThreadOptions::ENGINE_TIMING_WHEEL) {
+            _engine = new (std::nothrow) TimingWheelEngine(options.wheel_tick_us * 1000, timer_thread->now_ns());
         }
-        if (_options.num_buckets == 0 || _options.num_buckets > 1024) {
+        if (unlikely(_engine == NULL)) {
             return -1;
         }
-        _buckets = new (std::nothrow) Bucket[_options.num_buckets];
+        _buckets = new (std::nothrow) Bucket[options.num_buckets];
         if (unlikely(_buckets == NULL)) {
             return -1;
         }
-        int ret = pthread_create(&_thread, NULL, TimerThread::run_timer_thread, this);
-        if (ret) {
+        return 0;
+    }
+
+    int TimerThread::Shard::start_thread() {
+        if (pthread_create(&_thread, NULL, Shard::run_thread, this) != 0) {
             return -1;
         }
         _started = true;
         return 0;
     }
 
+    void* TimerThread::Shard::run_thread(void* arg) {
+        Shard* shard = static_cast<Shard*>(arg);
+        shard->run();
+        return NULL;
+    }
 
-    inline uint64_t fmix64(uint64_t k) {
-        k ^= k >> 33;
-        k *= 0xff51afd7ed558ccdLLU;
-        k ^= k >> 33;
-        k *= 0xc4ceb9fe1a85ec53LLU;
-        k ^= k >> 33;
-        return k;
+    void TimerThread::Shard::wake() {
+        _nsignals.fetch_add(1, std::memory_order_seq_cst);
+        base::futex_wake_private(&_nsignals, 1);
     }
 
-    std::weak_ptr<TimerThread::Task> TimerThread::schedule(
-            void (*fn)(void*), void* arg, const timespec& abstime) {
-        if (_stop.load(std::memory_order_relaxed) || !_started) {
-            return std::weak_ptr<TimerThread::Task>();
-        }
-        size_t bucket_index = fmix64(pthread_self()) % _options.num_buckets;
-        bool earlier = false;
-        std::weak_ptr<Task> wpTask = _buckets[bucket_index].schedule(fn, arg, abstime, &earlier);
-        if (earlier) {
-            bool earlier_global = false;
-            int64_t task_run_time = xthread::base::timespec_to_microseconds(abstime);
-            {
-                base::MutexGuard<base::MutexLock> guard(mutexLock_);
-                if (task_run_time < _nearest_run_time) {
-                    _nearest_run_time = task_run_time;
-                    ++_nsignals;
-                    earlier_global = true;
+    TimerThread::TaskId TimerThread::Shard::schedule(
+            void (*fn)(void*), void* arg, int64_t run_time, int owner,
+            int64_t period_ns, int periodic_flags) {
+        base::ResourceId<Task> id;
+        Task* pTask = base::get_resource<Task>(&id);
+        if (unlikely(pTask == NULL)) {
+            return INVALID_TASK_ID;
+        }
+        uint32_t version = pTask->version.load(std::memory_order_relaxed);
+        if (unlikely(version == 0)) {
+            // version回绕到0时跳过, 保证TaskId不等于INVALID_TASK_ID
+            version = 2;
+            pTask->version.store(version, std::memory_order_relaxed);
+        }
+        pTask->fn = fn;
+        pTask->arg = arg;
+        pTask->run_time = run_time;
+        pTask->task_id = make_task_id(version, id.value);
+        pTask->period_ns = period_ns;
+        pTask->periodic_flags = periodic_flags;
+        pTask->state = TimerThreadTaskState::IN_BUCKET;
+        pTask->shard = this;
+        pTask->owner = owner;
+        const TaskId task_id = pTask->task_id;
+        push_task(pTask);
+        return task_id;
+    }
+
+    void TimerThread::Shard::push_task(Task* pTask) {
+        // 允许推迟slack_ns执行, 和附近到期的Task合并为一次唤醒
+        const int64_t wake_time = add_delay_ns(pTask->run_time, _timer_thread->_options.slack_ns);
+
+        size_t bucket_index = fmix64(pthread_self()) % _timer_thread->_options.num_buckets;
+        if (_buckets[bucket_index].push(pTask, wake_time)) {
+            int64_t nearest = _nearest_run_time.load(std::memory_order_relaxed);
+            while (wake_time < nearest) {
+                if (_nearest_run_time.compare_exchange_weak(nearest, wake_time,
+                            std::memory_order_seq_cst, std::memory_order_relaxed)) {
+                    //唤醒TimerThread
+                    log_debug("wake TimerThread for early \n");
+                    wake();
+                    break;
                 }
             }
-            if (earlier_global) {
-                //唤醒TimerThread
-                log_debug("wake TimerThread for early \n");
-                base::futex_wake_private(&_nsignals, 1);
-            }
         }
-        return wpTask;
     }
 
-    int TimerThread::unschedule(std::weak_ptr<TimerThread::Task> wpTask) {
-        std::shared_ptr<TimerThread::Task> spTask(wpTask.lock());
-        if (spTask) {
-            uint32_t expected_stat = TimerThreadTaskStat::TASK_STATUS_INIT;
-            TimerThread::Task* pTask = spTask.get();
-            if (pTask->task_status.compare_exchange_strong(expected_stat,
-                        TimerThreadTaskStat::TASK_STATUS_FINISHED,
-                        std::memory_order_acquire)) {
-                return 0;
-            }
-            return (expected_stat == TimerThreadTaskStat::TASK_STATUS_RUNNING) ? 1 : -1;
+    void TimerThread::Shard::cancel(Task* pTask) {
+        // 放入取消链表, 由分片线程从Bucket/Engine中移除并归还
+        _ncancelled_resident.fetch_add(1, std::memory_order_relaxed);
+        Task* head = _cancelled_tasks.load(std::memory_order_relaxed);
+        do {
+            pTask->cancel_next = head;
+        } while (!_cancelled_tasks.compare_exchange_weak(head, pTask,
+                    std::memory_order_release, std::memory_order_relaxed));
+        // 分片线程可能在很久之后才醒来, 取消的Task积累到一定数量时唤醒它
+        if ((_ncancelled.fetch_add(1, std::memory_order_relaxed) + 1) % CANCEL_WAKE_THRESHOLD == 0) {
+            wake();
         }
-        return -1;
     }
 
-    bool TimerThread::Task::run_and_del() {
-        //uint32_t initial_stat = get_task_status(task_id);
-        uint32_t initial_stat =TimerThreadTaskStat::TASK_STATUS_INIT;
-        uint32_t expected_stat = initial_stat;
-        if (task_status.compare_exchange_strong(expected_stat,
-                    TimerThreadTaskStat::TASK_STATUS_RUNNING, std::memory_order_acquire)) {
-            fn(arg);
-            task_status.store(TimerThreadTaskStat::TASK_STATUS_FINISHED, std::memory_order_release);
-            return true;
+    void TimerThread::Shard::add_to_batch(Task* task) {
+        TimerTaskBatch* batch = NULL;
+        size_t i = 0;
+        for (; i < _batches.size(); ++i) {
+            if (_batches[i]->owner == task->owner) {
+                batch = _batches[i];
+                break;
+            }
         }
-        else if (expected_stat == TimerThreadTaskStat::TASK_STATUS_FINISHED) {
-            //
-            return false;
+        if (batch == NULL) {
+            batch = base::ObjectPool<TimerTaskBatch>::getInstance()->get_object();
+            if (unlikely(batch == NULL)) {
+                _timer_thread->run_task(task);
+                return;
+            }
+            batch->timer_thread = _timer_thread;
+            batch->executor = _timer_thread->_executor;
+            batch->next = NULL;
+            batch->owner = task->owner;
+            batch->ntask = 0;
+            _batches.push_back(batch);
         }
-        else {
-            return false;
+        batch->tasks[batch->ntask++] = task;
+        if (batch->ntask == TimerTaskBatch::MAX_TASK_NUM) {
+            _batches[i] = _batches.back();
+            _batches.pop_back();
+            _timer_thread->_executor->submit(batch);
         }
     }
 
-    bool TimerThread::Task::try_del() {
-        if (task_status.load(std::memory_order_relaxed) == TimerThreadTaskStat::TASK_STATUS_FINISHED) {
-            return true;
+    void TimerThread::Shard::submit_batches() {
+        for (size_t i = 0; i < _batches.size(); ++i) {
+            _timer_thread->_executor->submit(_batches[i]);
         }
-        return false;
+        _batches.clear();
+    }
+
+    void TimerThread::Shard::release_cancelled_task(Task* task) {
+        return_task(task);
+        _ncancelled_resident.fetch_sub(1, std::memory_order_relaxed);
     }
 
-    void TimerThread::run() {
-        if (_options.begin_fn) {
-            _options.begin_fn(_options.args);
+    void TimerThread::Shard::record_lateness(int64_t lateness_ns) {
+        const uint64_t us = static_cast<uint64_t>(lateness_ns > 0 ? lateness_ns / 1000 : 0);
+        int index = (us == 0 ? 0 : 64 - __builtin_clzll(us));
+        if (index >= TimerThreadStats::LATENESS_BUCKET_NUM) {
+            index = TimerThreadStats::LATENESS_BUCKET_NUM - 1;
         }
+        // 只有分片线程修改, 不需要原子的加法
+        std::atomic<int64_t>& bucket = _lateness_hist[index];
+        bucket.store(bucket.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
 
-        std::vector<std::shared_ptr<Task> > tasks;
-        tasks.reserve(4096);
-        while (!_stop.load(std::memory_order_relaxed)) {
-            {
-                base::MutexGuard<base::MutexLock> guard(mutexLock_);
-                _nearest_run_time = std::numeric_limits<int64_t>::max();
+    void TimerThread::Shard::remove_cancelled_tasks() {
+        Task* pTask = _cancelled_tasks.exchange(NULL, std::memory_order_acquire);
+        while (pTask != NULL) {
+            Task* next = pTask->cancel_next;
+            if (pTask->state == TimerThreadTaskState::IN_BUCKET) {
+                // 在Bucket中, 取出时归还
+                pTask->state = TimerThreadTaskState::CANCEL_SEEN;
+            }
+            else {
+                if (pTask->state == TimerThreadTaskState::IN_ENGINE) {
+                    _engine->erase(pTask);
+                }
+                release_cancelled_task(pTask);
             }
+            pTask = next;
+        }
+    }
+
+    void TimerThread::Shard::run() {
+        const TimerThreadOptions& options = _timer_thread->_options;
+        if (options.begin_fn) {
+            options.begin_fn(options.args);
+        }
+
+        while (!_timer_thread->_stop.load(std::memory_order_relaxed)) {
+            // 在这一轮开始之前读取_nsignals: 之后的schedule/unschedule发出的信号都会让futex立即返回
+            const int expected_signal = _nsignals.load(std::memory_order_seq_cst);
+            _nearest_run_time.store(std::numeric_limits<int64_t>::max(), std::memory_order_seq_cst);
 
             // step1 : 获取所有的Task
-            for(size_t i = 0; i < _options.num_buckets; ++i) {
+            for(size_t i = 0; i < options.num_buckets; ++i) {
                 Bucket& bucket = _buckets[i];
-                Bucket::TaskListPtr bucket_tasks = bucket.consume_tasks();
-                while (!bucket_tasks->empty()) {
-                    std::shared_ptr<TimerThread::Task> spTask = bucket_tasks->front();
-                    bucket_tasks->pop_front();
-                    if (!spTask->try_del()) {
-                        tasks.push_back(spTask);
-                        std::push_heap(tasks.begin(), tasks.end(), task_greater);
+                Task* pTask = bucket.consume_tasks();
+                int64_t nconsumed = 0;
+                while (pTask != NULL) {
+                    ++nconsumed;
+                    // push之后next可能被修改
+                    Task* next = pTask->next;
+                    if (!pTask->cancelled()) {
+                        pTask->state = TimerThreadTaskState::IN_ENGINE;
+                        _engine->push(pTask);
+                    }
+                    else if (pTask->state == TimerThreadTaskState::CANCEL_SEEN) {
+                        release_cancelled_task(pTask);
+                    }
+                    else {
+                        pTask->state = TimerThreadTaskState::DETACHED;
                     }
+                    pTask = next;
+                }
+                if (nconsumed != 0) {
+                    bucket.consumed(nconsumed);
                 }
-                delete bucket_tasks;
             }
 
+            // step2 : 从Engine中移除被取消的Task
+            remove_cancelled_tasks();
 
-            // step2 : 检查最早执行的Task,bRePoll用于判断当前的最早执行Task是否发生变化
+            // step3 : 执行所有到期的Task,bRePoll用于判断当前的最早执行Task是否发生变化
             bool bRePoll = false;
-            while (!tasks.empty()) {
-                std::shared_ptr<Task> task = tasks[0];
-                if (task->try_del()) {
-                    std::pop_heap(tasks.begin(), tasks.end());
-                    tasks.pop_back();
-                    continue;
-                }
-                if (task->run_time > base::gettimeofday_us()) {
-                    //printf("[%ld],[%ld]\n",task->run_time, base::gettimeofday_us());
+            TaskPtr task = NULL;
+            // 一轮只读一次时钟, 这一轮中到期的Task作为一批执行
+            const int64_t now = _timer_thread->now_ns();
+            int64_t nfired = 0;
+            while (_engine->pop_expired(now, &task)) {
+                if (_nearest_run_time.load(std::memory_order_relaxed) < task->run_time) {
+                    _engine->push(task);
+                    bRePoll = true;
                     break;
                 }
-                {
-                    base::MutexGuard<base::MutexLock> guard(mutexLock_);
-                    if (_nearest_run_time < task->run_time) {
-                        bRePoll = true;
-                        break;
-                    }
+                if (!task->claim()) {
+                    continue;
                 }
-                std::pop_heap(tasks.begin(), tasks.end(), task_greater);
-                tasks.pop_back();
-                if (task->run_and_del()) {
-                    // 执行Task并将状态置为FINISHED成功
+                ++nfired;
+                record_lateness(now - task->run_time);
+                if (_timer_thread->_executor == NULL) {
+                    _timer_thread->run_task(task);
+                }
+                else {
+                    add_to_batch(task);
                 }
             }
+            submit_batches();
+            if (nfired > 0) {
+                _nbatches.store(_nbatches.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+                _nfired.store(_nfired.load(std::memory_order_relaxed) + nfired, std::memory_order_relaxed);
+            }
+            _queue_depth.store(static_cast<int64_t>(_engine->size()), std::memory_order_relaxed);
             if (bRePoll) {
                 continue;
             }
 
-            // step3 : 更新全局的最早执行时间, 利用futex的特性来防止
+            // step4 : 更新全局的最早执行时间, 利用futex的特性来防止
             // 插入的最新的最早执行的Task不生效, futex如果发现等待的数据
             // 与期望的不一致，则放弃等待
-            int64_t next_run_time = std::numeric_limits<int64_t>::max();
-            if (!tasks.empty()) {
-                next_run_time = tasks[0]->run_time;
+            // 最早的Task可以推迟slack_ns, 这段时间内到期的Task在同一次唤醒中执行
+            int64_t next_run_time = _engine->next_run_time();
+            next_run_time = add_delay_ns(next_run_time, options.slack_ns);
+            for (size_t i = 0; i < options.num_buckets; ++i) {
+                next_run_time = std::min(next_run_time, _buckets[i].nearest_run_time());
             }
 
-            int expected_signal = 0;
-            {
-                base::MutexGuard<base::MutexLock> guard(mutexLock_);
-                if (_nearest_run_time < next_run_time) {
-                    continue;
-                }
-                else {
-                    _nearest_run_time = next_run_time;
-                    expected_signal = _nsignals;
-                }
+            int64_t nearest = _nearest_run_time.load(std::memory_order_seq_cst);
+            if (nearest < next_run_time) {
+                continue;
+            }
+            if (!_nearest_run_time.compare_exchange_strong(nearest, next_run_time,
+                        std::memory_order_seq_cst, std::memory_order_seq_cst)) {
+                // 只可能被其他线程改小
+                continue;
             }
 
             timespec next_timeout = {0, 0};
             timespec* pTimeOut = NULL;
-            int64_t now = base::gettimeofday_us();
+            // 回调可能执行了很久, 睡眠之前重新读取时钟
+            const int64_t wait_begin = _timer_thread->now_ns();
             if (next_run_time != std::numeric_limits<int64_t>::max()) {
-                int64_t diff = next_run_time - now;
-                next_timeout = base::us2timespec(diff);
+                int64_t diff = next_run_time - wait_begin;
+                if (diff <= 0) {
+                    continue;
+                }
+                next_timeout = base::ns2timespec(diff);
                 log_debug("NEXT_TIMEOUT [%lld] [%lld]\n", diff, next_timeout.tv_sec);
                 pTimeOut = &next_timeout;
             }
-            log_debug("wait start [%d][%lld] [%lld] [%x] [%x]\n", _nsignals, next_run_time, now, &_nsignals, pTimeOut);
+            log_debug("wait start [%d][%lld] [%lld] [%x] [%x]\n", expected_signal, next_run_time, wait_begin, &_nsignals, pTimeOut);
             long int ret = base::futex_wait_private(&_nsignals, expected_signal, pTimeOut);
+            _nwakeups.store(_nwakeups.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
             if (ret == -1) {
                 log_debug("errno [%lld]", errno);
             }
             log_debug("wait returned [%d][%lld] [%lld]\n", expected_signal, next_run_time, ret);
         }
+
+        if (options.end_fn) {
+            options.end_fn(options.args);
+        }
+    }
+
+    void TimerThread::Shard::stop_and_join() {
+        if (!_started) {
+            return;
+        }
+        _nearest_run_time.store(0, std::memory_order_seq_cst);
+        // 如果不是分片线程自己调用这个函数，则唤醒并等待它退出
+        if (pthread_self() != _thread) {
+            log_debug("stop TimerThread, wake \n");
+            wake();
+            pthread_join(_thread, NULL);
+        }
+        else {
+            _nsignals.fetch_add(1, std::memory_order_seq_cst);
+        }
+        _started = false;
+    }
+
+    void TimerThread::Shard::release_remaining_tasks() {
+        // 先处理取消链表: 被取消的Task从Engine中移除并归还, 还在Bucket中的标记为CANCEL_SEEN
+        remove_cancelled_tasks();
+        for (size_t i = 0; i < _timer_thread->_options.num_buckets; ++i) {
+            Task* pTask = _buckets[i].consume_tasks();
+            int64_t nconsumed = 0;
+            while (pTask != NULL) {
+                ++nconsumed;
+                Task* next = pTask->next;
+                if (pTask->state == TimerThreadTaskState::CANCEL_SEEN) {
+                    release_cancelled_task(pTask);
+                }
+                else {
+                    _engine->push(pTask);
+                }
+                pTask = next;
+            }
+            if (nconsumed != 0) {
+                _buckets[i].consumed(nconsumed);
+            }
+        }
+        // 剩下的都是没有执行也没有被取消的Task, 增加version使之前的TaskId失效之后归还
+        Task* pTask = _engine->take_all();
+        while (pTask != NULL) {
+            Task* next = pTask->next;
+            pTask->version.store(get_task_version(pTask->task_id) + 2, std::memory_order_relaxed);
+            return_task(pTask);
+            pTask = next;
+        }
+        _queue_depth.store(0, std::memory_order_relaxed);
+    }
+
+    TimerThread::TimerThread()
+        : _started(false),
+        _stop(false),
+        _use_tsc(false),
+        _shards(NULL),
+        _executor(NULL),
+        _nslow_callbacks(0),
+        _max_callback_us(0) {
+    }
+
+    TimerThread::~TimerThread() {
+        // 分片线程和Executor中还在执行的回调都会访问TimerThread
+        stop_and_join();
+        if (_shards != NULL) {
+            for (size_t i = 0; i < _options.num_shards; ++i) {
+                _shards[i].release_remaining_tasks();
+            }
+        }
+        delete [] _shards;
+        _shards = NULL;
+        delete _executor;
+        _executor = NULL;
+    }
+
+    int TimerThread::start(const TimerThreadOptions* options) {
+        if (_started) {
+            return 0;
+        }
+        if (options) {
+            _options = *options;
+        }
+        if (_options.num_buckets == 0 || _options.num_buckets > 1024) {
+            return -1;
+        }
+        if (_options.num_shards == 0 || _options.num_shards > MAX_SHARD_NUM) {
+            return -1;
+        }
+        if (_options.engine != TimerThreadOptions::ENGINE_HEAP &&
+                _options.engine != TimerThreadOptions::ENGINE_TIMING_WHEEL) {
+            return -1;
+        }
+        if (_options.engine == TimerThreadOptions::ENGINE_TIMING_WHEEL && _options.wheel_tick_us <= 0) {
+            return -1;
+        }
+        if (_options.slack_ns < 0) {
+            return -1;
+        }
+        // TSC不可用时退化为CLOCK_MONOTONIC
+        _use_tsc = _options.use_tsc && base::has_invariant_tsc();
+        if (_options.executor == TimerThreadOptions::EXECUTOR_PTHREAD_POOL) {
+            if (_options.executor_threads == 0) {
+                return -1;
+            }
+            _executor = new (std::nothrow) PthreadPoolExecutor(_options.executor_threads);
+        }
+        else if (_options.executor == TimerThreadOptions::EXECUTOR_XTHREAD) {
+            TaskControl* control = _options.task_control;
+            if (control == NULL) {
+                control = get_or_create_global_task_control();
+            }
+            _executor = new (std::nothrow) XthreadExecutor(control);
+        }
+        else if (_options.executor != TimerThreadOptions::EXECUTOR_INLINE) {
+            return -1;
+        }
+        if (_options.executor != TimerThreadOptions::EXECUTOR_INLINE) {
+            if (unlikely(_executor == NULL)) {
+                return -1;
+            }
+            if (_executor->start() != 0) {
+                delete _executor;
+                _executor = NULL;
+                return -1;
+            }
+        }
+        _shards = new (std::nothrow) Shard[_options.num_shards];
+        if (unlikely(_shards == NULL)) {
+            return -1;
+        }
+        for (size_t i = 0; i < _options.num_shards; ++i) {
+            if (_shards[i].init(this) != 0) {
+                delete [] _shards;
+                _shards = NULL;
+                return -1;
+            }
+        }
+        for (size_t i = 0; i < _options.num_shards; ++i) {
+            if (_shards[i].start_thread() != 0) {
+                _stop.store(true, std::memory_order_relaxed);
+                for (size_t j = 0; j < i; ++j) {
+                    _shards[j].stop_and_join();
+                }
+                if (_executor != NULL) {
+                    _executor->stop_and_join();
+                }
+                return -1;
+            }
+        }
+        _started = true;
+        return 0;
+    }
+
+    TimerThread::Shard* TimerThread::choose_shard() {
+        if (_options.num_shards == 1) {
+            return &_shards[0];
+        }
+        // 工作线程使用自己的分片, 同一个工作线程的Task由同一个分片线程执行
+        TaskGroup* g = get_current_task_group();
+        if (g != NULL) {
+            return &_shards[g->index() % _options.num_shards];
+        }
+        return &_shards[fmix64(pthread_self() >> 4) % _options.num_shards];
+    }
+
+    TimerThread::TaskId TimerThread::schedule(
+            void (*fn)(void*), void* arg, const timespec& abstime) {
+        // abstime是CLOCK_REALTIME的时间, 在调度时换算为相对时间, 之后调整系统时间不影响到期时间
+        const int64_t delay_ns = base::timespec_to_nanoseconds(abstime) - base::realtime_ns();
+        return schedule_after(fn, arg, delay_ns);
+    }
+
+    TimerThread::TaskId TimerThread::schedule_after(
+            void (*fn)(void*), void* arg, int64_t delay_ns) {
+        if (_stop.load(std::memory_order_relaxed) || !_started) {
+            return INVALID_TASK_ID;
+        }
+        const int64_t run_time = add_delay_ns(now_ns(), delay_ns);
+        const int owner = (_executor != NULL ? _executor->current_owner() : -1);
+        return choose_shard()->schedule(fn, arg, run_time, owner, 0, 0);
+    }
+
+    TimerThread::TaskId TimerThread::schedule_periodic(
+            void (*fn)(void*), void* arg, int64_t period_ns, int flags) {
+        if (_stop.load(std::memory_order_relaxed) || !_started) {
+            return INVALID_TASK_ID;
+        }
+        if (period_ns <= 0 || (flags != PERIODIC_FIXED_RATE && flags != PERIODIC_FIXED_DELAY)) {
+            return INVALID_TASK_ID;
+        }
+        const int64_t run_time = add_delay_ns(now_ns(), period_ns);
+        const int owner = (_executor != NULL ? _executor->current_owner() : -1);
+        return choose_shard()->schedule(fn, arg, run_time, owner, period_ns, flags);
+    }
+
+    int TimerThread::unschedule(TaskId task_id) {
+        if (task_id == INVALID_TASK_ID) {
+            return -1;
+        }
+        Task* pTask = address_task(task_id);
+        if (unlikely(pTask == NULL)) {
+            return -1;
+        }
+        const uint32_t id_version = get_task_version(task_id);
+        while (true) {
+            uint32_t expected_version = id_version;
+            if (pTask->version.compare_exchange_strong(expected_version, id_version + 2,
+                        std::memory_order_acquire)) {
+                break;
+            }
+            if (expected_version != id_version + 1) {
+                return -1;
+            }
+            if (pTask->period_ns == 0) {
+                return 1;
+            }
+            // 周期Task正在执行: 执行结束之后不再重新调度, 由执行线程归还
+            if (pTask->version.compare_exchange_strong(expected_version, id_version + 2,
+                        std::memory_order_acquire)) {
+                return 1;
+            }
+            // 执行已经结束并重新调度, 重试
+        }
+        // CAS成功之后Task在分片线程处理取消链表之前不会被归还, shard不会变化
+        pTask->shard->cancel(pTask);
+        return 0;
+    }
+
+    bool TimerThread::Task::claim() {
+        const uint32_t id_version = get_task_version(task_id);
+        uint32_t expected_version = id_version;
+        if (version.compare_exchange_strong(expected_version, id_version + 1,
+                    std::memory_order_acquire)) {
+            return true;
+        }
+        // 已经被取消, 等待处理取消链表时归还
+        state = TimerThreadTaskState::DETACHED;
+        return false;
+    }
+
+    void TimerThread::Task::run_and_del() {
+        fn(arg);
+        version.store(get_task_version(task_id) + 2, std::memory_order_release);
+        return_task(this);
+    }
+
+    bool TimerThread::Task::cancelled() const {
+        return version.load(std::memory_order_relaxed) != get_task_version(task_id);
     }
 
     void TimerThread::stop_and_join() {
         _stop.store(true, std::memory_order_relaxed);
         if (_started) {
-            {
-                base::MutexGuard<base::MutexLock>  guard(mutexLock_);
-                _nearest_run_time = 0;
-                ++_nsignals;
+            for (size_t i = 0; i < _options.num_shards; ++i) {
+                _shards[i].stop_and_join();
             }
+            if (_executor != NULL) {
+                _executor->stop_and_join();
+            }
+        }
+    }
 
-            // 如果不是TimerThread自己调用这个函数，则唤醒TimerThread
-            if (pthread_self() != _thread) {
-                log_debug("stop TimerThread, wake \n");
-                base::futex_wake_private(&_nsignals, 1);
-                pthread_join(_thread, NULL);
+    void TimerThread::run_periodic_task(Task* task) {
+        task->fn(task->arg);
+        const uint32_t id_version = get_task_version(task->task_id);
+        const int64_t period_ns = task->period_ns;
+        const int64_t now = now_ns();
+        int64_t next_run_time = 0;
+        if (task->periodic_flags == PERIODIC_FIXED_DELAY) {
+            next_run_time = now + period_ns;
+        }
+        else {
+            // 按照第一次的到期时间计算, 不会累积误差; 落后超过一个周期时跳过错过的周期
+            next_run_time = task->run_time + period_ns;
+            if (next_run_time <= now) {
+                next_run_time += ((now - next_run_time) / period_ns + 1) * period_ns;
             }
         }
+        task->run_time = next_run_time;
+        task->state = TimerThreadTaskState::IN_BUCKET;
+        // 恢复为等待执行, 之后的unschedule可以取消它
+        uint32_t expected_version = id_version + 1;
+        if (task->version.compare_exchange_strong(expected_version, id_version,
+                    std::memory_order_release)) {
+            task->shard->push_task(task);
+            return;
+        }
+        // 执行期间被unschedule
+        return_task(task);
+    }
+
+    void TimerThread::run_task(Task* task) {
+        void (*fn)(void*) = task->fn;
+        const bool track = (_options.slow_callback_us > 0);
+        const int64_t begin_ns = (track ? now_ns() : 0);
+        if (task->period_ns > 0) {
+            run_periodic_task(task);
+        }
+        else {
+            task->run_and_del();
+        }
+        if (!track) {
+            return;
+        }
+        const int64_t cost_us = (now_ns() - begin_ns) / 1000;
+        int64_t max_us = _max_callback_us.load(std::memory_order_relaxed);
+        while (cost_us > max_us) {
+            if (_max_callback_us.compare_exchange_weak(max_us, cost_us, std::memory_order_relaxed)) {
+                break;
+            }
+        }
+        if (cost_us >= _options.slow_callback_us) {
+            _nslow_callbacks.fetch_add(1, std::memory_order_relaxed);
+            log_warn("slow timer callback [%p] cost [%lld]us\n", fn, static_cast<long long>(cost_us));
+        }
+    }
+
+    void TimerThread::get_stats(TimerThreadStats* stats) const {
+        stats->nslow_callbacks = _nslow_callbacks.load(std::memory_order_relaxed);
+        stats->max_callback_us = _max_callback_us.load(std::memory_order_relaxed);
+        stats->ncancelled_resident = 0;
+        stats->nwakeups = 0;
+        stats->nbatches = 0;
+        stats->nfired = 0;
+        stats->mean_batch_size = 0;
+        stats->queue_depth = 0;
+        for (int i = 0; i < TimerThreadStats::LATENESS_BUCKET_NUM; ++i) {
+            stats->lateness_hist[i] = 0;
+        }
+        if (_shards == NULL) {
+            return;
+        }
+        for (size_t i = 0; i < _options.num_shards; ++i) {
+            _shards[i].add_stats(stats);
+        }
+        if (stats->nbatches != 0) {
+            stats->mean_batch_size = static_cast<double>(stats->nfired) / static_cast<double>(stats->nbatches);
+        }
+    }
+
+    int64_t TimerThreadStats::lateness_percentile_us(double ratio) const {
+        int64_t total = 0;
+        for (int i = 0; i < LATENESS_BUCKET_NUM; ++i) {
+            total += lateness_hist[i];
+        }
+        if (total == 0) {
+            return 0;
+        }
+        const double target = ratio * static_cast<double>(total);
+        int64_t count = 0;
+        for (int i = 0; i < LATENESS_BUCKET_NUM - 1; ++i) {
+            count += lateness_hist[i];
+            if (static_cast<double>(count) >= target) {
+                return static_cast<int64_t>(1) << i;
+            }
+        }
+        return static_cast<int64_t>(1) << (LATENESS_BUCKET_NUM - 1);
     }
 
     static pthread_once_t g_timer_thread_once = PTHREAD_ONCE_INIT;
@@ -365,6 +1623,11 @@ namespace xthread
     static void init_global_timer_thread() {
         g_timer_thread = new (std::nothrow) TimerThread();
         TimerThreadOptions option;
+        // XTHREAD_TIMER_THREAD_SHARDS: 全局TimerThread的分片数量
+        const char* env = getenv("XTHREAD_TIMER_THREAD_SHARDS");
+        if (env != NULL && atoi(env) > 0) {
+            option.num_shards = atoi(env);
+        }
         g_timer_thread->start(&option);
     }
 
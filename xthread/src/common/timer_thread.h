@@ -4,23 +4,79 @@
 #include <vector>
 #include <pthread.h>
 #include <atomic>
-#include <memory>
 #include "../common/util.h"
-#include "../base/lock.h"
 #include "../base/noncopyable.h"
+#include "../base/time.h"
 namespace xthread {
+class TaskControl;
+struct TimerTaskBatch;
+
 struct TimerThreadOptions {
+	// 二叉堆: 插入和取出O(log n); 分层时间轮: 插入和到期O(1), 精度为wheel_tick_us
+	static const int ENGINE_HEAP = 0;
+	static const int ENGINE_TIMING_WHEEL = 1;
+
 	size_t num_buckets;
+	// 分片数量, 每个分片有独立的线程, Bucket, Engine和futex, 到期的Task由各自的分片线程执行
+	size_t num_shards;
 	void (*begin_fn)(void *);
 	void (*end_fn) (void *);
 	void *args;
+	int engine;
+	int64_t wheel_tick_us;
+
+	// 到期Task的执行方式: 在分片线程中直接执行; 批量交给executor_threads个pthread执行;
+	// 批量作为xthread task投递到task_control(为NULL时使用全局的TaskControl), 工作线程调度的Task投递回它的TaskGroup
+	// 使用EXECUTOR_XTHREAD时先停止(析构)TimerThread再停止task_control, 并且不能在task_control的工作线程中停止TimerThread:
+	// 先停止的TaskControl会丢弃队列中的batch, 这些batch在stop_and_join的线程中执行并且不再归还;
+	// 在工作线程中调用stop_and_join时不等待还没有执行完的batch
+	static const int EXECUTOR_INLINE = 0;
+	static const int EXECUTOR_PTHREAD_POOL = 1;
+	static const int EXECUTOR_XTHREAD = 2;
+	int executor;
+	size_t executor_threads;
+	TaskControl* task_control;
+	// 单个回调执行超过这个时间时打印警告并计数, 小于等于0时不统计回调的执行时间
+	int64_t slow_callback_us;
+	// 使用TSC计算当前时间(base::cpuwide_time_ns), CPU不支持恒定频率的TSC时使用CLOCK_MONOTONIC
+	bool use_tsc;
+	// 每个Task最多可以推迟slack_ns执行: 分片线程在最早的Task到期slack_ns之后才醒来,
+	// 这段时间内到期的Task在同一次唤醒中执行, 减少futex唤醒的次数
+	int64_t slack_ns;
 	TimerThreadOptions();
 };
 
+struct TimerThreadStats {
+	// 执行时间超过slow_callback_us的回调数量, 以及最长的回调执行时间
+	int64_t nslow_callbacks;
+	int64_t max_callback_us;
+	// 已经被取消, 但还没有从TimerThread中移除的Task数量
+	int64_t ncancelled_resident;
+	// 分片线程从futex等待中返回的次数(累计值, 两次采样之差除以间隔得到每秒唤醒次数)
+	int64_t nwakeups;
+	// 执行了Task的轮数, 执行的Task数量, 以及平均每轮执行的Task数量
+	int64_t nbatches;
+	int64_t nfired;
+	double mean_batch_size;
+	// 等待到期的Task数量(包括已经取消还没有移除的): Bucket中的实时值加上各分片Engine中每一轮结束时的值
+	int64_t queue_depth;
+	// 分片线程取出Task时比run_time晚的时间分布: 第0个桶小于1us, 第i个桶为[2^(i-1), 2^i)us,
+	// 最后一个桶包括所有更大的值
+	static const int LATENESS_BUCKET_NUM = 24;
+	int64_t lateness_hist[LATENESS_BUCKET_NUM];
+
+	// 按照lateness_hist估计的分位数, 返回所在桶的上界(us), ratio的取值为(0, 1]
+	int64_t lateness_percentile_us(double ratio) const;
+};
+
 class TimerThread : base::NonCopyable {
 public:
 	struct Task;
 	class Bucket;
+	class Engine;
+	class Shard;
+	class Executor;
+	// 高32位为version, 低32位为Task在ResourcePool中的slot
 	typedef uint64_t TaskId;
 	const static TaskId INVALID_TASK_ID = 0;
 	TimerThread();
@@ -28,25 +84,47 @@ public:
 
 	int start(const TimerThreadOptions* options);
 	void stop_and_join();
-    std::weak_ptr<Task>  schedule(void (*fn)(void *), void* arg, const timespec& abstime);
-	int unschedule(std::weak_ptr<Task> wpTask);
+	// abstime为CLOCK_REALTIME的绝对时间, 失败时返回INVALID_TASK_ID
+	TaskId schedule(void (*fn)(void *), void* arg, const timespec& abstime);
+	// delay_ns纳秒之后执行, 按照单调时钟计时
+	TaskId schedule_after(void (*fn)(void *), void* arg, int64_t delay_ns);
+
+	// 周期Task: FIXED_RATE按照第一次的到期时间每period_ns执行一次, 落后超过一个周期时跳过错过的周期;
+	// FIXED_DELAY在上一次执行结束period_ns之后再执行
+	static const int PERIODIC_FIXED_RATE = 0;
+	static const int PERIODIC_FIXED_DELAY = 1;
+	// 第一次在period_ns之后执行, 每次执行之后复用同一个Task重新调度, TaskId不变
+	TaskId schedule_periodic(void (*fn)(void *), void* arg, int64_t period_ns, int flags);
+	// 0: 取消成功; 1: Task正在执行(周期Task在这次执行之后不再执行); -1: Task已经执行完成/被取消或者id不合法
+	int unschedule(TaskId task_id);
+	void get_stats(TimerThreadStats* stats) const;
 
 private:
-	void run();
-	static void * run_timer_thread(void* arg);
+	static const size_t MAX_SHARD_NUM = 64;
+
+	// 工作线程使用自己的TaskGroup对应的分片, 其他线程按照线程id哈希
+	Shard* choose_shard();
+
 	bool _started;
     std::atomic<bool> _stop;
+	bool _use_tsc;
 
-	TimerThreadOptions _options;
-	Bucket* _buckets;
-
-    base::MutexLock mutexLock_;
-	int64_t _nearest_run_time;
+	// 执行Task并统计执行时间
+	void run_task(Task* task);
+	// 执行周期Task并重新调度
+	void run_periodic_task(Task* task);
 
-    // _nsignals: 用来判断futex需要等待的数据是否发生变化
-	int _nsignals;
-	pthread_t _thread;
+	// Task::run_time所在的时间轴, 单位为纳秒
+	int64_t now_ns() const {
+		return _use_tsc ? base::cpuwide_time_ns() : base::monotonic_time_ns();
+	}
 
+	TimerThreadOptions _options;
+	Shard* _shards;
+	// EXECUTOR_INLINE时为NULL
+	Executor* _executor;
+	std::atomic<int64_t> _nslow_callbacks;
+	std::atomic<int64_t> _max_callback_us;
 };
 
 TimerThread* get_or_create_global_timer_thread();
@@ -1,8 +1,36 @@
 #ifndef XTHREAD_COMMON_UTIL_H
 #define XTHREAD_COMMON_UTIL_H
+#include <stdint.h>
 
 namespace xthread
 {
+    // MurmurHash3的finalizer, 用于把线程id等打散
+    inline uint64_t fmix64(uint64_t k) {
+        k ^= k >> 33;
+        k *= 0xff51afd7ed558ccdLLU;
+        k ^= k >> 33;
+        k *= 0xc4ceb9fe1a85ec53LLU;
+        k ^= k >> 33;
+        return k;
+    }
 
+    // xorshift64* 伪随机数, state不能为0
+    inline uint64_t xorshift64(uint64_t* state) {
+        uint64_t x = *state;
+        x ^= x >> 12;
+        x ^= x << 25;
+        x ^= x >> 27;
+        *state = x;
+        return x * 0x2545f4914f6cdd1dLLU;
+    }
+
+    inline uint64_t gcd(uint64_t a, uint64_t b) {
+        while (b != 0) {
+            uint64_t t = a % b;
+            a = b;
+            b = t;
+        }
+        return a;
+    }
 }
 #endif
@@ -2,41 +2,188 @@
 #define XTHREAD_COMMON_WORK_STEALING_QUEUE_H
 #include <cstddef>
 #include <atomic>
+#include <vector>
 #include <new>
+#include "macros.h"
 #include "../base/noncopyable.h"
 namespace xthread
 {
-    template <typename T>
-    class WorkStealingQueue : base::NonCopyable{
-    public:
-        WorkStealingQueue()
-            : bottom_(1),
-              top_(1),
-              capacity_(0),
-              buffer_(NULL)
-        {
-
+    namespace detail
+    {
+        inline size_t round_up_power_of_2(size_t n) {
+            size_t c = 1;
+            while (c < n) {
+                c <<= 1;
+            }
+            return c;
         }
 
-        ~WorkStealingQueue() {
-            delete[] buffer_;
-            buffer_ = NULL;
-        }
+        /*
+         *  容量在运行时确定的环形数组, 可以选择在满的时候扩容
+         */
+        template <typename T>
+        class DynamicWsqBuffer {
+        private:
+            struct Array {
+                size_t mask;
+                T* buffer;
+            };
 
-        bool init(size_t capacity) {
-            if (capacity_ != 0) {
-                return false;
+        public:
+            class View {
+            public:
+                explicit View(Array* a) : a_(a) {}
+                T& at(size_t i) const {
+                    return a_->buffer[i & a_->mask];
+                }
+            private:
+                Array* a_;
+            };
+
+            DynamicWsqBuffer() : array_(NULL), growable_(false) {}
+
+            ~DynamicWsqBuffer() {
+                delete_array(array_.load(std::memory_order_relaxed));
+                for (size_t i = 0; i < retired_.size(); ++i) {
+                    delete_array(retired_[i]);
+                }
             }
-            if (capacity == 0) {
-                return false;
+
+            bool init(size_t capacity, bool growable) {
+                if (array_.load(std::memory_order_relaxed) != NULL || capacity == 0) {
+                    return false;
+                }
+                Array* a = new_array(round_up_power_of_2(capacity));
+                if (a == NULL) {
+                    return false;
+                }
+                growable_ = growable;
+                array_.store(a, std::memory_order_relaxed);
+                return true;
             }
 
-            buffer_ = new (std::nothrow) T[capacity];
-            if (buffer_ == NULL) {
-                return false;
+            size_t capacity() const {
+                return array_.load(std::memory_order_relaxed)->mask + 1;
             }
-            capacity_ = capacity;
-            return true;
+
+            View owner_view() const {
+                return View(array_.load(std::memory_order_relaxed));
+            }
+
+            // 读到的可能是已经被替换的旧数组, 旧数组在队列销毁前不会释放,
+            // 并且下标在[t, b)之间的元素和新数组中相同
+            View thief_view() const {
+                return View(array_.load(std::memory_order_acquire));
+            }
+
+            /*
+             *  只被拥有者调用, 保证可以写入下标b, 不能写入时返回false.
+             *  扩容时把[t, b)复制到两倍大小的新数组中, 偷取者可能还在读旧数组,
+             *  旧数组放入retired_, 在队列销毁时释放, 所有旧数组的总大小小于当前数组的大小
+             */
+            bool reserve(size_t t, size_t b) {
+                Array* old = array_.load(std::memory_order_relaxed);
+                if (likely(b - t <= old->mask)) {
+                    return true;
+                }
+                if (!growable_) {
+                    return false;
+                }
+                Array* a = new_array((old->mask + 1) * 2);
+                if (a == NULL) {
+                    return false;
+                }
+                for (size_t i = t; i != b; ++i) {
+                    a->buffer[i & a->mask] = old->buffer[i & old->mask];
+                }
+                try {
+                    retired_.push_back(old);
+                } catch (...) {
+                    delete_array(a);
+                    return false;
+                }
+                array_.store(a, std::memory_order_release);
+                return true;
+            }
+
+        private:
+            static Array* new_array(size_t capacity) {
+                Array* a = new (std::nothrow) Array;
+                if (a == NULL) {
+                    return NULL;
+                }
+                a->buffer = new (std::nothrow) T[capacity];
+                if (a->buffer == NULL) {
+                    delete a;
+                    return NULL;
+                }
+                a->mask = capacity - 1;
+                return a;
+            }
+
+            static void delete_array(Array* a) {
+                if (a) {
+                    delete[] a->buffer;
+                    delete a;
+                }
+            }
+
+        private:
+            std::atomic<Array*> array_;
+            bool growable_;
+            // 已经被替换的数组, 只被拥有者访问
+            std::vector<Array*> retired_;
+        };
+
+        /*
+         *  编译期确定容量的环形数组, 数组内嵌在队列对象中
+         */
+        template <typename T, size_t N>
+        class FixedWsqBuffer {
+        public:
+            static_assert(N != 0 && (N & (N - 1)) == 0, "capacity must be a power of 2");
+            static const size_t MASK = N - 1;
+
+            class View {
+            public:
+                explicit View(T* buffer) : buffer_(buffer) {}
+                T& at(size_t i) const {
+                    return buffer_[i & MASK];
+                }
+            private:
+                T* buffer_;
+            };
+
+            View owner_view() {
+                return View(buffer_);
+            }
+
+            View thief_view() {
+                return View(buffer_);
+            }
+
+            bool reserve(size_t t, size_t b) {
+                return b - t < N;
+            }
+
+        private:
+            T buffer_[N];
+        };
+    }
+
+    /*
+     *  Chase-Lev work stealing queue, 只有拥有者可以push/pop, 其他线程steal.
+     *  bottom_只被拥有者修改, top_被偷取者CAS, 两者放在不同的cache line上
+     */
+    template <typename T, typename Buffer>
+    class BasicWorkStealingQueue : base::NonCopyable{
+    public:
+        BasicWorkStealingQueue()
+            : bottom_(1),
+              top_(1),
+              nbatch_stealers_(0)
+        {
+
         }
 
         /*
@@ -45,10 +192,10 @@ namespace xthread
         bool push(const T& param) {
             const size_t b = bottom_.load(std::memory_order_relaxed);
             const size_t t = top_.load(std::memory_order_acquire);
-            if (b - t >= capacity_) {
+            if (unlikely(!buffer_.reserve(t, b))) {
                 return false;
             }
-            buffer_[b%capacity_] = param;
+            buffer_.owner_view().at(b) = param;
             bottom_.store(b+1, std::memory_order_release);
             return true;
         }
@@ -60,7 +207,13 @@ namespace xthread
             size_t t = top_.load(std::memory_order_relaxed);
             bool popped = false;
             if (t <= b) {
-                *val = buffer_[b%capacity_];
+                if (unlikely(nbatch_stealers_.load(std::memory_order_relaxed) != 0)) {
+                    // 批量偷取可能已经根据旧的bottom_预留了包含b的区间,
+                    // 这时恢复bottom_, 和偷取者一样通过CAS top_获取任务
+                    bottom_.store(b + 1, std::memory_order_relaxed);
+                    return steal_one(val);
+                }
+                *val = buffer_.owner_view().at(b);
                 if (t != b) {
                     return true;
                 }
@@ -77,20 +230,98 @@ namespace xthread
             if (t >= b) {
                 return false;
             }
-            *val = buffer_[t % capacity_];
+            *val = buffer_.thief_view().at(t);
             return top_.compare_exchange_strong(t, t+1, std::memory_order_seq_cst, std::memory_order_relaxed);
         }
 
+        /*
+         *  一次CAS top_偷取最多一半的任务, 返回偷取的数量
+         */
+        size_t steal_batch(T* out, size_t max) {
+            if (max == 0) {
+                return 0;
+            }
+            // 和pop中的读取构成Dekker式同步: pop要么看到有批量偷取正在进行,
+            // 要么这里读到的bottom_已经包含了pop的修改
+            nbatch_stealers_.fetch_add(1, std::memory_order_seq_cst);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            size_t t = top_.load(std::memory_order_acquire);
+            const size_t b = bottom_.load(std::memory_order_acquire);
+            size_t n = 0;
+            if (t < b) {
+                n = (b - t + 1) / 2;
+                if (n > max) {
+                    n = max;
+                }
+                typename Buffer::View v = buffer_.thief_view();
+                for (size_t i = 0; i < n; ++i) {
+                    out[i] = v.at(t + i);
+                }
+                if (!top_.compare_exchange_strong(t, t + n, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+                    n = 0;
+                }
+            }
+            nbatch_stealers_.fetch_sub(1, std::memory_order_release);
+            return n;
+        }
+
         size_t volatile_size() const {
             const size_t b = bottom_.load(std::memory_order_relaxed);
             const size_t t = top_.load(std::memory_order_relaxed);
             return (b < t ? 0 : (b - t));
         }
+
     private:
+        // 只被拥有者在pop的慢路径中调用, 失败时重试直到成功或者队列为空
+        bool steal_one(T* val) {
+            while (true) {
+                size_t t = top_.load(std::memory_order_acquire);
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                const size_t b = bottom_.load(std::memory_order_acquire);
+                if (t >= b) {
+                    return false;
+                }
+                *val = buffer_.owner_view().at(t);
+                if (top_.compare_exchange_strong(t, t+1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+                    return true;
+                }
+            }
+        }
+
+    protected:
         std::atomic<size_t> bottom_;
+        char bottom_pad_[XTHREAD_CACHELINE_SIZE - sizeof(std::atomic<size_t>)];
+        // top_和nbatch_stealers_都由偷取者修改
         std::atomic<size_t> top_;
-        size_t capacity_;
-        T* buffer_;
+        std::atomic<size_t> nbatch_stealers_;
+        char top_pad_[XTHREAD_CACHELINE_SIZE - 2 * sizeof(std::atomic<size_t>)];
+        Buffer buffer_;
+    };
+
+    /*
+     *  容量在init时确定, 向上取整为2的幂. growable为true时队列满了push会把数组扩大一倍
+     */
+    template <typename T>
+    class WorkStealingQueue : public BasicWorkStealingQueue<T, detail::DynamicWsqBuffer<T> > {
+    public:
+        bool init(size_t capacity, bool growable = false) {
+            return this->buffer_.init(capacity, growable);
+        }
+
+        size_t capacity() const {
+            return this->buffer_.capacity();
+        }
+    };
+
+    /*
+     *  容量N在编译期确定, 必须是2的幂, 不需要init
+     */
+    template <typename T, size_t N>
+    class FixedWorkStealingQueue : public BasicWorkStealingQueue<T, detail::FixedWsqBuffer<T, N> > {
+    public:
+        size_t capacity() const {
+            return N;
+        }
     };
 }
 
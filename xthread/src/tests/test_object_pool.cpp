@@ -1,9 +1,16 @@
 #include <gtest/gtest.h>
 #include <string>
 #include <cstdio>
+#include <cstring>
 #include <vector>
 #include <cstdio>
+#include <atomic>
+#include <algorithm>
+#include <memory>
+#include <utility>
 #include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
 #include "../common/obj_pool/object_pool.h"
 #include "../base/time.h"
 int main(int argc, char **argv) {
@@ -215,3 +222,407 @@ TEST_F(ObjectPoolTest, test_multi_thread) {
     std::cout<< info_str<<std::endl<<pool_str<<std::endl;
     xthread::base::clear_objects<TestObjectDyMark>();
 }
+
+// 一个线程分配, 另一个线程归还: 满的FreeChunk不断从归还线程转移到分配线程
+struct HandoffObject {
+    std::atomic<int> in_use;
+    HandoffObject() : in_use(0) {}
+};
+
+struct HandoffQueue {
+    pthread_mutex_t mutex;
+    std::vector<HandoffObject*> objs;
+    bool done;
+    size_t nduplicate;
+};
+
+const size_t NHANDOFF = 200000;
+
+void* handoff_alloc_thread(void* arg) {
+    HandoffQueue* q = static_cast<HandoffQueue*>(arg);
+    std::vector<HandoffObject*> batch;
+    for (size_t i = 0; i < NHANDOFF; ++i) {
+        HandoffObject* obj = xthread::base::get_object<HandoffObject>();
+        int expected = 0;
+        if (!obj->in_use.compare_exchange_strong(expected, 1)) {
+            ++q->nduplicate;
+        }
+        batch.push_back(obj);
+        if (batch.size() == 100 || i + 1 == NHANDOFF) {
+            pthread_mutex_lock(&q->mutex);
+            q->objs.insert(q->objs.end(), batch.begin(), batch.end());
+            pthread_mutex_unlock(&q->mutex);
+            batch.clear();
+        }
+    }
+    pthread_mutex_lock(&q->mutex);
+    q->done = true;
+    pthread_mutex_unlock(&q->mutex);
+    return NULL;
+}
+
+void* handoff_free_thread(void* arg) {
+    HandoffQueue* q = static_cast<HandoffQueue*>(arg);
+    std::vector<HandoffObject*> batch;
+    while (true) {
+        pthread_mutex_lock(&q->mutex);
+        batch.swap(q->objs);
+        const bool done = q->done;
+        pthread_mutex_unlock(&q->mutex);
+        for (size_t i = 0; i < batch.size(); ++i) {
+            batch[i]->in_use.store(0);
+            xthread::base::return_object<HandoffObject>(batch[i]);
+        }
+        if (batch.empty() && done) {
+            break;
+        }
+        batch.clear();
+    }
+    return NULL;
+}
+
+TEST_F(ObjectPoolTest, test_cross_thread_free) {
+    const size_t npair = 2;
+    HandoffQueue queues[npair];
+    pthread_t alloc_tid[npair];
+    pthread_t free_tid[npair];
+    for (size_t i = 0; i < npair; ++i) {
+        pthread_mutex_init(&queues[i].mutex, NULL);
+        queues[i].done = false;
+        queues[i].nduplicate = 0;
+        ASSERT_EQ(0, pthread_create(&free_tid[i], NULL, handoff_free_thread, &queues[i]));
+        ASSERT_EQ(0, pthread_create(&alloc_tid[i], NULL, handoff_alloc_thread, &queues[i]));
+    }
+    for (size_t i = 0; i < npair; ++i) {
+        pthread_join(alloc_tid[i], NULL);
+        pthread_join(free_tid[i], NULL);
+        // 同一个对象不会同时分配给两个使用者
+        EXPECT_EQ(0UL, queues[i].nduplicate);
+        pthread_mutex_destroy(&queues[i].mutex);
+    }
+    // 归还的对象被复用, 分配的Block数量远小于分配的次数
+    xthread::base::ObjectPoolInfo info = xthread::base::ObjectPool<HandoffObject>::getInstance()->get_object_pool_info();
+    EXPECT_LT(info.item_num, npair * NHANDOFF / 2);
+}
+
+struct BatchObject {
+    char data[64];
+};
+
+TEST_F(ObjectPoolTest, test_batch) {
+    using namespace xthread::base;
+    // 跨越多个Block和FreeChunk
+    const size_t n = 3000;
+    std::vector<BatchObject*> objs(n);
+    ASSERT_EQ(n, get_objects<BatchObject>(&objs[0], n));
+    std::vector<BatchObject*> sorted(objs);
+    std::sort(sorted.begin(), sorted.end());
+    EXPECT_TRUE(sorted[0] != NULL);
+    EXPECT_TRUE(std::adjacent_find(sorted.begin(), sorted.end()) == sorted.end());
+
+    // 和单个的接口混合使用
+    ASSERT_EQ(0, return_objects<BatchObject>(&objs[0], n - 1));
+    ASSERT_EQ(0, return_object<BatchObject>(objs[n - 1]));
+    std::vector<BatchObject*> again(n);
+    ASSERT_EQ(n - 1, get_objects<BatchObject>(&again[0], n - 1));
+    again[n - 1] = get_object<BatchObject>();
+    // 归还的对象全部被复用
+    std::sort(again.begin(), again.end());
+    EXPECT_TRUE(sorted == again);
+    ASSERT_EQ(0, return_objects<BatchObject>(&again[0], n));
+    EXPECT_EQ(0UL, get_objects<BatchObject>(&again[0], 0));
+}
+
+struct TrimObject {
+    static std::atomic<int> nalive;
+    TrimObject() : value(7) {
+        nalive.fetch_add(1);
+    }
+    ~TrimObject() {
+        nalive.fetch_sub(1);
+    }
+    size_t value;
+    // 至少跨过一个完整的页
+    char data[2 * 4096];
+};
+std::atomic<int> TrimObject::nalive(0);
+
+// obj之后的第一个完整的页是否在内存中
+bool first_page_resident(const void* obj) {
+    const uintptr_t page_size = getpagesize();
+    const uintptr_t page = (reinterpret_cast<uintptr_t>(obj) + page_size - 1) & ~(page_size - 1);
+    unsigned char vec = 0;
+    EXPECT_EQ(0, mincore(reinterpret_cast<void*>(page), page_size, &vec));
+    return (vec & 1) != 0;
+}
+
+namespace xthread
+{
+namespace base
+{
+template <> struct ObjectPoolTrimPolicy<TrimObject> {
+    static const bool ENABLE = true;
+    static const size_t TRIM_IDLE_BLOCK_NUM = 0;
+};
+}
+}
+
+TEST_F(ObjectPoolTest, test_trim) {
+    using namespace xthread::base;
+    const size_t n = 200;
+    std::vector<TrimObject*> objs(n);
+    for (size_t i = 0; i < n; ++i) {
+        objs[i] = get_object<TrimObject>();
+        ASSERT_TRUE(objs[i] != NULL);
+        objs[i]->value = i;
+        memset(objs[i]->data, 1, sizeof(objs[i]->data));
+    }
+    EXPECT_EQ(static_cast<int>(n), TrimObject::nalive.load());
+    EXPECT_TRUE(first_page_resident(objs[n / 2]));
+    // 有对象在使用时Block不会被trim
+    EXPECT_EQ(0UL, trim_objects<TrimObject>());
+    // 归还时立即析构
+    ASSERT_EQ(0, return_objects<TrimObject>(&objs[0], n));
+    EXPECT_EQ(0, TrimObject::nalive.load());
+    const size_t ntrimmed = trim_objects<TrimObject>();
+    EXPECT_GT(ntrimmed, 0UL);
+    EXPECT_EQ(ntrimmed, ObjectPool<TrimObject>::getInstance()->get_object_pool_info().trimmed_block_num);
+    EXPECT_EQ(0UL, trim_objects<TrimObject>());
+    // 物理页已经还给操作系统
+    for (size_t i = 0; i < n; ++i) {
+        EXPECT_FALSE(first_page_resident(objs[i])) << i;
+    }
+
+    // 复用trim之后的Block时重新构造
+    for (size_t i = 0; i < n; ++i) {
+        objs[i] = get_object<TrimObject>();
+        ASSERT_TRUE(objs[i] != NULL);
+        EXPECT_EQ(7UL, objs[i]->value);
+        memset(objs[i]->data, 2, sizeof(objs[i]->data));
+    }
+    EXPECT_EQ(static_cast<int>(n), TrimObject::nalive.load());
+    EXPECT_EQ(0UL, ObjectPool<TrimObject>::getInstance()->get_object_pool_info().trimmed_block_num);
+    for (size_t i = 0; i < n; ++i) {
+        ASSERT_EQ(0, return_object<TrimObject>(objs[i]));
+    }
+    EXPECT_EQ(0, TrimObject::nalive.load());
+}
+
+struct CopyCounter {
+    static int ncopy;
+    CopyCounter() {}
+    CopyCounter(const CopyCounter&) {
+        ++ncopy;
+    }
+    CopyCounter(CopyCounter&&) {}
+};
+int CopyCounter::ncopy = 0;
+
+struct ForwardObject {
+    ForwardObject(std::unique_ptr<int> p, CopyCounter&& c, const std::string& s, int& ref)
+        : ptr(std::move(p)), counter(std::move(c)), str(s), ref_addr(&ref) {}
+    std::unique_ptr<int> ptr;
+    CopyCounter counter;
+    std::string str;
+    int* ref_addr;
+};
+
+TEST_F(ObjectPoolTest, test_forward_args) {
+    using namespace xthread::base;
+    int value = 0;
+    std::string s("forward");
+    ForwardObject* obj = get_object<ForwardObject>(std::unique_ptr<int>(new int(42)), CopyCounter(), s, value);
+    ASSERT_TRUE(obj != NULL);
+    EXPECT_EQ(42, *obj->ptr);
+    EXPECT_EQ(0, CopyCounter::ncopy);
+    EXPECT_EQ("forward", obj->str);
+    // 左值按照引用转发
+    EXPECT_EQ(&value, obj->ref_addr);
+    // 0到2个参数的旧用法不变
+    NoDefCtor* a = get_object<NoDefCtor>(1, 2);
+    EXPECT_EQ(3, a->value);
+    ASSERT_EQ(0, return_object(a));
+
+    // 复用归还的对象时同样用参数构造
+    ASSERT_EQ(0, return_object(obj));
+    int value2 = 0;
+    ForwardObject* obj2 = get_object<ForwardObject>(std::unique_ptr<int>(new int(7)), CopyCounter(), std::string("again"), value2);
+    ASSERT_EQ(obj, obj2);
+    EXPECT_EQ(7, *obj2->ptr);
+    EXPECT_EQ("again", obj2->str);
+    EXPECT_EQ(&value2, obj2->ref_addr);
+    ASSERT_EQ(0, return_object(obj2));
+    NoDefCtor* b = get_object<NoDefCtor>(5, 6);
+    ASSERT_EQ(a, b);
+    EXPECT_EQ(11, b->value);
+    ASSERT_EQ(0, return_object(b));
+}
+
+struct AutoTrimObject {
+    size_t value;
+    char data[2 * 4096];
+};
+
+namespace xthread
+{
+namespace base
+{
+template <> struct ObjectPoolTrimPolicy<AutoTrimObject> {
+    static const bool ENABLE = true;
+    static const size_t TRIM_IDLE_BLOCK_NUM = 1;
+};
+}
+}
+
+TEST_F(ObjectPoolTest, test_auto_trim) {
+    using namespace xthread::base;
+    ObjectPool<AutoTrimObject>* pool = ObjectPool<AutoTrimObject>::getInstance();
+    const size_t n = 200;
+    std::vector<AutoTrimObject*> objs(n);
+    for (size_t i = 0; i < n; ++i) {
+        objs[i] = get_object<AutoTrimObject>();
+        ASSERT_TRUE(objs[i] != NULL);
+        memset(objs[i]->data, 1, sizeof(objs[i]->data));
+    }
+    ASSERT_GT(pool->get_object_pool_info().block_num, 1UL);
+    // 第一个变为空闲的Block触发trim, 之后间隔内变为空闲的Block不会再触发
+    ASSERT_EQ(0, return_objects<AutoTrimObject>(&objs[0], n));
+    ObjectPoolInfo info = pool->get_object_pool_info();
+    EXPECT_GE(info.trimmed_block_num, 1UL);
+    EXPECT_LT(info.trimmed_block_num, info.block_num);
+
+    // 间隔之后Block再变为空闲时trim所有空闲的Block
+    usleep(detail::AUTO_TRIM_INTERVAL_NS / 1000 + 50000);
+    AutoTrimObject* obj = get_object<AutoTrimObject>();
+    ASSERT_TRUE(obj != NULL);
+    ASSERT_EQ(0, return_object<AutoTrimObject>(obj));
+    info = pool->get_object_pool_info();
+    EXPECT_EQ(info.block_num, info.trimmed_block_num);
+    EXPECT_FALSE(first_page_resident(objs[n / 2]));
+}
+
+TEST_F(ObjectPoolTest, test_trim_partial_page) {
+    using namespace xthread::base;
+    const size_t page_size = getpagesize();
+    char* mem = static_cast<char*>(mmap(NULL, 2 * page_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+    ASSERT_TRUE(mem != MAP_FAILED);
+    std::atomic<size_t> nlive(0);
+    // 范围内没有完整的页, 不算作trim过的Block
+    EXPECT_FALSE(detail::trim_block(&nlive, mem + 8, page_size));
+    EXPECT_EQ(0UL, nlive.load());
+    EXPECT_TRUE(detail::trim_block(&nlive, mem, page_size));
+    EXPECT_EQ(detail::BLOCK_TRIMMED, nlive.load());
+    munmap(mem, 2 * page_size);
+}
+
+struct AcquireArg {
+    std::atomic<size_t>* nlive;
+    std::atomic<bool> done;
+};
+
+void* acquire_thread(void* arg) {
+    AcquireArg* a = static_cast<AcquireArg*>(arg);
+    xthread::base::detail::acquire_block_item(a->nlive);
+    a->done.store(true);
+    return NULL;
+}
+
+TEST_F(ObjectPoolTest, test_trim_race) {
+    using namespace xthread::base;
+    const size_t len = 4 * getpagesize();
+    char* mem = static_cast<char*>(mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+    ASSERT_TRUE(mem != MAP_FAILED);
+    // trim已经开始(CAS到TRIMMING)之后才有线程分配Block中的对象
+    std::atomic<size_t> nlive(detail::BLOCK_TRIMMING);
+    AcquireArg arg;
+    arg.nlive = &nlive;
+    arg.done.store(false);
+    pthread_t th;
+    ASSERT_EQ(0, pthread_create(&th, NULL, acquire_thread, &arg));
+    usleep(10000);
+    // 等待trim结束
+    EXPECT_FALSE(arg.done.load());
+    nlive.fetch_add(detail::BLOCK_TRIMMED - detail::BLOCK_TRIMMING);
+    pthread_join(th, NULL);
+    EXPECT_EQ(1UL, nlive.load());
+    // 对象归还之后Block可以再次被trim
+    EXPECT_TRUE(detail::release_block_item(&nlive));
+    EXPECT_TRUE(detail::trim_block(&nlive, mem, len));
+    EXPECT_EQ(detail::BLOCK_TRIMMED, nlive.load());
+    munmap(mem, len);
+}
+
+struct TrimRaceObject {
+    TrimRaceObject() : value(7) {}
+    size_t value;
+    char data[4096];
+};
+
+namespace xthread
+{
+namespace base
+{
+template <> struct ObjectPoolTrimPolicy<TrimRaceObject> {
+    static const bool ENABLE = true;
+    static const size_t TRIM_IDLE_BLOCK_NUM = 0;
+};
+}
+}
+
+std::atomic<bool> g_trim_race_stop(false);
+
+void* trim_race_user(void*) {
+    using namespace xthread::base;
+    std::vector<TrimRaceObject*> objs;
+    for (int round = 0; round < 200; ++round) {
+        for (size_t i = 0; i < 64; ++i) {
+            TrimRaceObject* obj = get_object<TrimRaceObject>();
+            if (obj == NULL || obj->value != 7) {
+                abort();
+            }
+            obj->value = i;
+            objs.push_back(obj);
+        }
+        for (size_t i = 0; i < objs.size(); ++i) {
+            if (objs[i]->value != i) {
+                abort();
+            }
+            return_object(objs[i]);
+        }
+        objs.clear();
+    }
+    return NULL;
+}
+
+void* trim_race_trimmer(void*) {
+    while (!g_trim_race_stop.load()) {
+        xthread::base::trim_objects<TrimRaceObject>();
+    }
+    return NULL;
+}
+
+TEST_F(ObjectPoolTest, test_concurrent_trim) {
+    using namespace xthread::base;
+    const size_t NUSER = 3;
+    pthread_t users[NUSER];
+    pthread_t trimmer;
+    ASSERT_EQ(0, pthread_create(&trimmer, NULL, trim_race_trimmer, NULL));
+    for (size_t i = 0; i < NUSER; ++i) {
+        ASSERT_EQ(0, pthread_create(&users[i], NULL, trim_race_user, NULL));
+    }
+    for (size_t i = 0; i < NUSER; ++i) {
+        pthread_join(users[i], NULL);
+    }
+    g_trim_race_stop.store(true);
+    pthread_join(trimmer, NULL);
+    // 所有对象都已经归还, 每个Block都可以被trim
+    trim_objects<TrimRaceObject>();
+    ObjectPoolInfo info = ObjectPool<TrimRaceObject>::getInstance()->get_object_pool_info();
+    EXPECT_GT(info.block_num, 0UL);
+    EXPECT_EQ(info.block_num, info.trimmed_block_num);
+    // 再次使用之后归还, 空闲的Block还能再次被trim
+    TrimRaceObject* obj = get_object<TrimRaceObject>();
+    ASSERT_TRUE(obj != NULL);
+    ASSERT_EQ(0, return_object(obj));
+    EXPECT_EQ(1UL, trim_objects<TrimRaceObject>());
+}
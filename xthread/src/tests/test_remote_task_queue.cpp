@@ -0,0 +1,134 @@
+#include <algorithm>
+#include <vector>
+#include <atomic>
+#include <gtest/gtest.h>
+#include <pthread.h>
+#include "../common/remote_task_queue.h"
+int main(int argc, char **argv) {
+    testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
+
+class test_remote_queue_suite : public ::testing::Test {
+    protected:
+        test_remote_queue_suite() {
+
+        }
+        virtual ~test_remote_queue_suite() {
+
+        }
+        virtual void SetUp() {
+
+        }
+        virtual void TearDown() {
+
+        }
+};
+
+typedef size_t value_type;
+typedef xthread::RemoteTaskQueue<value_type> queue_type;
+const size_t NPRODUCER = 4;
+const size_t NPER_PRODUCER = 250000;
+const size_t NTHIEF = 2;
+std::atomic<size_t> nconsumed(0);
+
+struct ProducerArg {
+    queue_type* q;
+    size_t index;
+};
+
+void* producer_thread(void* arg) {
+    ProducerArg* pa = static_cast<ProducerArg*>(arg);
+    for (size_t i = 0; i < NPER_PRODUCER; ++i) {
+        const value_type val = pa->index * NPER_PRODUCER + i;
+        while (!pa->q->push(val)) {
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+// 拥有者批量取出
+void* owner_thread(void* arg) {
+    queue_type* q = static_cast<queue_type*>(arg);
+    std::vector<value_type>* got = new std::vector<value_type>;
+    value_type vals[32];
+    while (nconsumed.load(std::memory_order_relaxed) != NPRODUCER * NPER_PRODUCER) {
+        const size_t n = q->pop_batch(vals, 32);
+        got->insert(got->end(), vals, vals + n);
+        nconsumed.fetch_add(n, std::memory_order_relaxed);
+    }
+    return got;
+}
+
+// 偷取者每次取一个
+void* thief_thread(void* arg) {
+    queue_type* q = static_cast<queue_type*>(arg);
+    std::vector<value_type>* got = new std::vector<value_type>;
+    value_type val;
+    while (nconsumed.load(std::memory_order_relaxed) != NPRODUCER * NPER_PRODUCER) {
+        if (q->pop(&val)) {
+            got->push_back(val);
+            nconsumed.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+    return got;
+}
+
+TEST_F(test_remote_queue_suite, full_and_empty) {
+    queue_type q;
+    ASSERT_TRUE(q.init(5));
+    ASSERT_EQ(8UL, q.capacity());
+    value_type val;
+    ASSERT_FALSE(q.pop(&val));
+    for (size_t round = 0; round < 3; ++round) {
+        for (size_t i = 0; i < 8; ++i) {
+            ASSERT_TRUE(q.push(i));
+        }
+        ASSERT_FALSE(q.push(8));
+        ASSERT_EQ(8UL, q.volatile_size());
+        value_type vals[5];
+        ASSERT_EQ(5UL, q.pop_batch(vals, 5));
+        for (size_t i = 0; i < 5; ++i) {
+            ASSERT_EQ(i, vals[i]);
+        }
+        ASSERT_EQ(3UL, q.pop_batch(vals, 5));
+        ASSERT_EQ(7UL, vals[2]);
+        ASSERT_FALSE(q.pop(&val));
+    }
+}
+
+TEST_F(test_remote_queue_suite, multi_producer) {
+    queue_type q;
+    ASSERT_TRUE(q.init(1024));
+    nconsumed.store(0);
+    pthread_t producers[NPRODUCER];
+    ProducerArg args[NPRODUCER];
+    pthread_t consumers[NTHIEF + 1];
+    ASSERT_EQ(0, pthread_create(&consumers[0], NULL, owner_thread, &q));
+    for (size_t i = 1; i <= NTHIEF; ++i) {
+        ASSERT_EQ(0, pthread_create(&consumers[i], NULL, thief_thread, &q));
+    }
+    for (size_t i = 0; i < NPRODUCER; ++i) {
+        args[i].q = &q;
+        args[i].index = i;
+        ASSERT_EQ(0, pthread_create(&producers[i], NULL, producer_thread, &args[i]));
+    }
+    for (size_t i = 0; i < NPRODUCER; ++i) {
+        pthread_join(producers[i], NULL);
+    }
+    std::vector<value_type> all;
+    for (size_t i = 0; i <= NTHIEF; ++i) {
+        void* ret = NULL;
+        pthread_join(consumers[i], &ret);
+        std::vector<value_type>* got = static_cast<std::vector<value_type>*>(ret);
+        all.insert(all.end(), got->begin(), got->end());
+        delete got;
+    }
+    // 每个元素恰好被取出一次
+    ASSERT_EQ(NPRODUCER * NPER_PRODUCER, all.size());
+    std::sort(all.begin(), all.end());
+    for (size_t i = 0; i < all.size(); ++i) {
+        ASSERT_EQ(i, all[i]);
+    }
+}
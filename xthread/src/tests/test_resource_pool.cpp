@@ -1,8 +1,13 @@
 #include <gtest/gtest.h>
 #include <string>
 #include <cstdio>
+#include <cstring>
 #include <vector>
 #include <cstdio>
+#include <atomic>
+#include <algorithm>
+#include <memory>
+#include <utility>
 #include <pthread.h>
 #include "../common/obj_pool/resource_pool.h"
 #include "../base/time.h"
@@ -243,3 +248,199 @@ TEST_F(ObjectPoolTest, test_multi_thread) {
     std::cout<< info_str<<std::endl<<pool_str<<std::endl;
     xthread::base::clear_objects<TestObjectDyMark>();
 }
+
+// 一个线程分配, 另一个线程归还: 满的FreeChunkItems不断从归还线程转移到分配线程
+struct HandoffResource {
+    std::atomic<int> in_use;
+    HandoffResource() : in_use(0) {}
+};
+
+struct HandoffQueue {
+    pthread_mutex_t mutex;
+    std::vector<xthread::base::ResourceId<HandoffResource> > ids;
+    bool done;
+    size_t nduplicate;
+};
+
+const size_t NHANDOFF = 200000;
+
+void* handoff_alloc_thread(void* arg) {
+    HandoffQueue* q = static_cast<HandoffQueue*>(arg);
+    std::vector<xthread::base::ResourceId<HandoffResource> > batch;
+    for (size_t i = 0; i < NHANDOFF; ++i) {
+        xthread::base::ResourceId<HandoffResource> id;
+        HandoffResource* res = xthread::base::get_resource<HandoffResource>(&id);
+        int expected = 0;
+        if (!res->in_use.compare_exchange_strong(expected, 1)) {
+            ++q->nduplicate;
+        }
+        batch.push_back(id);
+        if (batch.size() == 100 || i + 1 == NHANDOFF) {
+            pthread_mutex_lock(&q->mutex);
+            q->ids.insert(q->ids.end(), batch.begin(), batch.end());
+            pthread_mutex_unlock(&q->mutex);
+            batch.clear();
+        }
+    }
+    pthread_mutex_lock(&q->mutex);
+    q->done = true;
+    pthread_mutex_unlock(&q->mutex);
+    return NULL;
+}
+
+void* handoff_free_thread(void* arg) {
+    HandoffQueue* q = static_cast<HandoffQueue*>(arg);
+    std::vector<xthread::base::ResourceId<HandoffResource> > batch;
+    while (true) {
+        pthread_mutex_lock(&q->mutex);
+        batch.swap(q->ids);
+        const bool done = q->done;
+        pthread_mutex_unlock(&q->mutex);
+        for (size_t i = 0; i < batch.size(); ++i) {
+            xthread::base::ResourcePool<HandoffResource>::get_addr_by_id_safe(batch[i])->in_use.store(0);
+            xthread::base::return_resource<HandoffResource>(batch[i]);
+        }
+        if (batch.empty() && done) {
+            break;
+        }
+        batch.clear();
+    }
+    return NULL;
+}
+
+TEST_F(ObjectPoolTest, test_cross_thread_free) {
+    const size_t npair = 2;
+    HandoffQueue queues[npair];
+    pthread_t alloc_tid[npair];
+    pthread_t free_tid[npair];
+    for (size_t i = 0; i < npair; ++i) {
+        pthread_mutex_init(&queues[i].mutex, NULL);
+        queues[i].done = false;
+        queues[i].nduplicate = 0;
+        ASSERT_EQ(0, pthread_create(&free_tid[i], NULL, handoff_free_thread, &queues[i]));
+        ASSERT_EQ(0, pthread_create(&alloc_tid[i], NULL, handoff_alloc_thread, &queues[i]));
+    }
+    for (size_t i = 0; i < npair; ++i) {
+        pthread_join(alloc_tid[i], NULL);
+        pthread_join(free_tid[i], NULL);
+        // 同一个id不会同时分配给两个使用者
+        EXPECT_EQ(0UL, queues[i].nduplicate);
+        pthread_mutex_destroy(&queues[i].mutex);
+    }
+}
+
+struct BatchResource {
+    char data[64];
+};
+
+TEST_F(ObjectPoolTest, test_batch) {
+    using namespace xthread::base;
+    const size_t n = 3000;
+    std::vector<ResourceId<BatchResource> > ids(n);
+    std::vector<BatchResource*> ptrs(n);
+    ASSERT_EQ(n, get_resources<BatchResource>(&ids[0], &ptrs[0], n));
+    std::vector<uint64_t> values;
+    for (size_t i = 0; i < n; ++i) {
+        EXPECT_EQ(ptrs[i], ResourcePool<BatchResource>::get_addr_by_id_safe(ids[i]));
+        values.push_back(ids[i].value);
+    }
+    std::sort(values.begin(), values.end());
+    EXPECT_TRUE(std::adjacent_find(values.begin(), values.end()) == values.end());
+
+    ASSERT_TRUE(return_resources<BatchResource>(&ids[0], n));
+    // 归还的id全部被复用, ptrs可以为NULL
+    std::vector<ResourceId<BatchResource> > again(n);
+    ASSERT_EQ(n, get_resources<BatchResource>(&again[0], static_cast<BatchResource**>(NULL), n));
+    std::vector<uint64_t> again_values;
+    for (size_t i = 0; i < n; ++i) {
+        again_values.push_back(again[i].value);
+    }
+    std::sort(again_values.begin(), again_values.end());
+    EXPECT_TRUE(values == again_values);
+    ASSERT_TRUE(return_resources<BatchResource>(&again[0], n));
+}
+
+struct TrimResource {
+    static std::atomic<int> nalive;
+    TrimResource() : value(7) {
+        nalive.fetch_add(1);
+    }
+    ~TrimResource() {
+        nalive.fetch_sub(1);
+    }
+    size_t value;
+    char data[4096];
+};
+std::atomic<int> TrimResource::nalive(0);
+
+namespace xthread
+{
+namespace base
+{
+template <> struct ResourcePoolTrimPolicy<TrimResource> {
+    static const bool ENABLE = true;
+    // Block变为全部空闲时自动trim
+    static const size_t TRIM_IDLE_BLOCK_NUM = 1;
+};
+}
+}
+
+TEST_F(ObjectPoolTest, test_trim) {
+    using namespace xthread::base;
+    const size_t n = 200;
+    std::vector<ResourceId<TrimResource> > ids(n);
+    for (size_t i = 0; i < n; ++i) {
+        TrimResource* r = get_resource<TrimResource>(&ids[i]);
+        ASSERT_TRUE(r != NULL);
+        r->value = i;
+        memset(r->data, 1, sizeof(r->data));
+    }
+    EXPECT_EQ(static_cast<int>(n), TrimResource::nalive.load());
+    EXPECT_EQ(0UL, trim_resources<TrimResource>());
+    ASSERT_TRUE(return_resources<TrimResource>(&ids[0], n));
+    EXPECT_EQ(0, TrimResource::nalive.load());
+    // 第一个变为空闲的Block自动trim, 间隔内其余的空闲Block留给trim_resources
+    EXPECT_GT(trim_resources<TrimResource>(), 0UL);
+    EXPECT_EQ(0UL, trim_resources<TrimResource>());
+
+    // id不变, 复用时重新构造
+    std::vector<ResourceId<TrimResource> > again(n);
+    std::vector<TrimResource*> ptrs(n);
+    ASSERT_EQ(n, get_resources<TrimResource>(&again[0], &ptrs[0], n));
+    for (size_t i = 0; i < n; ++i) {
+        EXPECT_EQ(ptrs[i], ResourcePool<TrimResource>::get_addr_by_id_safe(again[i]));
+        EXPECT_EQ(7UL, ptrs[i]->value);
+    }
+    EXPECT_EQ(static_cast<int>(n), TrimResource::nalive.load());
+    ASSERT_TRUE(return_resources<TrimResource>(&again[0], n));
+    EXPECT_EQ(0, TrimResource::nalive.load());
+}
+
+struct ForwardResource {
+    ForwardResource(std::unique_ptr<std::string> p, int& ref)
+        : ptr(std::move(p)), ref_addr(&ref) {}
+    std::unique_ptr<std::string> ptr;
+    int* ref_addr;
+};
+
+TEST_F(ObjectPoolTest, test_forward_args) {
+    using namespace xthread::base;
+    int value = 0;
+    ResourceId<ForwardResource> id;
+    ForwardResource* r = get_resource<ForwardResource>(&id, std::unique_ptr<std::string>(new std::string("forward")), value);
+    ASSERT_TRUE(r != NULL);
+    EXPECT_EQ(r, ResourcePool<ForwardResource>::get_addr_by_id_safe(id));
+    EXPECT_EQ("forward", *r->ptr);
+    EXPECT_EQ(&value, r->ref_addr);
+
+    // 复用归还的资源时同样用参数构造
+    ASSERT_TRUE(return_resource(id));
+    int value2 = 0;
+    ResourceId<ForwardResource> id2;
+    ForwardResource* r2 = get_resource<ForwardResource>(&id2, std::unique_ptr<std::string>(new std::string("again")), value2);
+    ASSERT_EQ(r, r2);
+    EXPECT_EQ(id.value, id2.value);
+    EXPECT_EQ("again", *r2->ptr);
+    EXPECT_EQ(&value2, r2->ref_addr);
+    ASSERT_TRUE(return_resource(id2));
+}
@@ -0,0 +1,218 @@
+#include <vector>
+#include <gtest/gtest.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include "../common/stack.h"
+int main(int argc, char **argv) {
+    testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
+
+class StackTest : public ::testing::Test {
+    protected:
+        StackTest() {
+
+        }
+        virtual ~StackTest() {
+
+        }
+        virtual void SetUp() {
+
+        }
+        virtual void TearDown() {
+
+        }
+};
+
+void entry(intptr_t) {
+}
+
+typedef xthread::StackContainerFactory<xthread::SmallStackClass> SmallFactory;
+
+TEST_F(StackTest, reuse_cached_stack) {
+    xthread::StackContainer* sc = xthread::get_stack(xthread::StackType::STACK_TYPE_SMALL, entry);
+    ASSERT_TRUE(sc != NULL);
+    ASSERT_TRUE(sc->stack != NULL);
+    const int expected_type = xthread::StackType::STACK_TYPE_SMALL;
+    EXPECT_EQ(expected_type, sc->stacktype);
+    void* mem = sc->stack;
+    const int nfree = SmallFactory::local_cached_num();
+    xthread::return_stack(sc);
+    EXPECT_EQ(nfree + 1, SmallFactory::local_cached_num());
+
+    // 同一个线程再次获取时复用缓存的栈, 不需要重新mmap
+    sc = xthread::get_stack(xthread::StackType::STACK_TYPE_SMALL, entry);
+    ASSERT_TRUE(sc != NULL);
+    EXPECT_EQ(mem, sc->stack);
+    EXPECT_EQ(nfree, SmallFactory::local_cached_num());
+    xthread::return_stack(sc);
+}
+
+void* get_and_return_many(void* arg) {
+    const size_t n = *static_cast<size_t*>(arg);
+    std::vector<xthread::StackContainer*> stacks;
+    for (size_t i = 0; i < n; ++i) {
+        xthread::StackContainer* sc = xthread::get_stack(xthread::StackType::STACK_TYPE_SMALL, entry);
+        EXPECT_TRUE(sc != NULL);
+        stacks.push_back(sc);
+    }
+    for (size_t i = 0; i < stacks.size(); ++i) {
+        xthread::return_stack(stacks[i]);
+    }
+    return reinterpret_cast<void*>(static_cast<intptr_t>(SmallFactory::local_cached_num()));
+}
+
+TEST_F(StackTest, cache_capacity) {
+    ASSERT_EQ(0, xthread::set_max_cached_stacks(xthread::StackType::STACK_TYPE_SMALL, 8));
+    size_t n = 20;
+    pthread_t th;
+    void* ret = NULL;
+    ASSERT_EQ(0, pthread_create(&th, NULL, get_and_return_many, &n));
+    pthread_join(th, &ret);
+    // 超过上限的栈被直接释放
+    EXPECT_EQ(8, static_cast<int>(reinterpret_cast<intptr_t>(ret)));
+    EXPECT_EQ(-1, xthread::set_max_cached_stacks(xthread::StackType::STACK_TYPE_MAIN, 8));
+    EXPECT_EQ(-1, xthread::set_max_cached_stacks(xthread::StackType::STACK_TYPE_SMALL, -1));
+    ASSERT_EQ(0, xthread::set_max_cached_stacks(xthread::StackType::STACK_TYPE_SMALL,
+                xthread::StackCacheConfig::MAX_CACHED_SMALL));
+}
+
+static bool page_resident(void* addr) {
+    unsigned char vec = 0;
+    const long pagesize = sysconf(_SC_PAGESIZE);
+    void* page = reinterpret_cast<void*>(reinterpret_cast<uintptr_t>(addr) & ~static_cast<uintptr_t>(pagesize - 1));
+    EXPECT_EQ(0, mincore(page, static_cast<size_t>(pagesize), &vec));
+    return vec & 1;
+}
+
+TEST_F(StackTest, trim_idle_stacks) {
+    const size_t N = 4;
+    // 之前的测试缓存的栈也先trim, 下面取到的栈不管是新分配的还是复用的, 栈底都没有物理内存
+    xthread::trim_cached_stacks(0, false);
+    std::vector<xthread::StackContainer*> stacks;
+    for (size_t i = 0; i < N; ++i) {
+        xthread::StackContainer* sc = xthread::get_stack(xthread::StackType::STACK_TYPE_SMALL, entry);
+        ASSERT_TRUE(sc != NULL);
+        // 新分配的栈在访问之前不占用物理内存
+        char* low = static_cast<char*>(sc->stack) - sc->stacksize;
+        EXPECT_FALSE(page_resident(low));
+        memset(low, 1, static_cast<size_t>(sc->stacksize));
+        EXPECT_TRUE(page_resident(low));
+        stacks.push_back(sc);
+    }
+    for (size_t i = 0; i < N; ++i) {
+        xthread::return_stack(stacks[i]);
+    }
+    // 刚归还的栈还不满足空闲2轮的条件
+    xthread::trim_cached_stacks(2, false);
+    EXPECT_TRUE(page_resident(static_cast<char*>(stacks[0]->stack) - stacks[0]->stacksize));
+    EXPECT_GE(xthread::trim_cached_stacks(0, false), N);
+    for (size_t i = 0; i < N; ++i) {
+        char* low = static_cast<char*>(stacks[i]->stack) - stacks[i]->stacksize;
+        EXPECT_FALSE(page_resident(low));
+    }
+    // 已经trim过的栈不会重复madvise, 仍然可以正常复用
+    EXPECT_EQ(0UL, xthread::trim_cached_stacks(0, false));
+    xthread::StackTrimStats stats;
+    xthread::get_stack_trim_stats(&stats);
+    EXPECT_GE(stats.npasses, 3UL);
+    EXPECT_GE(stats.ntrimmed, N);
+    EXPECT_GE(stats.ncached_trimmed, N);
+    xthread::StackContainer* sc = xthread::get_stack(xthread::StackType::STACK_TYPE_SMALL, entry);
+    ASSERT_TRUE(sc != NULL);
+    EXPECT_FALSE(sc->trimmed);
+    xthread::return_stack(sc);
+}
+
+TEST_F(StackTest, background_trimmer) {
+    xthread::StackTrimOptions options;
+    options.idle_time_us = 10000;
+    options.interval_us = 10000;
+    ASSERT_EQ(0, xthread::start_stack_trimmer(&options));
+    ASSERT_EQ(-1, xthread::start_stack_trimmer(&options));
+    xthread::StackTrimStats before;
+    xthread::get_stack_trim_stats(&before);
+    usleep(100000);
+    xthread::stop_stack_trimmer();
+    xthread::StackTrimStats after;
+    xthread::get_stack_trim_stats(&after);
+    EXPECT_GT(after.npasses, before.npasses);
+}
+
+// 析构时恢复一种栈的大小和guard大小, 并清除测试设置的环境变量, ASSERT提前返回时也不影响之后的测试
+struct StackConfigRestorer {
+    explicit StackConfigRestorer(int type)
+        : stacktype(type),
+          stacksize(xthread::get_stack_size(type)),
+          guardsize(xthread::get_guard_size(type)) {
+    }
+    ~StackConfigRestorer() {
+        unsetenv("XTHREAD_STACK_SIZE_SMALL");
+        unsetenv("XTHREAD_GUARD_SIZE_SMALL");
+        unsetenv("XTHREAD_MAX_CACHED_STACKS_LARGE");
+        EXPECT_EQ(0, xthread::set_stack_size(stacktype, stacksize));
+        EXPECT_EQ(0, xthread::set_guard_size(stacktype, guardsize));
+    }
+    int stacktype;
+    int stacksize;
+    int guardsize;
+};
+
+TEST_F(StackTest, runtime_stack_size) {
+    StackConfigRestorer restorer(xthread::StackType::STACK_TYPE_SMALL);
+    xthread::StackContainer* sc = xthread::get_stack(xthread::StackType::STACK_TYPE_SMALL, entry);
+    ASSERT_TRUE(sc != NULL);
+    xthread::return_stack(sc);
+
+    ASSERT_EQ(0, xthread::set_stack_size(xthread::StackType::STACK_TYPE_SMALL, 65536));
+    ASSERT_EQ(0, xthread::set_guard_size(xthread::StackType::STACK_TYPE_SMALL, 8192));
+    EXPECT_EQ(65536, xthread::get_stack_size(xthread::StackType::STACK_TYPE_SMALL));
+    EXPECT_EQ(8192, xthread::get_guard_size(xthread::StackType::STACK_TYPE_SMALL));
+    // 缓存中的旧栈不再被使用
+    sc = xthread::get_stack(xthread::StackType::STACK_TYPE_SMALL, entry);
+    ASSERT_TRUE(sc != NULL);
+    EXPECT_EQ(65536, sc->stacksize);
+    EXPECT_EQ(8192, sc->guardsize);
+    xthread::return_stack(sc);
+
+    EXPECT_EQ(-1, xthread::set_stack_size(xthread::StackType::STACK_TYPE_SMALL, 0));
+    EXPECT_EQ(-1, xthread::set_stack_size(xthread::StackType::STACK_TYPE_MAIN, 65536));
+    EXPECT_EQ(-1, xthread::set_guard_size(xthread::StackType::STACK_TYPE_SMALL, -1));
+    // 向上取整为页大小
+    ASSERT_EQ(0, xthread::set_stack_size(xthread::StackType::STACK_TYPE_SMALL, 65536 + 1));
+    EXPECT_EQ(65536 + getpagesize(), xthread::get_stack_size(xthread::StackType::STACK_TYPE_SMALL));
+
+    setenv("XTHREAD_STACK_SIZE_SMALL", "131072", 1);
+    setenv("XTHREAD_GUARD_SIZE_SMALL", "4096", 1);
+    setenv("XTHREAD_MAX_CACHED_STACKS_LARGE", "abc", 1);
+    EXPECT_EQ(1, xthread::load_stack_config_from_env());
+    EXPECT_EQ(131072, xthread::get_stack_size(xthread::StackType::STACK_TYPE_SMALL));
+    EXPECT_EQ(4096, xthread::get_guard_size(xthread::StackType::STACK_TYPE_SMALL));
+    // 非法的XTHREAD_MAX_CACHED_STACKS_LARGE被忽略, 不需要恢复
+}
+
+TEST_F(StackTest, class_stats) {
+    xthread::StackClassStats before;
+    ASSERT_EQ(0, xthread::get_stack_class_stats(xthread::StackType::STACK_TYPE_NORMAL, &before));
+    EXPECT_EQ(-1, xthread::get_stack_class_stats(xthread::StackType::STACK_TYPE_PTHREAD, &before));
+    const size_t N = 4;
+    std::vector<xthread::StackContainer*> stacks;
+    for (size_t i = 0; i < N; ++i) {
+        stacks.push_back(xthread::get_stack(xthread::StackType::STACK_TYPE_NORMAL, entry));
+        ASSERT_TRUE(stacks.back() != NULL);
+    }
+    xthread::StackClassStats stats;
+    ASSERT_EQ(0, xthread::get_stack_class_stats(xthread::StackType::STACK_TYPE_NORMAL, &stats));
+    EXPECT_EQ(before.nget + N, stats.nget);
+    EXPECT_GE(stats.nlive, N);
+    EXPECT_GE(stats.mapped_bytes, N * static_cast<uint64_t>(xthread::StackConfig::STACK_SIZE_NORMAL));
+    for (size_t i = 0; i < N; ++i) {
+        xthread::return_stack(stacks[i]);
+    }
+    ASSERT_EQ(0, xthread::get_stack_class_stats(xthread::StackType::STACK_TYPE_NORMAL, &stats));
+    EXPECT_GE(stats.npooled, N);
+    EXPECT_EQ(stats.nmmap - stats.nmunmap, stats.nlive + stats.npooled);
+}
@@ -0,0 +1,195 @@
+#include <gtest/gtest.h>
+#include <vector>
+#include <atomic>
+#include <pthread.h>
+#include <unistd.h>
+#include <time.h>
+#include "../common/task_control.h"
+#include "../common/task_group.h"
+int main(int argc, char **argv) {
+    testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
+
+class TaskGroupTest : public ::testing::Test {
+    protected:
+        TaskGroupTest() {
+
+        }
+        virtual ~TaskGroupTest() {
+
+        }
+        virtual void SetUp() {
+
+        }
+        virtual void TearDown() {
+
+        }
+};
+
+std::atomic<size_t> g_counter(0);
+
+void* add_one(void*) {
+    g_counter.fetch_add(1, std::memory_order_relaxed);
+    return NULL;
+}
+
+TEST_F(TaskGroupTest, start_from_foreign_thread) {
+    xthread::TaskControl control;
+    ASSERT_EQ(0, control.init(4));
+    g_counter.store(0);
+    const size_t N = 10000;
+    std::vector<xthread::TaskId> tids(N);
+    for (size_t i = 0; i < N; ++i) {
+        ASSERT_EQ(0, control.start_task(&tids[i], add_one, NULL));
+    }
+    for (size_t i = 0; i < N; ++i) {
+        ASSERT_EQ(0, xthread::TaskControl::join_task(tids[i]));
+    }
+    EXPECT_EQ(N, g_counter.load());
+    control.stop_and_join();
+}
+
+struct YieldArg {
+    xthread::TaskControl* control;
+    size_t nchild;
+    size_t nyield;
+    std::atomic<size_t> nrun;
+};
+
+void* yield_child(void* arg) {
+    YieldArg* ya = static_cast<YieldArg*>(arg);
+    for (size_t i = 0; i < ya->nyield; ++i) {
+        EXPECT_NE(xthread::INVALID_TASK_ID, xthread::TaskGroup::current_tid());
+        xthread::TaskGroup::yield();
+    }
+    ya->nrun.fetch_add(1, std::memory_order_relaxed);
+    return NULL;
+}
+
+void* spawn_children(void* arg) {
+    YieldArg* ya = static_cast<YieldArg*>(arg);
+    std::vector<xthread::TaskId> tids(ya->nchild);
+    for (size_t i = 0; i < ya->nchild; ++i) {
+        EXPECT_EQ(0, ya->control->start_task(&tids[i], yield_child, ya));
+    }
+    return NULL;
+}
+
+TEST_F(TaskGroupTest, spawn_in_task_and_yield) {
+    xthread::TaskControl control;
+    ASSERT_EQ(0, control.init(4));
+    YieldArg ya;
+    ya.control = &control;
+    ya.nchild = 1000;
+    ya.nyield = 10;
+    ya.nrun.store(0);
+    xthread::TaskId tid;
+    ASSERT_EQ(0, control.start_task(&tid, spawn_children, &ya));
+    ASSERT_EQ(0, xthread::TaskControl::join_task(tid));
+    while (ya.nrun.load() != ya.nchild) {
+        sched_yield();
+    }
+    control.stop_and_join();
+}
+
+TEST_F(TaskGroupTest, pthread_stack_type) {
+    xthread::TaskControl control;
+    ASSERT_EQ(0, control.init(2));
+    g_counter.store(0);
+    xthread::TaskId tid;
+    ASSERT_EQ(0, control.start_task(&tid, add_one, NULL, xthread::StackType::STACK_TYPE_PTHREAD));
+    ASSERT_EQ(0, xthread::TaskControl::join_task(tid));
+    EXPECT_EQ(1UL, g_counter.load());
+    // 已经结束的task再次join会立即返回
+    ASSERT_EQ(0, xthread::TaskControl::join_task(tid));
+    control.stop_and_join();
+}
+
+TEST_F(TaskGroupTest, steal_stats) {
+    xthread::TaskControl control;
+    ASSERT_EQ(0, control.init(4));
+    YieldArg ya;
+    ya.control = &control;
+    ya.nchild = 10000;
+    ya.nyield = 0;
+    ya.nrun.store(0);
+    xthread::TaskId tid;
+    ASSERT_EQ(0, control.start_task(&tid, spawn_children, &ya));
+    ASSERT_EQ(0, xthread::TaskControl::join_task(tid));
+    while (ya.nrun.load() != ya.nchild) {
+        sched_yield();
+    }
+    xthread::StealStats stats;
+    control.get_steal_stats(&stats);
+    EXPECT_GE(stats.nstolen, stats.nsuccess);
+    std::cout << "steal success=" << stats.nsuccess << " fail=" << stats.nfail
+        << " stolen=" << stats.nstolen << std::endl;
+    control.stop_and_join();
+}
+
+TEST_F(TaskGroupTest, idle_workers_park) {
+    xthread::TaskControl control;
+    ASSERT_EQ(0, control.init(4));
+    g_counter.store(0);
+    xthread::TaskId tid;
+    ASSERT_EQ(0, control.start_task(&tid, add_one, NULL));
+    ASSERT_EQ(0, xthread::TaskControl::join_task(tid));
+    usleep(10000);
+    // 空闲的工作线程在futex上等待, 不应该消耗CPU
+    timespec begin;
+    timespec end;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &begin);
+    usleep(200000);
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &end);
+    const long used_us = (end.tv_sec - begin.tv_sec) * 1000000L + (end.tv_nsec - begin.tv_nsec) / 1000L;
+    EXPECT_LT(used_us, 20000L);
+    // 唤醒之后仍然可以正常运行task
+    ASSERT_EQ(0, control.start_task(&tid, add_one, NULL));
+    ASSERT_EQ(0, xthread::TaskControl::join_task(tid));
+    EXPECT_EQ(2UL, g_counter.load());
+    control.stop_and_join();
+}
+
+void* yield_on_caller_stack(void* arg) {
+    YieldArg* ya = static_cast<YieldArg*>(arg);
+    const xthread::TaskId tid = xthread::TaskGroup::current_tid();
+    for (size_t i = 0; i < ya->nyield; ++i) {
+        xthread::TaskGroup::yield();
+        EXPECT_EQ(tid, xthread::TaskGroup::current_tid());
+    }
+    ya->nrun.fetch_add(1, std::memory_order_relaxed);
+    return NULL;
+}
+
+TEST_F(TaskGroupTest, pthread_stack_type_yield) {
+    xthread::TaskControl control;
+    ASSERT_EQ(0, control.init(4));
+    YieldArg ya;
+    ya.control = &control;
+    ya.nchild = 0;
+    ya.nyield = 5;
+    ya.nrun.store(0);
+    g_counter.store(0);
+    const size_t N = 1000;
+    std::vector<xthread::TaskId> tids(N);
+    // 一半不会挂起, 一半会yield, yield时切换到独立的栈上
+    for (size_t i = 0; i < N; ++i) {
+        if (i % 2 == 0) {
+            ASSERT_EQ(0, control.start_task(&tids[i], add_one, NULL, xthread::StackType::STACK_TYPE_PTHREAD));
+        }
+        else {
+            ASSERT_EQ(0, control.start_task(&tids[i], yield_on_caller_stack, &ya, xthread::StackType::STACK_TYPE_PTHREAD));
+        }
+    }
+    for (size_t i = 0; i < N; ++i) {
+        ASSERT_EQ(0, xthread::TaskControl::join_task(tids[i]));
+    }
+    EXPECT_EQ(N / 2, g_counter.load());
+    EXPECT_EQ(N / 2, ya.nrun.load());
+    xthread::InlineTaskStats stats;
+    control.get_inline_task_stats(&stats);
+    EXPECT_EQ(N / 2, stats.ninline);
+    EXPECT_EQ(N / 2, stats.npromoted);
+    control.stop_and_join();
+}
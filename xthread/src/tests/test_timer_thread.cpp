@@ -1,7 +1,14 @@
 #include <gtest/gtest.h>
 #include <vector>
+#include <algorithm>
 #include <pthread.h>
+#include <atomic>
+#include <limits>
+#include <unistd.h>
 #include "../common/timer_thread.h"
+#include "../common/task_control.h"
+#include "../common/task_group.h"
+#include "../common/task_meta.h"
 #include "../base/time.h"
 #include "../base/futex.h"
 int main(int argc, char **argv) {
@@ -103,7 +110,7 @@ namespace xthread {
 
         public:
             timespec expected_run_time_;
-            std::weak_ptr<TimerThread::Task> task_;
+            TimerThread::TaskId task_;
         private:
             const char* name_;
             int sleep_ms_;
@@ -138,3 +145,742 @@ namespace xthread {
         timer_thread.stop_and_join();
     }
 }
+
+namespace xthread {
+    struct WheelTask {
+        int64_t expected_us;
+        std::atomic<int64_t> run_us;
+    };
+
+    void wheel_routine(void* arg) {
+        WheelTask* t = static_cast<WheelTask*>(arg);
+        t->run_us.store(base::gettimeofday_us());
+    }
+
+    TEST_F(TimerThreadTest, TimingWheel)
+    {
+        TimerThread timer_thread;
+        TimerThreadOptions options;
+        options.engine = TimerThreadOptions::ENGINE_TIMING_WHEEL;
+        options.wheel_tick_us = 1000;
+        ASSERT_EQ(0, timer_thread.start(&options));
+
+        // 覆盖第0层, 第1层(>256ms)和已经过期的Task
+        const int64_t delays_ms[] = {-10, 0, 1, 5, 20, 100, 255, 256, 300, 700, 1200};
+        const size_t N = sizeof(delays_ms) / sizeof(delays_ms[0]);
+        WheelTask tasks[N];
+        WheelTask cancelled;
+        cancelled.run_us.store(0);
+        for (size_t i = 0; i < N; ++i) {
+            timespec abstime = base::milliseconds_from_now(delays_ms[i]);
+            tasks[i].expected_us = base::timespec_to_microseconds(abstime);
+            tasks[i].run_us.store(0);
+            timer_thread.schedule(wheel_routine, &tasks[i], abstime);
+        }
+        TimerThread::TaskId task = timer_thread.schedule(
+                wheel_routine, &cancelled, base::milliseconds_from_now(200));
+        EXPECT_EQ(0, timer_thread.unschedule(task));
+
+        usleep(1500000);
+        for (size_t i = 0; i < N; ++i) {
+            const int64_t run_us = tasks[i].run_us.load();
+            ASSERT_NE(0, run_us) << "delay=" << delays_ms[i];
+            EXPECT_GE(run_us, tasks[i].expected_us);
+            EXPECT_LE(run_us - tasks[i].expected_us, 50000);
+        }
+        EXPECT_EQ(0, cancelled.run_us.load());
+        timer_thread.stop_and_join();
+    }
+
+    TEST_F(TimerThreadTest, UnscheduleById)
+    {
+        TimerThread timer_thread;
+        ASSERT_EQ(0, timer_thread.start(NULL));
+        EXPECT_EQ(-1, timer_thread.unschedule(TimerThread::INVALID_TASK_ID));
+
+        WheelTask t1;
+        t1.run_us.store(0);
+        TimerThread::TaskId id1 = timer_thread.schedule(
+                wheel_routine, &t1, base::milliseconds_from_now(100));
+        ASSERT_NE(TimerThread::INVALID_TASK_ID, id1);
+        EXPECT_EQ(0, timer_thread.unschedule(id1));
+        EXPECT_EQ(-1, timer_thread.unschedule(id1));
+
+        WheelTask t2;
+        t2.run_us.store(0);
+        TimerThread::TaskId id2 = timer_thread.schedule(
+                wheel_routine, &t2, base::milliseconds_from_now(10));
+        ASSERT_NE(TimerThread::INVALID_TASK_ID, id2);
+        usleep(200000);
+        EXPECT_NE(0, t2.run_us.load());
+        EXPECT_EQ(0, t1.run_us.load());
+        // 执行完成之后slot被复用, 旧的id不能取消新的Task
+        EXPECT_EQ(-1, timer_thread.unschedule(id2));
+        WheelTask t3;
+        t3.run_us.store(0);
+        TimerThread::TaskId id3 = timer_thread.schedule(
+                wheel_routine, &t3, base::milliseconds_from_now(100));
+        EXPECT_NE(id2, id3);
+        EXPECT_EQ(-1, timer_thread.unschedule(id2));
+        EXPECT_EQ(-1, timer_thread.unschedule(id1));
+        EXPECT_EQ(0, timer_thread.unschedule(id3));
+        timer_thread.stop_and_join();
+    }
+
+    struct ScheduleArg {
+        TimerThread* timer_thread;
+        std::atomic<int>* nrun;
+        int index;
+    };
+
+    void count_routine(void* arg) {
+        static_cast<std::atomic<int>*>(arg)->fetch_add(1);
+    }
+
+    const int NSCHEDULER = 4;
+    const int NPER_SCHEDULER = 5000;
+
+    void* schedule_thread(void* arg) {
+        ScheduleArg* sa = static_cast<ScheduleArg*>(arg);
+        for (int i = 0; i < NPER_SCHEDULER; ++i) {
+            // 一部分Task比之前的更早到期, 会触发唤醒TimerThread
+            const int64_t delay_ms = (i * 7 + sa->index) % 50;
+            TimerThread::TaskId id = sa->timer_thread->schedule(
+                    count_routine, sa->nrun, base::milliseconds_from_now(delay_ms));
+            EXPECT_NE(TimerThread::INVALID_TASK_ID, id);
+        }
+        return NULL;
+    }
+
+    TEST_F(TimerThreadTest, ConcurrentSchedule)
+    {
+        TimerThread timer_thread;
+        ASSERT_EQ(0, timer_thread.start(NULL));
+        std::atomic<int> nrun(0);
+        pthread_t threads[NSCHEDULER];
+        ScheduleArg args[NSCHEDULER];
+        for (int i = 0; i < NSCHEDULER; ++i) {
+            args[i].timer_thread = &timer_thread;
+            args[i].nrun = &nrun;
+            args[i].index = i;
+            ASSERT_EQ(0, pthread_create(&threads[i], NULL, schedule_thread, &args[i]));
+        }
+        for (int i = 0; i < NSCHEDULER; ++i) {
+            pthread_join(threads[i], NULL);
+        }
+        for (int i = 0; i < 100 && nrun.load() != NSCHEDULER * NPER_SCHEDULER; ++i) {
+            usleep(10000);
+        }
+        EXPECT_EQ(NSCHEDULER * NPER_SCHEDULER, nrun.load());
+        timer_thread.stop_and_join();
+    }
+
+    void expect_cancelled_removed(int engine) {
+        TimerThread timer_thread;
+        TimerThreadOptions options;
+        options.engine = engine;
+        ASSERT_EQ(0, timer_thread.start(&options));
+
+        // 大部分超时都被取消, 取消之后不能一直留在Engine中
+        const int N = 10 * 1024 + 100;
+        std::atomic<int> nrun(0);
+        std::vector<TimerThread::TaskId> ids;
+        for (int i = 0; i < N; ++i) {
+            ids.push_back(timer_thread.schedule(count_routine, &nrun,
+                        base::milliseconds_from_now(10000 + i)));
+            ASSERT_NE(TimerThread::INVALID_TASK_ID, ids.back());
+        }
+        for (int i = 0; i < N; ++i) {
+            ASSERT_EQ(0, timer_thread.unschedule(ids[i]));
+        }
+        TimerThreadStats stats;
+        for (int i = 0; i < 100; ++i) {
+            timer_thread.get_stats(&stats);
+            if (stats.ncancelled_resident < 1024) {
+                break;
+            }
+            usleep(10000);
+        }
+        EXPECT_LT(stats.ncancelled_resident, 1024);
+
+        // 唤醒TimerThread之后剩下的也被移除
+        timer_thread.schedule(count_routine, &nrun, base::milliseconds_from_now(10));
+        for (int i = 0; i < 100; ++i) {
+            timer_thread.get_stats(&stats);
+            if (stats.ncancelled_resident == 0 && nrun.load() == 1) {
+                break;
+            }
+            usleep(10000);
+        }
+        EXPECT_EQ(0, stats.ncancelled_resident);
+        EXPECT_EQ(1, nrun.load());
+        timer_thread.stop_and_join();
+    }
+
+    TEST_F(TimerThreadTest, RemoveCancelledTasks)
+    {
+        expect_cancelled_removed(TimerThreadOptions::ENGINE_HEAP);
+        expect_cancelled_removed(TimerThreadOptions::ENGINE_TIMING_WHEEL);
+    }
+
+    struct ShardTask {
+        std::atomic<int> nrun;
+        std::atomic<pthread_t> thread;
+    };
+
+    void shard_routine(void* arg) {
+        ShardTask* t = static_cast<ShardTask*>(arg);
+        t->thread.store(pthread_self());
+        t->nrun.fetch_add(1);
+    }
+
+    struct ShardScheduleArg {
+        TimerThread* timer_thread;
+        ShardTask* tasks;
+        TimerThread::TaskId* ids;
+        int n;
+    };
+
+    void* shard_schedule_thread(void* arg) {
+        ShardScheduleArg* sa = static_cast<ShardScheduleArg*>(arg);
+        for (int i = 0; i < sa->n; ++i) {
+            // 偶数下标的Task之后会被取消, 到期时间足够远, 不会在取消之前执行
+            const int64_t ms = (i % 2 == 0 ? 10000 : 20 + i % 30);
+            sa->ids[i] = sa->timer_thread->schedule(shard_routine, &sa->tasks[i],
+                    base::milliseconds_from_now(ms));
+        }
+        return NULL;
+    }
+
+    TEST_F(TimerThreadTest, Shards)
+    {
+        TimerThread timer_thread;
+        TimerThreadOptions options;
+        options.num_shards = 3;
+        ASSERT_EQ(0, timer_thread.start(&options));
+
+        const int NTHREAD = 6;
+        const int N = 1000;
+        std::vector<ShardTask> tasks(NTHREAD * N);
+        std::vector<TimerThread::TaskId> ids(NTHREAD * N);
+        for (size_t i = 0; i < tasks.size(); ++i) {
+            tasks[i].nrun.store(0);
+            tasks[i].thread.store(0);
+        }
+        pthread_t threads[NTHREAD];
+        ShardScheduleArg args[NTHREAD];
+        for (int i = 0; i < NTHREAD; ++i) {
+            args[i].timer_thread = &timer_thread;
+            args[i].tasks = &tasks[i * N];
+            args[i].ids = &ids[i * N];
+            args[i].n = N;
+            ASSERT_EQ(0, pthread_create(&threads[i], NULL, shard_schedule_thread, &args[i]));
+        }
+        for (int i = 0; i < NTHREAD; ++i) {
+            pthread_join(threads[i], NULL);
+        }
+        // 在调度之外的线程中取消, 由Task所属的分片移除
+        for (size_t i = 0; i < ids.size(); i += 2) {
+            ASSERT_NE(TimerThread::INVALID_TASK_ID, ids[i]);
+            EXPECT_EQ(0, timer_thread.unschedule(ids[i]));
+        }
+        usleep(300000);
+        std::vector<pthread_t> run_threads;
+        for (size_t i = 0; i < tasks.size(); ++i) {
+            EXPECT_EQ(i % 2 == 0 ? 0 : 1, tasks[i].nrun.load());
+            if (tasks[i].nrun.load() != 0 &&
+                    std::find(run_threads.begin(), run_threads.end(), tasks[i].thread.load()) == run_threads.end()) {
+                run_threads.push_back(tasks[i].thread.load());
+            }
+        }
+        // 同一个调度线程的Task由同一个分片线程执行
+        for (int i = 0; i < NTHREAD; ++i) {
+            EXPECT_EQ(tasks[i * N + 1].thread.load(), tasks[i * N + N - 1].thread.load());
+        }
+        EXPECT_LE(run_threads.size(), options.num_shards);
+        TimerThreadStats stats;
+        timer_thread.get_stats(&stats);
+        EXPECT_EQ(0, stats.ncancelled_resident);
+        timer_thread.stop_and_join();
+    }
+
+    void slow_routine(void* arg) {
+        usleep(200000);
+        static_cast<WheelTask*>(arg)->run_us.store(base::gettimeofday_us());
+    }
+
+    TEST_F(TimerThreadTest, PthreadPoolExecutor)
+    {
+        TimerThread timer_thread;
+        TimerThreadOptions options;
+        options.executor = TimerThreadOptions::EXECUTOR_PTHREAD_POOL;
+        options.executor_threads = 2;
+        options.slow_callback_us = 100000;
+        ASSERT_EQ(0, timer_thread.start(&options));
+
+        // 慢回调不能推迟之后到期的Task
+        WheelTask slow;
+        slow.run_us.store(0);
+        WheelTask fast;
+        fast.run_us.store(0);
+        timer_thread.schedule(slow_routine, &slow, base::milliseconds_from_now(10));
+        timespec abstime = base::milliseconds_from_now(50);
+        fast.expected_us = base::timespec_to_microseconds(abstime);
+        timer_thread.schedule(wheel_routine, &fast, abstime);
+
+        usleep(400000);
+        ASSERT_NE(0, fast.run_us.load());
+        ASSERT_NE(0, slow.run_us.load());
+        EXPECT_LE(fast.run_us.load() - fast.expected_us, 50000);
+        EXPECT_LT(fast.run_us.load(), slow.run_us.load());
+        TimerThreadStats stats;
+        timer_thread.get_stats(&stats);
+        EXPECT_EQ(1, stats.nslow_callbacks);
+        EXPECT_GE(stats.max_callback_us, 200000);
+        timer_thread.stop_and_join();
+    }
+
+    struct XthreadTimerTask {
+        std::atomic<int> nrun;
+        std::atomic<int> nin_worker;
+    };
+
+    void xthread_timer_routine(void* arg) {
+        XthreadTimerTask* t = static_cast<XthreadTimerTask*>(arg);
+        if (get_current_task_group() != NULL) {
+            t->nin_worker.fetch_add(1);
+        }
+        t->nrun.fetch_add(1);
+    }
+
+    TEST_F(TimerThreadTest, XthreadExecutor)
+    {
+        TaskControl control;
+        ASSERT_EQ(0, control.init(2));
+        TimerThread timer_thread;
+        TimerThreadOptions options;
+        options.executor = TimerThreadOptions::EXECUTOR_XTHREAD;
+        options.task_control = &control;
+        ASSERT_EQ(0, timer_thread.start(&options));
+
+        XthreadTimerTask t;
+        t.nrun.store(0);
+        t.nin_worker.store(0);
+        const int N = 100;
+        for (int i = 0; i < N; ++i) {
+            timer_thread.schedule(xthread_timer_routine, &t, base::milliseconds_from_now(i % 20));
+        }
+        for (int i = 0; i < 100 && t.nrun.load() != N; ++i) {
+            usleep(10000);
+        }
+        EXPECT_EQ(N, t.nrun.load());
+        EXPECT_EQ(N, t.nin_worker.load());
+        timer_thread.stop_and_join();
+        control.stop_and_join();
+    }
+
+    struct SlowTimerTask {
+        std::atomic<int> nstarted;
+        std::atomic<int> ninside;
+    };
+
+    void slow_timer_routine(void* arg) {
+        SlowTimerTask* t = static_cast<SlowTimerTask*>(arg);
+        t->nstarted.fetch_add(1);
+        t->ninside.fetch_add(1);
+        usleep(2000);
+        t->ninside.fetch_sub(1);
+    }
+
+    TEST_F(TimerThreadTest, DestroyWithPendingXthreadCallbacks)
+    {
+        TaskControl control;
+        ASSERT_EQ(0, control.init(1));
+        SlowTimerTask t;
+        t.nstarted.store(0);
+        t.ninside.store(0);
+        TimerThread* timer_thread = new TimerThread;
+        TimerThreadOptions options;
+        options.executor = TimerThreadOptions::EXECUTOR_XTHREAD;
+        options.task_control = &control;
+        ASSERT_EQ(0, timer_thread->start(&options));
+        // 回调比到期的速度慢, 析构时TaskControl中还有没执行的batch
+        const int N = 200;
+        for (int i = 0; i < N; ++i) {
+            timer_thread->schedule_after(slow_timer_routine, &t, 0);
+        }
+        // 周期Task执行之后还要访问分片
+        timer_thread->schedule_periodic(slow_timer_routine, &t, 1000000, TimerThread::PERIODIC_FIXED_RATE);
+        while (t.nstarted.load() == 0) {
+            usleep(1000);
+        }
+        delete timer_thread;
+        // 析构返回之前已经提交的回调都执行完成, 之后不再有回调
+        EXPECT_EQ(0, t.ninside.load());
+        const int nstarted = t.nstarted.load();
+        usleep(50000);
+        EXPECT_EQ(nstarted, t.nstarted.load());
+        control.stop_and_join();
+    }
+
+    TEST_F(TimerThreadTest, DestroyAfterTaskControlStopped)
+    {
+        TaskControl control;
+        ASSERT_EQ(0, control.init(1));
+        SlowTimerTask t;
+        t.nstarted.store(0);
+        t.ninside.store(0);
+        TimerThread* timer_thread = new TimerThread;
+        TimerThreadOptions options;
+        options.executor = TimerThreadOptions::EXECUTOR_XTHREAD;
+        options.task_control = &control;
+        ASSERT_EQ(0, timer_thread->start(&options));
+        const int N = 200;
+        for (int i = 0; i < N; ++i) {
+            timer_thread->schedule_after(slow_timer_routine, &t, 0);
+        }
+        // 等所有Task都提交给TaskControl
+        TimerThreadStats stats;
+        for (int i = 0; i < 500; ++i) {
+            timer_thread->get_stats(&stats);
+            if (stats.nfired == N) {
+                break;
+            }
+            usleep(1000);
+        }
+        ASSERT_EQ(N, stats.nfired);
+        // TaskControl丢弃的batch在析构时由当前线程执行, 不能一直等待
+        control.stop_and_join();
+        delete timer_thread;
+        EXPECT_EQ(0, t.ninside.load());
+        EXPECT_EQ(N, t.nstarted.load());
+    }
+
+    struct StopInWorkerArg {
+        TimerThread* timer_thread;
+        std::atomic<int> nrun;
+        std::atomic<int> stopped;
+    };
+
+    void stop_in_worker_routine(void* arg) {
+        static_cast<StopInWorkerArg*>(arg)->nrun.fetch_add(1);
+    }
+
+    void* stop_in_worker_task(void* arg) {
+        StopInWorkerArg* a = static_cast<StopInWorkerArg*>(arg);
+        // 到期的batch投递回当前工作线程, 在这个task结束之前不会执行
+        a->timer_thread->schedule_after(stop_in_worker_routine, a, 0);
+        usleep(50000);
+        a->timer_thread->stop_and_join();
+        a->stopped.store(1);
+        return NULL;
+    }
+
+    TEST_F(TimerThreadTest, StopInXthreadWorker)
+    {
+        TaskControl control;
+        ASSERT_EQ(0, control.init(1));
+        TimerThread timer_thread;
+        TimerThreadOptions options;
+        options.executor = TimerThreadOptions::EXECUTOR_XTHREAD;
+        options.task_control = &control;
+        ASSERT_EQ(0, timer_thread.start(&options));
+        StopInWorkerArg a;
+        a.timer_thread = &timer_thread;
+        a.nrun.store(0);
+        a.stopped.store(0);
+        TaskId tid;
+        ASSERT_EQ(0, control.start_task(&tid, stop_in_worker_task, &a));
+        for (int i = 0; i < 200 && (a.stopped.load() == 0 || a.nrun.load() == 0); ++i) {
+            usleep(10000);
+        }
+        EXPECT_EQ(1, a.stopped.load());
+        EXPECT_EQ(1, a.nrun.load());
+        timer_thread.stop_and_join();
+        control.stop_and_join();
+    }
+
+    void noop_routine(void*) {
+    }
+
+    void expect_tasks_released(int engine) {
+        const int N = 100;
+        const int64_t delay_ns = 3600LL * 1000000000LL;
+        TimerThreadOptions options;
+        options.engine = engine;
+        std::vector<TimerThread::TaskId> old_ids;
+        {
+            TimerThread timer_thread;
+            ASSERT_EQ(0, timer_thread.start(&options));
+            for (int i = 0; i < N; ++i) {
+                old_ids.push_back(timer_thread.schedule_after(noop_routine, NULL, delay_ns));
+                ASSERT_NE(TimerThread::INVALID_TASK_ID, old_ids.back());
+            }
+            // 等分片线程把Task放入Engine, 之后的Task留在Bucket中
+            usleep(50000);
+            for (int i = 0; i < N; ++i) {
+                old_ids.push_back(timer_thread.schedule_after(noop_routine, NULL, delay_ns));
+                ASSERT_NE(TimerThread::INVALID_TASK_ID, old_ids.back());
+            }
+            // 一部分在取消链表中
+            for (size_t i = 0; i < old_ids.size(); i += 3) {
+                ASSERT_EQ(0, timer_thread.unschedule(old_ids[i]));
+            }
+        }
+        // 析构时归还了所有的Task, 新的Task复用原来的slot
+        std::vector<uint64_t> old_slots;
+        for (size_t i = 0; i < old_ids.size(); ++i) {
+            old_slots.push_back(get_task_slot(old_ids[i]));
+        }
+        std::sort(old_slots.begin(), old_slots.end());
+        TimerThread timer_thread;
+        ASSERT_EQ(0, timer_thread.start(&options));
+        std::vector<TimerThread::TaskId> new_ids;
+        for (size_t i = 0; i < old_ids.size(); ++i) {
+            new_ids.push_back(timer_thread.schedule_after(noop_routine, NULL, delay_ns));
+            ASSERT_NE(TimerThread::INVALID_TASK_ID, new_ids.back());
+            EXPECT_TRUE(std::binary_search(old_slots.begin(), old_slots.end(),
+                        get_task_slot(new_ids.back())));
+        }
+        // 之前的TaskId失效
+        for (size_t i = 0; i < old_ids.size(); ++i) {
+            EXPECT_EQ(-1, timer_thread.unschedule(old_ids[i]));
+        }
+        timer_thread.stop_and_join();
+    }
+
+    TEST_F(TimerThreadTest, DestroyReleasesPendingTasks)
+    {
+        expect_tasks_released(TimerThreadOptions::ENGINE_HEAP);
+        expect_tasks_released(TimerThreadOptions::ENGINE_TIMING_WHEEL);
+    }
+
+    struct MonotonicTask {
+        int64_t expected_ns;
+        std::atomic<int64_t> run_ns;
+    };
+
+    void monotonic_routine(void* arg) {
+        static_cast<MonotonicTask*>(arg)->run_ns.store(base::monotonic_time_ns());
+    }
+
+    void expect_schedule_after(bool use_tsc) {
+        TimerThread timer_thread;
+        TimerThreadOptions options;
+        options.use_tsc = use_tsc;
+        ASSERT_EQ(0, timer_thread.start(&options));
+        const int64_t delays_ns[] = {0, 1000000, 5000000, 20000000, 100000000};
+        const size_t N = sizeof(delays_ns) / sizeof(delays_ns[0]);
+        MonotonicTask tasks[N];
+        for (size_t i = 0; i < N; ++i) {
+            tasks[i].run_ns.store(0);
+            tasks[i].expected_ns = base::monotonic_time_ns() + delays_ns[i];
+            ASSERT_NE(TimerThread::INVALID_TASK_ID,
+                    timer_thread.schedule_after(monotonic_routine, &tasks[i], delays_ns[i]));
+        }
+        usleep(300000);
+        for (size_t i = 0; i < N; ++i) {
+            const int64_t run_ns = tasks[i].run_ns.load();
+            ASSERT_NE(0, run_ns) << "delay=" << delays_ns[i];
+            // TSC和CLOCK_MONOTONIC之间允许有微秒级的误差
+            EXPECT_GE(run_ns - tasks[i].expected_ns, use_tsc ? -100000 : 0);
+            EXPECT_LE(run_ns - tasks[i].expected_ns, 50000000);
+        }
+        timer_thread.stop_and_join();
+    }
+
+    TEST_F(TimerThreadTest, ScheduleAfter)
+    {
+        expect_schedule_after(false);
+        expect_schedule_after(true);
+        if (base::has_invariant_tsc()) {
+            const int64_t diff = base::cpuwide_time_ns() - base::monotonic_time_ns();
+            EXPECT_LT(diff < 0 ? -diff : diff, 1000000);
+        }
+    }
+
+    TEST_F(TimerThreadTest, TscToNs)
+    {
+        const int64_t freq = 3000000000L;
+        const uint64_t base = 1000000000000ULL;
+        const int64_t base_ns = 5000000000L;
+        EXPECT_EQ(base_ns, base::detail::tsc_to_ns(base, base, base_ns, freq));
+        EXPECT_EQ(base_ns + 1000000000L, base::detail::tsc_to_ns(base + freq, base, base_ns, freq));
+        EXPECT_EQ(base_ns + 1500000000L, base::detail::tsc_to_ns(base + freq * 3 / 2, base, base_ns, freq));
+        // 其他CPU上的TSC比校准时的读数略小: 不能回绕成很大的值
+        EXPECT_EQ(base_ns - 1000, base::detail::tsc_to_ns(base - 3000, base, base_ns, freq));
+        EXPECT_EQ(base_ns - 2000000000L, base::detail::tsc_to_ns(base - 2 * freq, base, base_ns, freq));
+        // 一小时之后的换算不溢出
+        EXPECT_EQ(base_ns + 3600 * 1000000000L, base::detail::tsc_to_ns(base + 3600 * freq, base, base_ns, freq));
+    }
+
+    void expect_huge_delay_not_run(int engine) {
+        TimerThread timer_thread;
+        TimerThreadOptions options;
+        options.engine = engine;
+        options.slack_ns = 1000000;
+        ASSERT_EQ(0, timer_thread.start(&options));
+        std::atomic<int> nrun(0);
+        // now + delay_ns溢出时不能变成已经到期
+        TimerThread::TaskId id = timer_thread.schedule_after(count_routine, &nrun,
+                std::numeric_limits<int64_t>::max());
+        ASSERT_NE(TimerThread::INVALID_TASK_ID, id);
+        TimerThread::TaskId periodic_id = timer_thread.schedule_periodic(count_routine, &nrun,
+                std::numeric_limits<int64_t>::max() - 1, TimerThread::PERIODIC_FIXED_RATE);
+        ASSERT_NE(TimerThread::INVALID_TASK_ID, periodic_id);
+        usleep(50000);
+        EXPECT_EQ(0, nrun.load());
+        EXPECT_EQ(0, timer_thread.unschedule(id));
+        EXPECT_EQ(0, timer_thread.unschedule(periodic_id));
+        timer_thread.stop_and_join();
+    }
+
+    TEST_F(TimerThreadTest, ScheduleAfterHugeDelay)
+    {
+        expect_huge_delay_not_run(TimerThreadOptions::ENGINE_HEAP);
+        expect_huge_delay_not_run(TimerThreadOptions::ENGINE_TIMING_WHEEL);
+    }
+
+    TEST_F(TimerThreadTest, Slack)
+    {
+        TimerThread timer_thread;
+        TimerThreadOptions options;
+        options.slack_ns = 20000000;
+        ASSERT_EQ(0, timer_thread.start(&options));
+
+        // 每2ms到期一个, 20ms的slack内到期的Task合并为一次唤醒
+        const size_t N = 100;
+        MonotonicTask tasks[N];
+        const int64_t begin_ns = base::monotonic_time_ns();
+        for (size_t i = 0; i < N; ++i) {
+            tasks[i].run_ns.store(0);
+            const int64_t delay_ns = 10000000 + static_cast<int64_t>(i) * 2000000;
+            tasks[i].expected_ns = begin_ns + delay_ns;
+            timer_thread.schedule_after(monotonic_routine, &tasks[i],
+                    tasks[i].expected_ns - base::monotonic_time_ns());
+        }
+        usleep(400000);
+        for (size_t i = 0; i < N; ++i) {
+            const int64_t run_ns = tasks[i].run_ns.load();
+            ASSERT_NE(0, run_ns);
+            EXPECT_GE(run_ns, tasks[i].expected_ns);
+            EXPECT_LE(run_ns - tasks[i].expected_ns, options.slack_ns + 20000000);
+        }
+        TimerThreadStats stats;
+        timer_thread.get_stats(&stats);
+        EXPECT_EQ(static_cast<int64_t>(N), stats.nfired);
+        EXPECT_LE(stats.nbatches, 25);
+        EXPECT_GE(stats.mean_batch_size, 4.0);
+        timer_thread.stop_and_join();
+    }
+
+    struct PeriodicTask {
+        TimerThread* timer_thread;
+        TimerThread::TaskId task_id;
+        std::atomic<int> nrun;
+        int sleep_ms;
+        // 执行到第cancel_at次时在回调中取消自己
+        int cancel_at;
+        int cancel_ret;
+    };
+
+    void periodic_routine(void* arg) {
+        PeriodicTask* task = static_cast<PeriodicTask*>(arg);
+        const int nrun = task->nrun.fetch_add(1) + 1;
+        if (task->sleep_ms > 0) {
+            usleep(task->sleep_ms * 1000);
+        }
+        if (nrun == task->cancel_at) {
+            task->cancel_ret = task->timer_thread->unschedule(task->task_id);
+        }
+    }
+
+    TEST_F(TimerThreadTest, Periodic)
+    {
+        TimerThread timer_thread;
+        ASSERT_EQ(0, timer_thread.start(NULL));
+        PeriodicTask tasks[3];
+        for (size_t i = 0; i < 3; ++i) {
+            tasks[i].timer_thread = &timer_thread;
+            tasks[i].nrun.store(0);
+            tasks[i].sleep_ms = 0;
+            tasks[i].cancel_at = -1;
+            tasks[i].cancel_ret = -2;
+        }
+        // 回调耗时5ms: FIXED_RATE仍然每10ms执行一次, FIXED_DELAY每15ms执行一次
+        tasks[0].sleep_ms = 5;
+        tasks[1].sleep_ms = 5;
+        tasks[2].cancel_at = 3;
+        ASSERT_EQ(TimerThread::INVALID_TASK_ID,
+                timer_thread.schedule_periodic(periodic_routine, &tasks[0], 0, TimerThread::PERIODIC_FIXED_RATE));
+        tasks[0].task_id = timer_thread.schedule_periodic(periodic_routine, &tasks[0],
+                10000000, TimerThread::PERIODIC_FIXED_RATE);
+        tasks[1].task_id = timer_thread.schedule_periodic(periodic_routine, &tasks[1],
+                10000000, TimerThread::PERIODIC_FIXED_DELAY);
+        tasks[2].task_id = timer_thread.schedule_periodic(periodic_routine, &tasks[2],
+                10000000, TimerThread::PERIODIC_FIXED_RATE);
+        for (size_t i = 0; i < 3; ++i) {
+            ASSERT_NE(TimerThread::INVALID_TASK_ID, tasks[i].task_id);
+        }
+        usleep(305000);
+        const int nrate = tasks[0].nrun.load();
+        const int ndelay = tasks[1].nrun.load();
+        EXPECT_GE(nrate, 22);
+        EXPECT_LE(nrate, 31);
+        EXPECT_GE(ndelay, 12);
+        EXPECT_LE(ndelay, 21);
+        EXPECT_LT(ndelay, nrate);
+
+        // 在回调中取消返回1, 之后不再执行
+        EXPECT_EQ(1, tasks[2].cancel_ret);
+        EXPECT_EQ(3, tasks[2].nrun.load());
+        EXPECT_EQ(-1, timer_thread.unschedule(tasks[2].task_id));
+
+        // 多次执行之后仍然可以用同一个id取消
+        for (size_t i = 0; i < 2; ++i) {
+            const int ret = timer_thread.unschedule(tasks[i].task_id);
+            EXPECT_TRUE(ret == 0 || ret == 1);
+            EXPECT_EQ(-1, timer_thread.unschedule(tasks[i].task_id));
+        }
+        usleep(20000);
+        const int nrate_stopped = tasks[0].nrun.load();
+        const int ndelay_stopped = tasks[1].nrun.load();
+        usleep(50000);
+        EXPECT_EQ(nrate_stopped, tasks[0].nrun.load());
+        EXPECT_EQ(ndelay_stopped, tasks[1].nrun.load());
+        timer_thread.stop_and_join();
+    }
+
+    TEST_F(TimerThreadTest, LatenessStats)
+    {
+        TimerThread timer_thread;
+        ASSERT_EQ(0, timer_thread.start(NULL));
+        const size_t N = 100;
+        MonotonicTask tasks[N];
+        for (size_t i = 0; i < N; ++i) {
+            tasks[i].run_ns.store(0);
+            tasks[i].expected_ns = base::monotonic_time_ns() + 100000000;
+            timer_thread.schedule_after(monotonic_routine, &tasks[i], 100000000);
+        }
+        usleep(50000);
+        TimerThreadStats stats;
+        timer_thread.get_stats(&stats);
+        EXPECT_EQ(static_cast<int64_t>(N), stats.queue_depth);
+        EXPECT_EQ(0, stats.lateness_percentile_us(0.99));
+
+        usleep(150000);
+        timer_thread.get_stats(&stats);
+        EXPECT_EQ(0, stats.queue_depth);
+        int64_t total = 0;
+        for (int i = 0; i < TimerThreadStats::LATENESS_BUCKET_NUM; ++i) {
+            total += stats.lateness_hist[i];
+        }
+        EXPECT_EQ(stats.nfired, total);
+        EXPECT_EQ(static_cast<int64_t>(N), total);
+        const int64_t p50 = stats.lateness_percentile_us(0.5);
+        EXPECT_GT(p50, 0);
+        EXPECT_LE(p50, stats.lateness_percentile_us(0.999));
+        EXPECT_LE(stats.lateness_percentile_us(0.999), 65536);
+        timer_thread.stop_and_join();
+    }
+}
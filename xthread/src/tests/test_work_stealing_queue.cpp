@@ -119,3 +119,127 @@ TEST_F(test_wsq_suite, sanity) {
     ASSERT_EQ(N-1, stolen[N-1]);
     std::cout << "stolen=" << nstolen << " popped=" << npopped << " left=" << (N - nstolen - npopped)  << std::endl;
 }
+
+std::atomic<bool> owner_done(false);
+
+void* batch_steal_thread(void* arg) {
+    std::vector<value_type> *stolen = new std::vector<value_type>;
+    stolen->reserve(N);
+    xthread::WorkStealingQueue<value_type> *q = static_cast<xthread::WorkStealingQueue<value_type>* >(arg);
+    value_type vals[16];
+    while (!owner_done.load(std::memory_order_relaxed)) {
+        size_t n = q->steal_batch(vals, ARRAY_SIZE(vals));
+        for (size_t i = 0; i < n; ++i) {
+            stolen->push_back(vals[i]);
+        }
+        if (n == 0) {
+            asm volatile("pause\n": : :"memory");
+        }
+    }
+    return stolen;
+}
+
+// 拥有者线程不加锁地push/pop, 其他线程批量偷取, 每个值只能被取走一次
+void* owner_thread(void* arg) {
+    std::vector<value_type> *popped = new std::vector<value_type>;
+    popped->reserve(N);
+    xthread::WorkStealingQueue<value_type> *q =
+        static_cast<xthread::WorkStealingQueue<value_type>*>(arg);
+    value_type val;
+    for (size_t i = 0; i < N; ++i) {
+        while (!q->push(i)) {
+            if (q->pop(&val)) {
+                popped->push_back(val);
+            }
+        }
+        if (i % 3 == 0 && q->pop(&val)) {
+            popped->push_back(val);
+        }
+    }
+    while (q->pop(&val)) {
+        popped->push_back(val);
+    }
+    owner_done.store(true, std::memory_order_relaxed);
+    return popped;
+}
+
+TEST_F(test_wsq_suite, steal_batch) {
+    xthread::WorkStealingQueue<value_type> q;
+    ASSERT_EQ(true, q.init(1024));
+    pthread_t rth[4];
+    pthread_t owner;
+    for (size_t i = 0; i < ARRAY_SIZE(rth); ++i) {
+        ASSERT_EQ(0, pthread_create(&rth[i], NULL, batch_steal_thread, &q));
+    }
+    ASSERT_EQ(0, pthread_create(&owner, NULL, owner_thread, &q));
+
+    std::vector<value_type> all;
+    all.reserve(N);
+    std::vector<value_type>* res = NULL;
+    pthread_join(owner, reinterpret_cast<void**>(&res));
+    all.insert(all.end(), res->begin(), res->end());
+    const size_t npopped = res->size();
+    delete res;
+    for (size_t i = 0; i < ARRAY_SIZE(rth); ++i) {
+        pthread_join(rth[i], reinterpret_cast<void**>(&res));
+        all.insert(all.end(), res->begin(), res->end());
+        delete res;
+    }
+
+    std::sort(all.begin(), all.end());
+    ASSERT_EQ(N, all.size());
+    for (size_t i = 0; i < N; ++i) {
+        ASSERT_EQ(i, all[i]);
+    }
+    std::cout << "popped=" << npopped << " stolen=" << (N - npopped) << std::endl;
+}
+
+std::atomic<bool> grow_done(false);
+
+void* grow_steal_thread(void* arg) {
+    std::vector<value_type> *stolen = new std::vector<value_type>;
+    xthread::WorkStealingQueue<value_type> *q = static_cast<xthread::WorkStealingQueue<value_type>* >(arg);
+    value_type val;
+    while (!grow_done.load(std::memory_order_relaxed)) {
+        if (q->steal(&val)) {
+            stolen->push_back(val);
+        }
+    }
+    return stolen;
+}
+
+TEST_F(test_wsq_suite, growable) {
+    xthread::WorkStealingQueue<value_type> q;
+    ASSERT_EQ(true, q.init(3, true));
+    ASSERT_EQ(4UL, q.capacity());
+    pthread_t rth[4];
+    for (size_t i = 0; i < ARRAY_SIZE(rth); ++i) {
+        ASSERT_EQ(0, pthread_create(&rth[i], NULL, grow_steal_thread, &q));
+    }
+    std::vector<value_type> all;
+    all.reserve(N);
+    value_type val;
+    // 拥有者只push不pop, 队列必须不断扩容
+    for (size_t i = 0; i < N; ++i) {
+        ASSERT_TRUE(q.push(i));
+        if (i % 1000 == 0 && q.pop(&val)) {
+            all.push_back(val);
+        }
+    }
+    while (q.pop(&val)) {
+        all.push_back(val);
+    }
+    grow_done.store(true, std::memory_order_relaxed);
+    for (size_t i = 0; i < ARRAY_SIZE(rth); ++i) {
+        std::vector<value_type>* res = NULL;
+        pthread_join(rth[i], reinterpret_cast<void**>(&res));
+        all.insert(all.end(), res->begin(), res->end());
+        delete res;
+    }
+    std::sort(all.begin(), all.end());
+    ASSERT_EQ(N, all.size());
+    for (size_t i = 0; i < N; ++i) {
+        ASSERT_EQ(i, all[i]);
+    }
+    std::cout << "capacity=" << q.capacity() << std::endl;
+}